@@ -5,6 +5,10 @@
 
 #include <Luna/vmm/vm.hpp>
 
+#include <Luna/cpu/cpu.hpp>
+#include <std/mutex.hpp>
+#include <std/vector.hpp>
+
 namespace npt {
     struct [[gnu::packed]] page_entry {
         uint64_t present : 1;
@@ -65,12 +69,31 @@ namespace npt {
 
         uint8_t get_levels() const { return levels; }
 
+        // Bumped every time a mapping changes, so VCPUs know to flush their TLB
+        uint64_t get_generation() const { return __atomic_load_n(&generation, __ATOMIC_SEQ_CST); }
+
+        // A VCPU running on this context, in_guest is set before it reads the generation it enters with, and cleared after vmrun returns
+        // Mappings that are removed or lose permissions can't wait for the lazy flush, the frame might be freed right after,
+        // so those kick every user that's in the guest with an older generation out with an IPI, and wait for it to leave
+        struct User {
+            uint64_t generation = 0;
+            uint32_t lapic_id = 0;
+            bool in_guest = false;
+        };
+        void add_user(User* user);
+        void remove_user(User* user);
+
         private:
         page_entry* walk(uintptr_t va, bool create_new_tables);
+        void shootdown(uint64_t generation);
 
         uint8_t levels;
         uint32_t asid;
 
         uintptr_t root_pa;
+        uint64_t generation = 0;
+
+        TicketLock users_lock{};
+        std::vector<User*> users;
     };
 } // namespace npt
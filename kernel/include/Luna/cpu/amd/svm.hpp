@@ -39,6 +39,25 @@ namespace svm {
         uint64_t raw;
     };
 
+    namespace clean {
+        enum {
+            Intercepts = (1 << 0), // Intercept vectors, TSC offset, Pause filter
+            IOPM = (1 << 1), // IOPM and MSRPM base
+            Asid = (1 << 2),
+            Tpr = (1 << 3), // V_TPR, V_IRQ and friends
+            Npt = (1 << 4), // NPT enable, nCR3 and gPAT
+            Cr = (1 << 5), // CR0, CR3, CR4 and EFER
+            Dr = (1 << 6), // DR6 and DR7
+            Dt = (1 << 7), // GDTR and IDTR
+            Seg = (1 << 8), // CS, DS, SS, ES and CPL
+            Cr2 = (1 << 9),
+            Lbr = (1 << 10),
+            Avic = (1 << 11),
+
+            All = 0xFFF
+        };
+    } // namespace clean
+
     constexpr size_t io_bitmap_size = 3;
     constexpr size_t msr_bitmap_size = 2;
 
@@ -216,5 +235,11 @@ namespace svm {
 
         uint8_t* io_bitmap, *msr_bitmap;
         uintptr_t io_bitmap_pa, msr_bitmap_pa;
+
+
+        uint32_t dirty = clean::All; // VMCB areas that were modified since the last vmrun
+        uint32_t last_cpu = ~0u;
+        uint64_t npt_generation = 0;
+        npt::context::User npt_user{};
     };
 } // namespace svm
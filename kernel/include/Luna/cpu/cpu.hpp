@@ -20,6 +20,7 @@ namespace cpu {
     bool cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d);
 
     uint64_t rdtsc();
+    uint64_t tsc_ticks_per_ms();
 
     void early_init(); // Cannot access per_cpu struct
     void init(); // Can access per_cpu struct
@@ -63,16 +64,22 @@ struct CpuData {
         struct {
             uint8_t ept_levels;
             bool ept_dirty_accessed;
+
+            bool preemption_timer;
+            uint8_t preemption_timer_shift;
         } vmx;
 
         struct {
             uint32_t n_asids;
             std::lazy_initializer<svm::AsidManager> asid_manager;
+
+            bool nrip_save, vmcb_clean, flush_by_asid, decode_assists;
         } svm;
     } cpu;
 
     struct {
         size_t region_size, region_alignment;
+        uint64_t xcr0; // Host XCR0, 0 if XSAVE isn't used
         void (*store)(uint8_t* context);
         void (*load)(const uint8_t* context);
     } simd_data;
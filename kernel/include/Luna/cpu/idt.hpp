@@ -60,6 +60,8 @@ namespace idt
     void load();
     void set_handler(uint8_t vector, const handler& h);
 
+    void dispatch(uint8_t vector); // Run the handler for an interrupt that was acknowledged without going through the IDT
+
     uint8_t allocate_vector();
     void reserve_vector(uint8_t vector);
 } // namespace idt
@@ -71,10 +71,11 @@ namespace vmx {
 
     enum class VMExitControls : uint32_t {
         LongMode = (1 << 9),
+        AckIntOnExit = (1 << 15),
         SaveIA32PAT = (1 << 18),
         LoadIA32PAT = (1 << 19),
         SaveIA32EFER = (1 << 20),
-        LoadIA32EFER = (1 << 21),
+        LoadIA32EFER = (1 << 21)
     };
     
     enum class VMEntryControls : uint32_t {
@@ -88,13 +89,17 @@ namespace vmx {
         ExtInt = 1,
         CPUID = 10,
         Hlt = 12,
+        Rdtsc = 16,
         Vmcall = 18,
         MovToCr = 28,
         PIO = 30,
         Rdmsr = 31,
         Wrmsr = 32,
         InvalidGuestState = 33,
-        EPTViolation = 48
+        EPTViolation = 48,
+        Rdtscp = 51,
+        PreemptionTimer = 52,
+        Xsetbv = 55
     };
 
     union [[gnu::packed]] InterruptionInfo {
@@ -123,6 +128,20 @@ namespace vmx {
         uint64_t raw;
     };
 
+    union [[gnu::packed]] CrQualification {
+        struct {
+            uint64_t cr : 4;
+            uint64_t type : 2; // 0: MOV to CR, 1: MOV from CR, 2: CLTS, 3: LMSW
+            uint64_t lmsw_memory : 1;
+            uint64_t reserved : 1;
+            uint64_t gpr : 4;
+            uint64_t reserved_0 : 4;
+            uint64_t lmsw_source : 16;
+            uint64_t reserved_1 : 32;
+        };
+        uint64_t raw;
+    };
+
     union [[gnu::packed]] EPTViolationQualification {
         struct {
             uint64_t r : 1;
@@ -218,6 +237,7 @@ namespace vmx {
     constexpr uint64_t guest_interruptibility_state = 0x4824;
     constexpr uint64_t guest_activity_state = 0x4826;
     constexpr uint64_t guest_smbase = 0x4828;
+    constexpr uint64_t guest_preemption_timer_value = 0x482E;
 
     constexpr uint64_t guest_intr_status = 0x810;
     constexpr uint64_t guest_pml_index = 0x812;
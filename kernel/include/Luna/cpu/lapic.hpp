@@ -39,6 +39,7 @@ namespace lapic
         void eoi();
 
         void start_timer(uint8_t vector, uint64_t ms, regs::LapicTimerModes mode, void (*poll)(uint64_t ms));
+        void send_ipi(uint32_t dest, uint8_t vector); // Fixed delivery, physical destination mode
 
         private:
         uint32_t read(uint32_t reg);
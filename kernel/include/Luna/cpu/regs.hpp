@@ -103,6 +103,22 @@ namespace cr4 {
     void write(uint64_t v);
 } // namespace cr4
 
+namespace xcr0 {
+    enum {
+        X87 = (1 << 0),
+        SSE = (1 << 1),
+        AVX = (1 << 2),
+        Opmask = (1 << 5),
+        ZmmHi256 = (1 << 6),
+        Hi16Zmm = (1 << 7),
+
+        AVX512 = Opmask | ZmmHi256 | Hi16Zmm
+    };
+
+    uint64_t read();
+    void write(uint64_t v);
+} // namespace xcr0
+
 namespace simd {
     struct [[gnu::packed]] FxState {
         uint16_t fcw, fsw;
@@ -139,6 +155,7 @@ namespace simd {
         void store();
         void load() const;
         FxState* data() { return (FxState*)_ctx; }
+        uint64_t& xstate_bv() { return *(uint64_t*)(_ctx + sizeof(FxState)); } // Only valid when XSAVE is in use
 
         private:
         uint8_t* _ctx;
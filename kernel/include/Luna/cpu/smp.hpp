@@ -8,4 +8,5 @@
 
 namespace smp {
     void start_cpus(stivale2::Parser& boot_info, void (*f)(stivale2_smp_info*));
+    size_t get_cpu_count();
 } // namespace smp
@@ -93,6 +93,11 @@ namespace rtl81x9 {
     } // namespace tcr
 
     namespace rcr {
+        constexpr uint32_t accept_all_physical = (1 << 0);
+        constexpr uint32_t accept_physical_match = (1 << 1);
+        constexpr uint32_t accept_multicast = (1 << 2);
+        constexpr uint32_t accept_broadcast = (1 << 3);
+
         constexpr uint32_t mxdma_unlimited = (0b111 << 8);
         constexpr uint32_t rxftr_none = (0b111 << 13);
     } // namespace rcr
@@ -143,6 +148,15 @@ namespace rtl81x9 {
         constexpr uint32_t udp_cs = (1u << 31);
     } // namespace tx_flags
     
+    namespace rx_flags {
+        constexpr uint32_t own = (1u << 31);
+        constexpr uint32_t eor = (1 << 30);
+        constexpr uint32_t fs = (1 << 29);
+        constexpr uint32_t ls = (1 << 28);
+
+        constexpr uint32_t length_mask = 0x3FFF; // Includes the FCS
+    } // namespace rx_flags
+
     constexpr size_t n_descriptor_sets = 256;
     constexpr size_t mtu = 1536;
 
@@ -156,11 +170,17 @@ namespace rtl81x9 {
         Nic(pci::Device& device, uint16_t did);
 
         bool send_packet(const net::Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload);
+        bool send_frame(const std::span<uint8_t>& frame);
+        void set_promiscuous(bool enable);
         net::Mac get_mac() const { return mac; }
 
         private:
+        uint8_t* tx_begin();
+        void tx_commit(size_t len, uint32_t offload);
+
         void handle_irq();
         void handle_tx_ok();
+        void handle_rx();
 
         iovmm::Iovmm mm;
         volatile Regs* regs;
@@ -174,6 +194,8 @@ namespace rtl81x9 {
         iovmm::Iovmm::Allocation tx_alloc, rx_alloc, tx_set_alloc, rx_set_alloc;
 
         net::Mac mac;
-        size_t tx_index;
+        size_t tx_index, rx_index;
+
+        TicketLock tx_lock{};
     };
 } // namespace rtl81x9
@@ -28,6 +28,15 @@ namespace uart {
             pio::outb(base, c);
         }
 
+        // Polled, returns false if nothing was received
+        bool getc(uint8_t& c) const {
+            if((pio::inb(base + 5) & (1 << 0)) == 0)
+                return false;
+
+            c = pio::inb(base);
+            return true;
+        }
+
         private:
         uint16_t base;
     };
@@ -51,11 +51,14 @@ namespace echfs {
         vfs::FileType get_type();
         size_t read(size_t offset, size_t count, uint8_t* data);
         size_t write(size_t offset, size_t count, uint8_t* data);
+        size_t read_sg(size_t offset, std::span<std::span<uint8_t>> segments);
         size_t get_size();
 
         void close();
 
         private:
+        size_t extent(size_t offset, size_t count, uint64_t& loc);
+
         size_t root_dir_index;
         DirectoryEntry entry;
 
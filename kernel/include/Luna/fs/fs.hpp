@@ -2,12 +2,14 @@
 
 #include <Luna/common.hpp>
 #include <Luna/fs/storage_dev.hpp>
+#include <Luna/fs/vfs.hpp>
 
 
 namespace fs {
     struct Partition {
         storage_dev::Device* device;
         size_t start_lba, n_sectors;
+        uint8_t type; // MBR partition type
 
         void read(size_t offset, size_t count, uint8_t* data) {
             device->read((device->driver.sector_size * start_lba) + offset, count, data);
@@ -18,5 +20,23 @@ namespace fs {
         }
     };
 
+    // Raw access to a Partition, or any other range of LBAs, as a File, so guest disks can be backed without a filesystem in between
+    // Offsets translate to device offsets with a single add, accesses are clamped to the range
+    struct PartitionFile : public vfs::File {
+        PartitionFile(const Partition& part): part{part} {}
+
+        vfs::FileType get_type() { return vfs::FileType::File; }
+        size_t read(size_t offset, size_t count, uint8_t* data);
+        size_t write(size_t offset, size_t count, uint8_t* data);
+        size_t get_size() { return part.n_sectors * part.device->driver.sector_size; }
+
+        void close() {}
+
+        private:
+        size_t clamp(size_t offset, size_t count);
+
+        Partition part;
+    };
+
     void probe_fs(Partition& part);
 } // namespace fs
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <Luna/fs/storage_dev.hpp>
+#include <Luna/fs/fs.hpp>
 
 namespace mbr {
     struct [[gnu::packed]] PartitionTable {
@@ -20,6 +21,8 @@ namespace mbr {
     };
 
     constexpr uint16_t magic = 0xAA55;
+    constexpr uint8_t guest_disk_type = 0xDA; // "Non-FS data", handed to the guest as a raw disk
 
     void parse_mbr(storage_dev::Device& dev);
+    bool get_partition(storage_dev::Device& dev, uint8_t i, fs::Partition& part); // Returns false if entry i is inactive or there's no valid MBR
 } // namespace mbr
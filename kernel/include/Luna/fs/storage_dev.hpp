@@ -25,6 +25,7 @@ namespace storage_dev {
     };
 
     void register_device(const DriverDevice& driver);
+    Device* get_device(size_t i); // nullptr if there are no more devices
 
     
 } // namespace fs
@@ -2,6 +2,7 @@
 
 #include <Luna/common.hpp>
 #include <std/unordered_map.hpp>
+#include <std/span.hpp>
 
 namespace vfs {
     enum class FileType { File, Directory };
@@ -13,6 +14,20 @@ namespace vfs {
         virtual size_t write(size_t offset, size_t count, uint8_t* data) = 0;
         virtual size_t get_size() = 0;
 
+        // Reads consecutive bytes starting at offset into each segment in turn, returns the amount of bytes read
+        virtual size_t read_sg(size_t offset, std::span<std::span<uint8_t>> segments) {
+            size_t progress = 0;
+            for(auto& segment : segments) {
+                auto n = read(offset + progress, segment.size(), segment.data());
+                progress += n;
+
+                if(n != segment.size())
+                    break;
+            }
+
+            return progress;
+        }
+
         virtual void close() = 0;
     };
 
@@ -8,9 +8,24 @@ namespace gui {
         Framebuffer(Vec2i pos, Vec2i size, uint8_t* fb): fb{(uint32_t*)fb}, pos{pos}, size{size} { }
 
         void redraw(Desktop& desktop, const Vec2i& parent_pos) {
-            for(int32_t y = 0; y < size.y; y++)
-                for(int32_t x = 0; x < size.x; x++)
-                    desktop.put_pixel(parent_pos + pos + Vec2i{x, y}, Colour{fb[x + y * size.y]});
+            redraw_lines(desktop, parent_pos, 0, size.y);
+        }
+
+        // Draws lines [y_start, y_end) into the backbuffer, clipped to the screen, returns the screen rect they ended up in
+        gpu::Rect redraw_lines(Desktop& desktop, const Vec2i& parent_pos, int32_t y_start, int32_t y_end) {
+            auto origin = parent_pos + pos;
+            const auto& screen = desktop.get_size();
+
+            auto x_end = min(size.x, (int32_t)screen.x - origin.x);
+            y_end = min(min(y_end, size.y), (int32_t)screen.y - origin.y);
+            if(x_end <= 0 || y_start >= y_end)
+                return {0, 0, 0, 0};
+
+            for(int32_t y = y_start; y < y_end; y++)
+                for(int32_t x = 0; x < x_end; x++)
+                    desktop.put_pixel(origin + Vec2i{x, y}, Colour{fb[x + y * size.x]});
+
+            return {(size_t)origin.x, (size_t)(origin.y + y_start), (size_t)x_end, (size_t)(y_end - y_start)};
         }
 
         private:
@@ -19,7 +34,7 @@ namespace gui {
     };
 
     struct FbWindow : public Widget {
-        FbWindow(Vec2i size, uint8_t* fb, const char* title): window{{450, 30}, {size.x + 10, size.y + 10}, title}, fb{{4, 8}, size, fb} {
+        FbWindow(Vec2i size, uint8_t* fb, const char* title): window{pos, {size.x + 10, size.y + 10}, title}, fb{{4, 8}, size, fb} {
             window.add_widget(&this->fb);
         }
 
@@ -27,7 +42,18 @@ namespace gui {
             window.redraw(desktop, parent_pos);
         }
 
+        // Puts only the given lines of the framebuffer on the screen, without recomposing the rest of the desktop
+        void update_lines(int32_t y_start, int32_t y_end) {
+            auto& desktop = gui::get_desktop();
+
+            auto rect = fb.redraw_lines(desktop, pos, y_start, y_end);
+            if(rect.w && rect.h)
+                desktop.update(rect);
+        }
+
         private:
+        static constexpr Vec2i pos = {450, 30};
+
         mutable Window window;
         mutable Framebuffer fb;
     };
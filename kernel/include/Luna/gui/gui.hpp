@@ -121,13 +121,21 @@ namespace gui {
             for(auto* widget : widgets)
                 widget->redraw(*this, {0, 0});
 
-            for(int x = 0; x < cursor_size; x++)
-                for(int y = 0; y < cursor_size; y++)
-                    put_pixel(mouse.pos + Vec2i{x, y}, cursor[x][y]);
+            draw_cursor();
 
             gpu::get_gpu().flush();
         }
 
+        // For widgets that already drew their changes into the backbuffer themselves, only pushes rect to the screen
+        void update(const gpu::Rect& rect) {
+            if((size_t)mouse.pos.x < (rect.x + rect.w) && rect.x < (size_t)(mouse.pos.x + cursor_size) && (size_t)mouse.pos.y < (rect.y + rect.h) && rect.y < (size_t)(mouse.pos.y + cursor_size))
+                draw_cursor();
+
+            gpu::get_gpu().flush(rect);
+        }
+
+        const Vec2<size_t>& get_size() const { return size; }
+
         [[gnu::always_inline]]
         inline void put_pixel(const Vec2i& c, Colour colour) {
             if(colour.a > 0)
@@ -159,6 +167,12 @@ namespace gui {
         }
 
         private:
+        void draw_cursor() {
+            for(int x = 0; x < cursor_size; x++)
+                for(int y = 0; y < cursor_size; y++)
+                    put_pixel(mouse.pos + Vec2i{x, y}, cursor[x][y]);
+        }
+
         EventQueue<GuiEvent> event_queue;
         std::vector<Widget*> widgets;
         volatile uint32_t* fb;
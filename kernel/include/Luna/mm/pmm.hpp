@@ -12,4 +12,5 @@ namespace pmm {
     uintptr_t alloc_n_blocks(size_t n_pages);
     void free_block(uintptr_t block);
     void reserve_block(uintptr_t block);
+    size_t n_free_blocks();
 } // namespace pmm
\ No newline at end of file
@@ -40,8 +40,14 @@ namespace net {
 
     struct Nic {
         virtual bool send_packet(const Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload) = 0;
+        virtual bool send_frame(const std::span<uint8_t>& frame) = 0; // Complete Ethernet frame, without FCS
+        virtual void set_promiscuous(bool enable) = 0;
         virtual Mac get_mac() const = 0;
 
+        // Called from IRQ context for every received frame, without FCS
+        void (*rx_handler)(void* userptr, std::span<uint8_t> frame) = nullptr;
+        void* rx_userptr = nullptr;
+
         uint32_t checksum_offload;
     };
 
@@ -52,6 +58,7 @@ namespace net {
 
     void register_nic(Nic* nic);
     Interface* get_default_if();
+    Interface* get_if(size_t i); // nullptr if there are no more interfaces
 } // namespace net
 
 namespace format {
@@ -9,6 +9,9 @@
 namespace net::luna_debug {
     struct Writer : public log::Logger {
         void putc(const char c) const {
+            if(i == buf_size)
+                flush();
+
             buf[i++] = c;
         }
 
@@ -21,11 +24,12 @@ namespace net::luna_debug {
             std::span<uint8_t> packet{(uint8_t*)buf, i};
 
             udp::send(*net::get_default_if(), a, packet);
+            i = 0;
         }
 
         private:
         static constexpr size_t buf_size = 100;
         mutable char buf[buf_size];
-        mutable size_t i;
+        mutable size_t i = 0;
 	};
 } // namespace net::luna_debug
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <std/vector.hpp>
+
+namespace vm::cpuid {
+    constexpr uint32_t luna_sig = 0x616E754C; // Luna in ASCII
+
+    constexpr uint32_t hv_base_leaf = 0x4000'0000;
+    constexpr uint32_t hv_features_leaf = 0x4000'0001;
+
+    constexpr uint32_t any_subleaf = ~0u;
+
+    // EAX of the Luna features leaf
+    namespace features {
+        enum {
+            PvClock = (1 << 0), // pvclock::msr_system_time is present
+            StableTsc = (1 << 1), // The TscStable flag of the pvclock can be trusted
+            Hypercalls = (1 << 2) // Luna hypercall ABI, see hypercall.hpp
+        };
+    } // namespace features
+
+    struct Leaf {
+        uint32_t leaf, subleaf;
+        uint32_t a, b, c, d;
+    };
+
+    // Bits that are cleared from the host values of a leaf, applied after all subleaves have been read
+    struct Mask {
+        uint32_t leaf, subleaf = any_subleaf;
+        uint32_t a = 0, b = 0, c = 0, d = 0;
+    };
+
+    struct Policy {
+        uint32_t max_basic_leaf, max_extended_leaf;
+        uint32_t hv_features; // EAX of the Luna features leaf
+        uint64_t xcr0; // XCR0 bits the guest is allowed to set, must be a subset of the host XCR0
+
+        std::vector<Mask> masks;
+    };
+
+    // Policy that only exposes features that are either handled by the VMM or safe to expose without intervention
+    Policy default_policy();
+
+    struct Table {
+        void init(const Policy& policy);
+
+        // Returns false if the leaf is not part of the CPU model, a, b, c and d are zero in that case
+        bool get(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) const;
+
+        uint64_t get_xcr0_mask() const { return allowed_xcr0; }
+        uint32_t xsave_size(uint64_t xcr0) const; // Size of the standard format XSAVE area for a given XCR0
+
+        private:
+        Leaf* find(uint32_t leaf, uint32_t subleaf);
+        void filter_xsave();
+        void add(uint32_t leaf, uint32_t subleaf, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+
+        std::vector<Leaf> leaves;
+        uint64_t allowed_xcr0;
+    };
+} // namespace vm::cpuid
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/pci/pci_driver.hpp>
+
+// Memory balloon, lets the host ask the guest for pages back, and lets the guest hint pages it doesn't use
+// Both inflated and hinted pages are unmapped and freed to the pmm, if the guest touches them again they're repopulated with zeroes
+// The guest passes pages in lists of up to 512 GPAs, one page worth of uint64_t's
+namespace vm::balloon {
+    constexpr size_t bar_size = 0x1000;
+    constexpr size_t max_list_entries = pmm::block_size / sizeof(uint64_t);
+
+    constexpr uint16_t vendor_id = 0x4C55; // Not assigned by the PCI-SIG, only ever seen by Luna guests
+    constexpr uint16_t device_id = 0xBA11;
+
+    namespace regs {
+        constexpr size_t features = 0x0; // RO
+        constexpr size_t target = 0x4; // RO, amount of pages the host wants in the balloon
+        constexpr size_t actual = 0x8; // RO, amount of pages currently in the balloon
+        constexpr size_t isr = 0xC; // RO, Read to clear
+        constexpr size_t list_low = 0x10;
+        constexpr size_t list_high = 0x14;
+        constexpr size_t list_count = 0x18;
+        constexpr size_t command = 0x1C; // WO, processes the page list
+        constexpr size_t result = 0x20; // RO, amount of pages that were accepted by the last command
+    } // namespace regs
+
+    namespace features {
+        constexpr uint32_t free_page_hints = (1 << 0);
+    } // namespace features
+
+    namespace isr {
+        constexpr uint32_t target_changed = (1 << 0);
+    } // namespace isr
+
+    namespace commands {
+        constexpr uint32_t inflate = 1;
+        constexpr uint32_t deflate = 2;
+        constexpr uint32_t hint = 3;
+    } // namespace commands
+
+    struct Driver : vm::pci::PCIDriver, public vm::AbstractMMIODriver {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot): PCIDriver{vm}, vm{vm} {
+            bridge->register_pci_driver(pci::DeviceID{0, 0, slot, 0}, this);
+
+            pci_space.header.vendor_id = vendor_id;
+            pci_space.header.device_id = device_id;
+
+            pci_space.header.class_id = 5; // Memory Controller
+            pci_space.header.subclass = 0x80; // Other
+
+            pci_space.header.irq_pin = 1;
+
+            pci_init_bar(0, bar_size, true);
+        }
+
+        // Host API
+        void set_target(size_t pages) {
+            if(pages == target)
+                return;
+
+            target = pages;
+
+            isr_status |= isr::target_changed;
+            pci_set_irq_line(true);
+        }
+
+        size_t get_target() const { return target; }
+        size_t get_actual() const { return actual; }
+
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+            auto reg = addr - mmio_base;
+            if(size != 4) {
+                print("balloon: Ignoring {} byte MMIO write {:#x} <- {:#x}\n", (uint16_t)size, reg, value);
+                return;
+            }
+
+            if(reg == regs::list_low) {
+                list = (list & ~0xFFFF'FFFFull) | (value & 0xFFFF'FFFF);
+            } else if(reg == regs::list_high) {
+                list = (list & 0xFFFF'FFFF) | (value << 32);
+            } else if(reg == regs::list_count) {
+                list_count = value;
+            } else if(reg == regs::command) {
+                result = handle_command(value);
+            } else {
+                print("balloon: Unknown MMIO write {:#x} <- {:#x}\n", reg, value);
+            }
+        }
+
+        uint64_t mmio_read(uintptr_t addr, uint8_t size) {
+            auto reg = addr - mmio_base;
+            if(size != 4) {
+                print("balloon: Ignoring {} byte MMIO read from {:#x}\n", (uint16_t)size, reg);
+                return 0;
+            }
+
+            switch (reg) {
+                case regs::features: return features::free_page_hints;
+                case regs::target: return target;
+                case regs::actual: return actual;
+                case regs::isr: {
+                    auto ret = isr_status;
+                    isr_status = 0;
+                    pci_set_irq_line(false);
+                    return ret;
+                }
+                case regs::list_low: return list & 0xFFFF'FFFF;
+                case regs::list_high: return list >> 32;
+                case regs::list_count: return list_count;
+                case regs::result: return result;
+                default:
+                    print("balloon: Unknown MMIO read from {:#x}\n", reg);
+                    return 0;
+            }
+        }
+
+        void pci_handle_write(uint16_t reg, uint32_t value, [[maybe_unused]] uint8_t size) {
+            print("balloon: Unhandled PCI write, reg: {:#x}, value: {:#x}\n", reg, value);
+        }
+
+        uint32_t pci_handle_read(uint16_t reg, uint8_t size) {
+            print("balloon: Unhandled PCI read, reg: {:#x}, size: {:#x}\n", reg, (uint16_t)size);
+
+            return 0;
+        }
+
+        void pci_update_bars() {
+            if(mmio_enabled)
+                vm->mmio_map.erase(mmio_base);
+            mmio_enabled = false;
+
+            if(!(pci_space.header.command & (1 << 1)))
+                return;
+
+            uint64_t base = pci_space.header.bar[0] & ~0xF;
+
+            vm->mmio_map[base] = {this, bar_size};
+            mmio_base = base;
+            mmio_enabled = true;
+        }
+
+        private:
+        uint32_t handle_command(uint32_t cmd) {
+            if(list_count > max_list_entries || (list & (pmm::block_size - 1)))
+                return 0;
+
+            auto* pages = new uint64_t[max_list_entries];
+            vm->cpus[0].dma_read(list, {(uint8_t*)pages, list_count * sizeof(uint64_t)});
+
+            uint32_t accepted = 0;
+            for(size_t i = 0; i < list_count; i++) {
+                auto gpa = pages[i] & ~(pmm::block_size - 1);
+
+                if(cmd == commands::inflate || cmd == commands::hint) {
+                    if(!vm->discard_page(gpa))
+                        continue;
+
+                    if(cmd == commands::inflate)
+                        actual++;
+                } else if(cmd == commands::deflate) {
+                    // Nothing to map yet, the page is repopulated once the guest touches it
+                    if(actual == 0)
+                        break;
+
+                    actual--;
+                } else {
+                    print("balloon: Unknown command {}\n", cmd);
+                    break;
+                }
+
+                accepted++;
+            }
+
+            delete[] pages;
+            return accepted;
+        }
+
+        vm::Vm* vm;
+
+        bool mmio_enabled = false;
+        uintptr_t mmio_base = 0;
+
+        uint64_t list = 0;
+        uint32_t list_count = 0, result = 0;
+
+        uint32_t target = 0, actual = 0, isr_status = 0;
+    };
+} // namespace vm::balloon
@@ -7,13 +7,20 @@
 
 #include <Luna/vmm/drivers/pci/pci_driver.hpp>
 #include <Luna/vmm/drivers/gpu/edid.hpp>
+#include <Luna/vmm/drivers/gpu/vga.hpp>
 
 #include <Luna/gui/fb.hpp>
+#include <Luna/mm/hmm.hpp>
+#include <Luna/mm/vmm.hpp>
 
+// Bochs Graphics Adapter, the framebuffer is host memory mapped straight into the guest
+// The standard VGA ports are also reachable at 0x400 in the MMIO BAR, and VGA output is off while a BGA mode is enabled
+// Writes to it are tracked with a dirty log, and every refresh only the lines covering written pages are put on the screen, so an idle guest costs close to nothing
 namespace vm::gpu::bga {
+    constexpr size_t vga_ports = 0x400; // 0x3C0 - 0x3DF
     constexpr size_t dispi = 0x500;
 
-    constexpr uint32_t lfb_size = 0x100000;
+    constexpr uint32_t lfb_size = 0x800000;
     constexpr uint32_t mmio_size = 0x1000;
 
     constexpr size_t edid_size = 256;
@@ -24,13 +31,23 @@ namespace vm::gpu::bga {
         constexpr size_t yres = dispi + (2 * 2);
         constexpr size_t bpp = dispi + (3 * 2);
         constexpr size_t enable = dispi + (4 * 2);
+        constexpr size_t video_memory_64k = dispi + (0xA * 2);
     } // namespace regs
 
-    constexpr size_t max_x = 512, max_y = 512;
-    
+    namespace enable {
+        constexpr uint16_t enabled = (1 << 0);
+        constexpr uint16_t get_caps = (1 << 1);
+    } // namespace enable
+
+    constexpr size_t max_x = 1920, max_y = 1080;
+    constexpr size_t native_x = 1024, native_y = 768;
+    static_assert((max_x * max_y * 4) <= lfb_size);
+
+    constexpr uint64_t refresh_interval_ms = 16;
+
 
     struct Driver : public vm::AbstractMMIODriver, vm::pci::PCIDriver {
-        Driver(vm::Vm* vm, pci::HostBridge* bridge, vfs::File* vgabios, uint8_t slot): PCIDriver{vm}, vm{vm} {
+        Driver(vm::Vm* vm, pci::HostBridge* bridge, vfs::File* vgabios, vga::Driver* vga, uint8_t slot): PCIDriver{vm}, vm{vm}, vga{vga} {
             bridge->register_pci_driver(pci::DeviceID{0, 0, slot, 0}, this);
             pci_set_option_rom(vgabios);
             pci_init_bar(0, lfb_size, true);
@@ -43,54 +60,50 @@ namespace vm::gpu::bga {
             pci_space.header.subclass = 0;
             pci_space.header.prog_if = 0;
 
-            this->edid = edid::generate_edid({.native_x = max_x, .native_y = max_y});
+            this->edid = edid::generate_edid({.native_x = native_x, .native_y = native_y});
 
             fb = {(uint8_t*)hmm::alloc(lfb_size, 0x1000), lfb_size};
         }
 
         void register_mmio_driver(Vm* vm) { ASSERT(this->vm == vm); }
 
-        void mmio_write(uintptr_t addr, uint64_t value, [[maybe_unused]] uint8_t size) {
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
             /*if(addr >= bar0 && addr < (bar0 + lfb_size)) {
                 auto off = addr - bar0;
                 if(off <= (curr_mode.x * curr_mode.y * (curr_mode.bpp / 8))) {
                     window->get_fb()[off / 4] = value;
                 }
-            } else*/ if(addr == (bar2 + 0x400)) {
-                // Some kind of sync register?
+            } else*/ if(addr >= (bar2 + vga_ports) && addr < (bar2 + vga_ports + 0x20)) {
+                vga->pio_write(0x3C0 + (addr - bar2 - vga_ports), value, size);
             } else if(addr == bar2 + regs::xres) {
-                ASSERT(value <= max_x);
-                mode.x = value;
+                if(value <= max_x)
+                    mode.x = value;
             } else if(addr == bar2 + regs::yres) {
-                ASSERT(value <= max_y);
-                mode.y = value;
+                if(value <= max_y)
+                    mode.y = value;
             } else if(addr == bar2 + regs::bpp) {
-                ASSERT(value == 32);
-                mode.bpp = value;
+                if(value == 32)
+                    mode.bpp = value;
+                else
+                    print("bga: Unsupported bpp {}\n", value);
             } else if(addr == bar2 + regs::enable) {
-                mode.enabled = value & 1;
-                if(curr_mode.enabled == false && mode.enabled == true) {
-                    window = new gui::FbWindow{{(int32_t)mode.x, (int32_t)mode.y}, fb.data(), "VM Screen"};
-
-                    gui::get_desktop().add_window(window);
-                    gui::get_desktop().update();
-
-                    curr_mode = mode;
-                } else {
-                    PANIC("TODO");
-                }
+                get_caps = value & enable::get_caps;
+                mode.enabled = value & enable::enabled;
+                set_mode();
             } else {
                 print("bga: Unhandled MMIO Write {:#x} <- {:#x}\n", addr, value);
             }
         }
 
-        uint64_t mmio_read(uintptr_t addr, [[maybe_unused]] uint8_t size) {
+        uint64_t mmio_read(uintptr_t addr, uint8_t size) {
             /*if(addr >= bar0 && addr < (bar0 + lfb_size)) {
                 auto off = addr - bar0;
                 if(off <= (curr_mode.x * curr_mode.y * (curr_mode.bpp / 8))) {
                     return window->get_fb()[off / 4];
                 }
-            } else*/ if(addr >= bar2 && addr < (bar2 + edid_size) && size == 1) {
+            } else*/ if(addr >= (bar2 + vga_ports) && addr < (bar2 + vga_ports + 0x20)) {
+                return vga->pio_read(0x3C0 + (addr - bar2 - vga_ports), size);
+            } else if(addr >= bar2 && addr < (bar2 + edid_size) && size == 1) {
                 auto i = addr - bar2;
                 if(i < 128) // We only have the base EDID block
                     return ((uint8_t*)&edid)[i];
@@ -98,6 +111,16 @@ namespace vm::gpu::bga {
                     return 0;
             } else if(addr == bar2 + regs::id)
                 return 0xB0C5; // ID5
+            else if(addr == bar2 + regs::xres)
+                return get_caps ? max_x : mode.x;
+            else if(addr == bar2 + regs::yres)
+                return get_caps ? max_y : mode.y;
+            else if(addr == bar2 + regs::bpp)
+                return get_caps ? 32 : mode.bpp;
+            else if(addr == bar2 + regs::enable)
+                return (mode.enabled ? enable::enabled : 0) | (get_caps ? enable::get_caps : 0);
+            else if(addr == bar2 + regs::video_memory_64k)
+                return lfb_size / 0x10000;
             else
                 print("bga: Unhandled MMIO Read {:#x}\n", addr);
 
@@ -126,22 +149,89 @@ namespace vm::gpu::bga {
             }
 
             //vm->mmio_map[bar0] = {this, lfb_size};
+            if(dirty_log)
+                vm->stop_dirty_log(dirty_log);
+
             auto& kvmm = vmm::kernel_vmm::get_instance();
             for(size_t i = 0; i < lfb_size; i += 0x1000)
                 vm->mm->map(kvmm.get_phys((uintptr_t)fb.data() + i), bar0 + i, paging::mapPagePresent | paging::mapPageWrite);
             
             this->bar0 = bar0;
+            dirty_log = vm->start_dirty_log(bar0, lfb_size);
 
             vm->mmio_map[bar2] = {this, mmio_size};
             this->bar2 = bar2;
             mmio_enabled = true;
         }
 
+        private:
+        void set_mode() {
+            if(!mode.enabled) {
+                vm->cpus[0].stop_timer(refresh, this);
+                curr_mode.enabled = false;
+                vga->set_active(true);
+                return;
+            }
+
+            if(!mode.x || !mode.y || mode.bpp != 32) {
+                print("bga: Invalid mode {}x{}x{}\n", mode.x, mode.y, mode.bpp);
+                return;
+            }
+
+            // The desktop can't take windows away, so a resize gets a new one on top
+            if(!window || mode.x != curr_mode.x || mode.y != curr_mode.y) {
+                window = new gui::FbWindow{{(int32_t)mode.x, (int32_t)mode.y}, fb.data(), "VM Screen"};
+                gui::get_desktop().add_window(window);
+            }
+
+            curr_mode = mode;
+            vga->set_active(false);
+            gui::get_desktop().update();
+
+            arm_refresh();
+        }
+
+        void arm_refresh() {
+            vm->cpus[0].start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * refresh_interval_ms, refresh, this);
+        }
+
+        // Runs of dirty pages become runs of lines, which are drawn straight into the backbuffer and flushed on their own
+        static void refresh(VCPU*, void* userptr) {
+            auto& self = *(Driver*)userptr;
+            self.arm_refresh();
+
+            if(!self.dirty_log || !self.vm->collect_dirty_log(*self.dirty_log, self.dirty))
+                return;
+
+            auto pitch = self.curr_mode.x * (self.curr_mode.bpp / 8);
+            auto page_bit = [&](size_t page) { return (self.dirty[page / 64] >> (page % 64)) & 1; };
+
+            auto n_pages = div_ceil(pitch * self.curr_mode.y, pmm::block_size);
+            for(size_t page = 0; page < n_pages;) {
+                if(!page_bit(page)) {
+                    page++;
+                    continue;
+                }
+
+                auto start = page;
+                while(page < n_pages && page_bit(page))
+                    page++;
+
+                auto y_start = (start * pmm::block_size) / pitch;
+                auto y_end = div_ceil(page * pmm::block_size, pitch);
+                self.window->update_lines(y_start, y_end);
+            }
+        }
 
         vm::Vm* vm;
-        gui::FbWindow* window;
+        vga::Driver* vga;
+        gui::FbWindow* window = nullptr;
         std::span<uint8_t> fb;
 
+        DirtyLog* dirty_log = nullptr;
+        std::vector<uint64_t> dirty;
+        bool get_caps = false;
+
         bool mmio_enabled = false;
         uint32_t bar0, bar2;
 
@@ -150,6 +240,6 @@ namespace vm::gpu::bga {
         struct {
             size_t x, y, bpp;
             bool enabled;
-        } curr_mode, mode;
+        } curr_mode{}, mode{};
     };
 } // namespace vm::gpu::bga
@@ -3,23 +3,524 @@
 #include <Luna/common.hpp>
 #include <Luna/vmm/vm.hpp>
 
+#include <Luna/misc/log.hpp>
+#include <Luna/gui/fb.hpp>
+#include <Luna/mm/hmm.hpp>
+#include <Luna/mm/vmm.hpp>
 
+#include <std/vector.hpp>
 
+// Standard VGA, sequencer, CRTC, graphics and attribute controllers, DAC, and 256KiB of planar VRAM
+// VRAM is stored byte interleaved, byte p of dword n is plane p at offset n, which makes chain-4 addressing the identity, so chain-4 modes get the legacy window mapped straight into the guest
+// Text and planar modes trap every access to go through the plane logic
+// A VCPU timer renders from a shadow copy of VRAM and registers, and only if something changed since the last time
 namespace vm::gpu::vga {
-    struct Driver : public vm::AbstractMMIODriver {
-        Driver(Vm* vm) {
-            vm->mmio_map[0xA'0000] = {this, 0x2'0000};
+    constexpr size_t plane_size = 0x1'0000;
+    constexpr size_t vram_size = 4 * plane_size;
+
+    constexpr uintptr_t window_base = 0xA'0000;
+    constexpr size_t window_size = 0x2'0000;
+
+    constexpr size_t max_width = 640, max_height = 480;
+    constexpr size_t char_width = 8;
+    constexpr uint64_t refresh_interval_ms = 20;
+
+    namespace ports {
+        constexpr uint16_t attr_index = 0x3C0; // Index and data through a flip-flop
+        constexpr uint16_t attr_read = 0x3C1;
+        constexpr uint16_t misc_write = 0x3C2;
+        constexpr uint16_t seq_index = 0x3C4;
+        constexpr uint16_t seq_data = 0x3C5;
+        constexpr uint16_t dac_mask = 0x3C6;
+        constexpr uint16_t dac_read_index = 0x3C7;
+        constexpr uint16_t dac_write_index = 0x3C8;
+        constexpr uint16_t dac_data = 0x3C9;
+        constexpr uint16_t feature_read = 0x3CA;
+        constexpr uint16_t misc_read = 0x3CC;
+        constexpr uint16_t gc_index = 0x3CE;
+        constexpr uint16_t gc_data = 0x3CF;
+        constexpr uint16_t crtc_index_mono = 0x3B4;
+        constexpr uint16_t crtc_data_mono = 0x3B5;
+        constexpr uint16_t status_mono = 0x3BA;
+        constexpr uint16_t crtc_index = 0x3D4;
+        constexpr uint16_t crtc_data = 0x3D5;
+        constexpr uint16_t status = 0x3DA;
+    } // namespace ports
+
+    namespace seq {
+        constexpr uint8_t clocking_mode = 1;
+        constexpr uint8_t map_mask = 2;
+        constexpr uint8_t memory_mode = 4; // Bit 2: Odd/Even disable, Bit 3: Chain-4
+
+        constexpr size_t n_regs = 5;
+    } // namespace seq
+
+    namespace gc {
+        constexpr uint8_t set_reset = 0;
+        constexpr uint8_t enable_set_reset = 1;
+        constexpr uint8_t colour_compare = 2;
+        constexpr uint8_t data_rotate = 3;
+        constexpr uint8_t read_map_select = 4;
+        constexpr uint8_t mode = 5;
+        constexpr uint8_t misc = 6; // Bit 0: Graphics, Bits 2-3: Memory map
+        constexpr uint8_t colour_dont_care = 7;
+        constexpr uint8_t bit_mask = 8;
+
+        constexpr size_t n_regs = 9;
+    } // namespace gc
+
+    namespace crtc {
+        constexpr uint8_t h_display_end = 0x1;
+        constexpr uint8_t overflow = 0x7;
+        constexpr uint8_t max_scan_line = 0x9;
+        constexpr uint8_t cursor_start = 0xA;
+        constexpr uint8_t cursor_end = 0xB;
+        constexpr uint8_t start_high = 0xC;
+        constexpr uint8_t start_low = 0xD;
+        constexpr uint8_t cursor_high = 0xE;
+        constexpr uint8_t cursor_low = 0xF;
+        constexpr uint8_t v_display_end = 0x12;
+        constexpr uint8_t offset = 0x13;
+
+        constexpr size_t n_regs = 0x19;
+    } // namespace crtc
+
+    namespace attr {
+        constexpr uint8_t mode = 0x10; // Bit 6: 8bit colour, Bit 7: P5/P4 from colour select
+        constexpr uint8_t colour_select = 0x14;
+        constexpr uint8_t palette_source = (1 << 5); // In the index, the display is blanked while it's clear
+
+        constexpr size_t n_regs = 0x15;
+    } // namespace attr
+
+    struct Driver : public vm::AbstractMMIODriver, public vm::AbstractPIODriver {
+        Driver(Vm* vm): vm{vm} {
+            vm->mmio_map[window_base] = {this, window_size};
+
+            for(uint16_t port = 0x3B4; port <= 0x3DA; port++)
+                if(is_vga_port(port))
+                    vm->pio_map[port] = this;
+
+            vram = {(uint8_t*)hmm::alloc(vram_size, pmm::block_size), vram_size};
+            memset(vram.data(), 0, vram_size);
+            shadow.vram.resize(vram_size);
+
+            display = new uint32_t[max_width * max_height]{};
+
+            arm_refresh();
+        }
+
+        // Another adapter took over the display, like BGA does when its own modes are enabled
+        void set_active(bool active) {
+            this->active = active;
+            dirty = true;
+        }
+
+        void pio_write(uint16_t port, uint32_t value, uint8_t size) {
+            // Word writes put the index and data in one go
+            for(uint8_t i = 0; i < size; i++)
+                write_reg(port + i, value >> (i * 8));
+        }
+
+        uint32_t pio_read(uint16_t port, uint8_t size) {
+            uint32_t value = 0;
+            for(uint8_t i = 0; i < size; i++)
+                value |= read_reg(port + i) << (i * 8);
+
+            return value;
         }
-        
-        void mmio_write([[maybe_unused]] uintptr_t addr, [[maybe_unused]] uint64_t value, [[maybe_unused]] uint8_t size) {
 
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+            for(uint8_t i = 0; i < size; i++)
+                mem_write(addr + i, value >> (i * 8));
         }
 
-        uint64_t mmio_read([[maybe_unused]] uintptr_t addr, [[maybe_unused]] uint8_t size) { 
-            return 0;
+        uint64_t mmio_read(uintptr_t addr, uint8_t size) {
+            uint64_t value = 0;
+            for(uint8_t i = 0; i < size; i++)
+                value |= (uint64_t)mem_read(addr + i) << (i * 8);
+
+            return value;
         }
 
         private:
-        log::Logger* logger;
+        static bool is_vga_port(uint16_t port) {
+            return (port >= 0x3C0 && port <= 0x3CF) || port == ports::crtc_index_mono || port == ports::crtc_data_mono || port == ports::status_mono ||
+                   port == ports::crtc_index || port == ports::crtc_data || port == ports::status;
+        }
+
+        // Expands the low 4 bits to a byte per plane
+        static uint32_t plane_mask(uint8_t v) {
+            uint32_t mask = 0;
+            for(uint8_t p = 0; p < 4; p++)
+                if(v & (1 << p))
+                    mask |= 0xFFu << (p * 8);
+
+            return mask;
+        }
+
+        void write_reg(uint16_t port, uint8_t value) {
+            dirty = true;
+
+            switch (port) {
+                case ports::attr_index:
+                    if(!attr_flipflop) {
+                        attr_index = value & 0x3F;
+                    } else if((attr_index & 0x1F) < attr::n_regs) {
+                        attr_regs[attr_index & 0x1F] = value;
+                    }
+                    attr_flipflop = !attr_flipflop;
+                    break;
+                case ports::misc_write: misc = value; break;
+                case ports::seq_index: seq_index = value; break;
+                case ports::seq_data:
+                    if(seq_index < seq::n_regs) {
+                        seq_regs[seq_index] = value;
+                        update_mapping();
+                    }
+                    break;
+                case ports::dac_mask: dac_mask = value; break;
+                case ports::dac_read_index: dac_read = value * 3; break;
+                case ports::dac_write_index: dac_write = value * 3; break;
+                case ports::dac_data:
+                    palette[dac_write] = value & 0x3F;
+                    dac_write = (dac_write + 1) % sizeof(palette);
+                    break;
+                case ports::gc_index: gc_index = value; break;
+                case ports::gc_data:
+                    if(gc_index < gc::n_regs) {
+                        gc_regs[gc_index] = value;
+                        update_mapping();
+                    }
+                    break;
+                case ports::crtc_index: case ports::crtc_index_mono: crtc_index = value; break;
+                case ports::crtc_data: case ports::crtc_data_mono:
+                    if(crtc_index < crtc::n_regs)
+                        crtc_regs[crtc_index] = value;
+                    break;
+                case ports::status: case ports::status_mono: break; // Feature Control, nothing to control
+                default:
+                    print("vga: Unhandled write to {:#x} <- {:#x}\n", port, (uint16_t)value);
+                    break;
+            }
+        }
+
+        uint8_t read_reg(uint16_t port) {
+            switch (port) {
+                case ports::attr_index: return attr_index;
+                case ports::attr_read: return ((attr_index & 0x1F) < attr::n_regs) ? attr_regs[attr_index & 0x1F] : 0;
+                case ports::misc_read: return misc;
+                case ports::feature_read: return 0;
+                case ports::seq_index: return seq_index;
+                case ports::seq_data: return (seq_index < seq::n_regs) ? seq_regs[seq_index] : 0;
+                case ports::dac_mask: return dac_mask;
+                case ports::dac_write_index: return dac_write / 3;
+                case ports::dac_data: {
+                    auto v = palette[dac_read];
+                    dac_read = (dac_read + 1) % sizeof(palette);
+                    return v;
+                }
+                case ports::gc_index: return gc_index;
+                case ports::gc_data: return (gc_index < gc::n_regs) ? gc_regs[gc_index] : 0;
+                case ports::crtc_index: case ports::crtc_index_mono: return crtc_index;
+                case ports::crtc_data: case ports::crtc_data_mono: return (crtc_index < crtc::n_regs) ? crtc_regs[crtc_index] : 0;
+                case ports::status: case ports::status_mono:
+                    // Toggle retrace and display enable so polling loops finish, this also resets the attribute flip-flop
+                    attr_flipflop = false;
+                    retrace ^= (1 << 3) | (1 << 0);
+                    return retrace;
+                default:
+                    print("vga: Unhandled read from {:#x}\n", port);
+                    return 0xFF;
+            }
+        }
+
+        bool chain4() const { return seq_regs[seq::memory_mode] & (1 << 3); }
+        bool odd_even() const { return !(seq_regs[seq::memory_mode] & (1 << 2)); }
+
+        // Returns the offset into the window selected by the memory map, or false if addr isn't decoded
+        bool window_offset(uintptr_t addr, size_t& offset) const {
+            constexpr uintptr_t bases[] = {0xA'0000, 0xA'0000, 0xB'0000, 0xB'8000};
+            constexpr size_t sizes[] = {0x2'0000, 0x1'0000, 0x8000, 0x8000};
+
+            auto map = (gc_regs[gc::misc] >> 2) & 3;
+            if(addr < bases[map] || addr >= (bases[map] + sizes[map]))
+                return false;
+
+            offset = addr - bases[map];
+            return true;
+        }
+
+        void mem_write(uintptr_t addr, uint8_t value) {
+            size_t offset = 0;
+            if(!window_offset(addr, offset))
+                return;
+
+            auto map_mask = seq_regs[seq::map_mask];
+            if(chain4()) {
+                if(offset < vram_size && (map_mask & (1 << (offset & 3))))
+                    vram[offset] = value;
+                return;
+            } else if(odd_even()) {
+                auto plane = offset & 1;
+                auto index = ((offset & ~1) << 1) | plane;
+                if(index < vram_size && (map_mask & (1 << plane)))
+                    vram[index] = value;
+                return;
+            }
+
+            if(offset >= plane_size)
+                return;
+
+            auto mode = gc_regs[gc::mode] & 3;
+            auto rotate = gc_regs[gc::data_rotate] & 7;
+            auto rotated = (uint8_t)((value >> rotate) | (value << (8 - rotate)));
+
+            uint32_t data = 0;
+            uint8_t bit_mask = gc_regs[gc::bit_mask];
+            switch (mode) {
+                case 0: {
+                    data = rotated * 0x0101'0101u;
+                    auto set_mask = plane_mask(gc_regs[gc::enable_set_reset]);
+                    data = (data & ~set_mask) | (plane_mask(gc_regs[gc::set_reset]) & set_mask);
+                    break;
+                }
+                case 1: // Latches straight back
+                    store_planes(offset, latch, map_mask);
+                    return;
+                case 2:
+                    data = plane_mask(value);
+                    break;
+                case 3:
+                    bit_mask &= rotated;
+                    data = plane_mask(gc_regs[gc::set_reset]);
+                    break;
+            }
+
+            switch ((gc_regs[gc::data_rotate] >> 3) & 3) {
+                case 1: data &= latch; break;
+                case 2: data |= latch; break;
+                case 3: data ^= latch; break;
+            }
+
+            uint32_t mask = bit_mask * 0x0101'0101u;
+            store_planes(offset, (data & mask) | (latch & ~mask), map_mask);
+        }
+
+        uint8_t mem_read(uintptr_t addr) {
+            size_t offset = 0;
+            if(!window_offset(addr, offset))
+                return 0xFF;
+
+            if(chain4()) {
+                return (offset < vram_size) ? vram[offset] : 0xFF;
+            } else if(odd_even()) {
+                auto plane = (gc_regs[gc::read_map_select] & 2) | (offset & 1);
+                auto index = ((offset & ~1) << 1) | plane;
+                return (index < vram_size) ? vram[index] : 0xFF;
+            }
+
+            if(offset >= plane_size)
+                return 0xFF;
+
+            memcpy(&latch, &vram[offset * 4], 4);
+            if(!(gc_regs[gc::mode] & (1 << 3))) // Read Mode 0
+                return latch >> ((gc_regs[gc::read_map_select] & 3) * 8);
+
+            // Read Mode 1, bits that match the colour compare in every plane that isn't don't care
+            auto diff = (latch ^ plane_mask(gc_regs[gc::colour_compare])) & plane_mask(gc_regs[gc::colour_dont_care]);
+            diff |= diff >> 16;
+            diff |= diff >> 8;
+            return ~diff & 0xFF;
+        }
+
+        void store_planes(size_t offset, uint32_t data, uint8_t map_mask) {
+            uint32_t curr = 0;
+            memcpy(&curr, &vram[offset * 4], 4);
+
+            auto mask = plane_mask(map_mask);
+            curr = (curr & ~mask) | (data & mask);
+            memcpy(&vram[offset * 4], &curr, 4);
+        }
+
+        // Plain chain-4 writes don't need any plane logic, so they can go straight to VRAM without exiting
+        void update_mapping() {
+            auto map = (gc_regs[gc::misc] >> 2) & 3;
+            bool direct = chain4() && (seq_regs[seq::map_mask] & 0xF) == 0xF && map <= 1;
+            if(direct == mapped)
+                return;
+
+            auto& kvmm = vmm::kernel_vmm::get_instance();
+            for(size_t i = 0; i < plane_size; i += pmm::block_size) {
+                if(direct)
+                    vm->mm->map(kvmm.get_phys((uintptr_t)vram.data() + i), window_base + i, paging::mapPagePresent | paging::mapPageWrite);
+                else
+                    vm->mm->unmap(window_base + i);
+            }
+
+            mapped = direct;
+        }
+
+        void arm_refresh() {
+            vm->cpus[0].start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * refresh_interval_ms, refresh, this);
+        }
+
+        static void refresh(VCPU*, void* userptr) {
+            auto& self = *(Driver*)userptr;
+            self.arm_refresh();
+
+            // Direct mapped writes don't exit, so VRAM has to be compared too
+            bool changed = self.dirty || memcmp(self.shadow.vram.data(), self.vram.data(), vram_size) != 0;
+            if(!changed || !self.active || !(self.attr_index & attr::palette_source))
+                return;
+
+            memcpy(self.shadow.vram.data(), self.vram.data(), vram_size);
+            memcpy(self.shadow.crtc, self.crtc_regs, sizeof(self.crtc_regs));
+            memcpy(self.shadow.attr, self.attr_regs, sizeof(self.attr_regs));
+            memcpy(self.shadow.palette, self.palette, sizeof(self.palette));
+            self.shadow.graphics = self.gc_regs[gc::misc] & 1;
+            self.shadow.chain4 = self.chain4();
+            self.shadow.dac_mask = self.dac_mask;
+            self.dirty = false;
+
+            self.render();
+        }
+
+        uint32_t colour(uint8_t index) const {
+            index &= shadow.dac_mask;
+            auto* rgb = &shadow.palette[index * 3];
+
+            // 6-bit DAC
+            return (0xFFu << 24) | ((uint32_t)(rgb[0] << 2) << 16) | ((uint32_t)(rgb[1] << 2) << 8) | (uint32_t)(rgb[2] << 2);
+        }
+
+        // 16 colour indices go through the attribute palette first
+        uint32_t attr_colour(uint8_t index) const {
+            auto v = shadow.attr[index & 0xF] & 0x3F;
+            auto select = shadow.attr[attr::colour_select];
+            if(shadow.attr[attr::mode] & (1 << 7))
+                v = (v & 0xF) | ((select & 0x3) << 4);
+            v |= (select & 0xC) << 4;
+
+            return colour(v);
+        }
+
+        void render() {
+            const auto* c = shadow.crtc;
+
+            size_t v_display = (c[crtc::v_display_end] | ((c[crtc::overflow] & 0x2) << 7) | ((c[crtc::overflow] & 0x40) << 3)) + 1;
+            size_t scan_lines = (c[crtc::max_scan_line] & 0x1F) + 1;
+            size_t start = (c[crtc::start_high] << 8) | c[crtc::start_low];
+
+            size_t width = 0, height = 0;
+            if(!shadow.graphics) {
+                size_t cols = c[crtc::h_display_end] + 1, rows = v_display / scan_lines;
+                width = min(cols * char_width, max_width);
+                height = min(rows * scan_lines, max_height);
+
+                render_text(start, cols, rows, scan_lines, width, height);
+            } else {
+                if(c[crtc::max_scan_line] & (1 << 7)) // Double scan
+                    scan_lines *= 2;
+
+                width = min((c[crtc::h_display_end] + 1) * (shadow.chain4 ? 4 : 8), max_width);
+                height = min(v_display / scan_lines, max_height);
+                size_t pitch = c[crtc::offset] * (shadow.chain4 ? 8 : 2);
+
+                for(size_t y = 0; y < height; y++) {
+                    for(size_t x = 0; x < width; x++) {
+                        uint32_t pixel = 0;
+                        if(shadow.chain4) {
+                            auto i = (start * 4 + y * pitch + x) % vram_size;
+                            pixel = colour(shadow.vram[i]);
+                        } else {
+                            auto offset = ((start + y * pitch + x / 8) % plane_size) * 4;
+                            auto bit = 7 - (x % 8);
+
+                            uint8_t index = 0;
+                            for(uint8_t p = 0; p < 4; p++)
+                                index |= ((shadow.vram[offset + p] >> bit) & 1) << p;
+                            pixel = attr_colour(index);
+                        }
+
+                        display[x + y * max_width] = pixel;
+                    }
+                }
+            }
+
+            if(!window) {
+                window = new gui::FbWindow{{max_width, max_height}, (uint8_t*)display, "VGA"};
+                gui::get_desktop().add_window(window);
+            }
+
+            // Clear whatever the previous mode left outside of this one
+            for(size_t y = 0; y < max_height; y++)
+                for(size_t x = (y < height) ? width : 0; x < max_width; x++)
+                    display[x + y * max_width] = 0xFF00'0000;
+
+            window->update_lines(0, max_height);
+        }
+
+        void render_text(size_t start, size_t cols, size_t rows, size_t char_height, size_t width, size_t height) {
+            const auto* c = shadow.crtc;
+            auto plane = [&](uint8_t p, size_t offset) { return shadow.vram[(offset % plane_size) * 4 + p]; };
+
+            size_t cursor = ((c[crtc::cursor_high] << 8) | c[crtc::cursor_low]) - start;
+            bool cursor_enabled = !(c[crtc::cursor_start] & (1 << 5));
+            size_t cursor_start = c[crtc::cursor_start] & 0x1F, cursor_end = c[crtc::cursor_end] & 0x1F;
+
+            for(size_t row = 0; row < rows; row++) {
+                for(size_t col = 0; col < cols; col++) {
+                    auto i = row * cols + col;
+                    auto ch = plane(0, start + i), attribute = plane(1, start + i);
+
+                    auto fg = attr_colour(attribute & 0xF), bg = attr_colour(attribute >> 4);
+                    for(size_t line = 0; line < char_height; line++) {
+                        auto y = row * char_height + line;
+                        if(y >= height)
+                            break;
+
+                        auto glyph = plane(2, ch * 32 + line); // Font 0 has room for 32 lines per character
+                        if(cursor_enabled && i == cursor && line >= cursor_start && line <= cursor_end)
+                            glyph = 0xFF;
+
+                        for(size_t x = 0; x < char_width; x++) {
+                            auto px = col * char_width + x;
+                            if(px < width)
+                                display[px + y * max_width] = (glyph & (0x80 >> x)) ? fg : bg;
+                        }
+                    }
+                }
+            }
+        }
+
+        Vm* vm;
+
+        std::span<uint8_t> vram;
+        uint32_t latch = 0;
+        bool mapped = false;
+
+        uint8_t misc = 0, retrace = 0;
+        uint8_t seq_index = 0, seq_regs[seq::n_regs] = {};
+        uint8_t gc_index = 0, gc_regs[gc::n_regs] = {};
+        uint8_t crtc_index = 0, crtc_regs[crtc::n_regs] = {};
+        uint8_t attr_index = 0, attr_regs[attr::n_regs] = {};
+        bool attr_flipflop = false;
+
+        uint8_t dac_mask = 0xFF, palette[256 * 3] = {};
+        size_t dac_read = 0, dac_write = 0;
+
+        // What the last refresh rendered from
+        struct {
+            std::vector<uint8_t> vram;
+            uint8_t crtc[crtc::n_regs], attr[attr::n_regs], palette[256 * 3];
+            uint8_t dac_mask;
+            bool graphics, chain4;
+        } shadow{};
+
+        bool dirty = true, active = true;
+
+        uint32_t* display;
+        gui::FbWindow* window = nullptr;
     };
-} // namespace vm::e9
+} // namespace vm::gpu::vga
@@ -1,4 +1,3 @@
-
 #pragma once
 
 #include <Luna/common.hpp>
@@ -6,46 +5,302 @@
 
 #include <Luna/misc/log.hpp>
 
-
+// HPET with a 100MHz main counter derived from the host TSC, reads are computed on the spot and nothing ticks in the background
+// Every comparator is backed by a VCPU timer armed for the TSC value at which the counter reaches it, in one-shot or periodic mode
+// Interrupts go to the legacy IRQ0 / IRQ8 lines with LegacyReplacement, to the routed 8259 line, or as an MSI over the FSB
 namespace vm::hpet {
     constexpr uintptr_t base = 0xFED0'0000;
 
     constexpr size_t clk_period = 10; // In ns
     constexpr size_t fs_per_ns = 100'0000;
+    constexpr uint64_t ticks_per_ms = 1'000'000 / clk_period;
+
+    constexpr size_t n_timers = 3;
+
+    namespace regs {
+        constexpr uintptr_t cap = 0x0;
+        constexpr uintptr_t config = 0x10;
+        constexpr uintptr_t isr = 0x20;
+        constexpr uintptr_t counter = 0xF0;
+
+        constexpr uintptr_t timer_base = 0x100;
+        constexpr uintptr_t timer_stride = 0x20;
+
+        constexpr uintptr_t timer_config = 0x0;
+        constexpr uintptr_t timer_comparator = 0x8;
+        constexpr uintptr_t timer_fsb = 0x10;
+    } // namespace regs
+
+    namespace config {
+        constexpr uint64_t enable = (1 << 0);
+        constexpr uint64_t legacy_replacement = (1 << 1);
+    } // namespace config
 
-    constexpr uintptr_t cap = 0;
-    constexpr uintptr_t clk = 4;
+    namespace timer_config {
+        constexpr uint64_t level = (1 << 1);
+        constexpr uint64_t int_enable = (1 << 2);
+        constexpr uint64_t periodic = (1 << 3);
+        constexpr uint64_t periodic_cap = (1 << 4);
+        constexpr uint64_t size_cap = (1 << 5); // 64bit
+        constexpr uint64_t val_set = (1 << 6);
+        constexpr uint64_t mode_32 = (1 << 8);
+        constexpr uint64_t route_shift = 9;
+        constexpr uint64_t route_mask = (0x1F << route_shift);
+        constexpr uint64_t fsb_enable = (1 << 14);
+        constexpr uint64_t fsb_cap = (1 << 15);
 
-    constexpr uint64_t cap_val = (0x8086 << 16) | (1 << 15) | (1 << 13) | (2 << 8) | 1; // LegacyReplacement Capable, 64bit timer, 3 comparators, Rev1
+        constexpr uint64_t writable = level | int_enable | periodic | val_set | mode_32 | route_mask | fsb_enable;
+        constexpr uint64_t route_cap = 0xFFFB; // Any 8259 line except the cascade
+    } // namespace timer_config
+
+    constexpr uint64_t cap_val = (0x8086 << 16) | (1 << 15) | (1 << 13) | ((n_timers - 1) << 8) | 1; // LegacyReplacement Capable, 64bit timer, 3 comparators, Rev1
     constexpr uint64_t clk_val = clk_period * fs_per_ns;
 
     struct Driver : public vm::AbstractMMIODriver {
         Driver(Vm* vm): vm{vm} {
             vm->mmio_map[base] = {this, 0x1000};
+
+            for(uint8_t i = 0; i < n_timers; i++) {
+                timers[i].hpet = this;
+                timers[i].index = i;
+                timers[i].comparator = ~0ull;
+            }
         }
 
-        void mmio_write(uintptr_t addr, uint64_t value, [[maybe_unused]] uint8_t size) {
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
             auto reg = addr - base;
 
-            print("hpet: Unknown write {:#x} <- {:#x}\n", reg, value);
+            // 32bit accesses hit half of a 64bit register
+            auto merge = [&](uint64_t old) -> uint64_t {
+                if(size == 8)
+                    return value;
+
+                auto shift = (reg & 4) * 8;
+                return (old & ~(0xFFFF'FFFFull << shift)) | ((value & 0xFFFF'FFFF) << shift);
+            };
+
+            auto reg64 = reg & ~7;
+            if(reg64 == regs::config) {
+                auto old = general_config;
+                general_config = merge(general_config) & (config::enable | config::legacy_replacement);
+
+                if((old ^ general_config) & config::legacy_replacement) {
+                    for(auto& timer : timers)
+                        lower(timer); // The level timer's line changes, isr stays set and raises the new one again
+                    for(auto& timer : timers)
+                        if(isr & (1 << timer.index))
+                            raise(timer);
+                }
+
+                if((old ^ general_config) & config::enable) {
+                    if(general_config & config::enable) {
+                        tsc_base = cpu::rdtsc();
+                    } else {
+                        counter_base = counter();
+                    }
+
+                    for(auto& timer : timers)
+                        arm(timer);
+                }
+            } else if(reg64 == regs::isr) {
+                auto clear = merge(0) & isr;
+                isr &= ~clear;
+                for(auto& timer : timers)
+                    if(clear & (1 << timer.index))
+                        lower(timer);
+            } else if(reg64 == regs::counter) {
+                if(general_config & config::enable) {
+                    print("hpet: Ignoring write to running main counter\n");
+                    return;
+                }
+
+                counter_base = merge(counter_base);
+            } else if(reg64 >= regs::timer_base && reg64 < (regs::timer_base + n_timers * regs::timer_stride)) {
+                auto& timer = timers[(reg64 - regs::timer_base) / regs::timer_stride];
+
+                switch ((reg64 - regs::timer_base) % regs::timer_stride) {
+                    case regs::timer_config: {
+                        lower(timer);
+
+                        timer.config = merge(timer.config) & timer_config::writable;
+                        if(timer.config & timer_config::mode_32)
+                            timer.comparator = (uint32_t)timer.comparator;
+
+                        if((timer.config & timer_config::level) && (isr & (1 << timer.index)))
+                            raise(timer);
+                        break;
+                    }
+                    case regs::timer_comparator: {
+                        auto v = merge(timer.comparator);
+                        if(timer.config & timer_config::mode_32)
+                            v = (uint32_t)v;
+
+                        // In periodic mode a write sets the period, and only moves the comparator when software asked for it
+                        if(!(timer.config & timer_config::periodic) || (timer.config & timer_config::val_set))
+                            timer.comparator = v;
+                        timer.period = merge(timer.period);
+                        if(timer.config & timer_config::mode_32)
+                            timer.period = (uint32_t)timer.period;
+
+                        timer.config &= ~timer_config::val_set;
+                        break;
+                    }
+                    case regs::timer_fsb:
+                        timer.fsb = merge(timer.fsb);
+                        break;
+                    default:
+                        print("hpet: Unknown write {:#x} <- {:#x}\n", reg, value);
+                        return;
+                }
+
+                arm(timer);
+            } else {
+                print("hpet: Unknown write {:#x} <- {:#x}\n", reg, value);
+            }
         }
 
-        uint64_t mmio_read(uintptr_t addr, [[maybe_unused]] uint8_t size) {
+        uint64_t mmio_read(uintptr_t addr, uint8_t size) {
             auto reg = addr - base;
+            auto reg64 = reg & ~7;
 
-            if(reg == cap && size == 4)
-                return cap_val;
-            else if(reg == cap && size == 8)
-                return (clk_val << 32) | cap_val;
-            else if(reg == clk && size == 4)
-                return clk_val;
-            else
+            uint64_t value = 0;
+            if(reg64 == regs::cap) {
+                value = (clk_val << 32) | cap_val;
+            } else if(reg64 == regs::config) {
+                value = general_config;
+            } else if(reg64 == regs::isr) {
+                value = isr;
+            } else if(reg64 == regs::counter) {
+                value = counter();
+            } else if(reg64 >= regs::timer_base && reg64 < (regs::timer_base + n_timers * regs::timer_stride)) {
+                const auto& timer = timers[(reg64 - regs::timer_base) / regs::timer_stride];
+
+                switch ((reg64 - regs::timer_base) % regs::timer_stride) {
+                    case regs::timer_config:
+                        value = (timer_config::route_cap << 32) | timer.config | timer_config::periodic_cap | timer_config::size_cap | timer_config::fsb_cap;
+                        break;
+                    case regs::timer_comparator: value = timer.comparator; break;
+                    case regs::timer_fsb: value = timer.fsb; break;
+                    default:
+                        print("hpet: Unknown read from {:#x}\n", reg);
+                        return 0;
+                }
+            } else {
                 print("hpet: Unknown read from {:#x}\n", reg);
-            
-            return 0;
+                return 0;
+            }
+
+            if(size == 8)
+                return value;
+
+            return (value >> ((reg & 4) * 8)) & 0xFFFF'FFFF;
         }
 
         private:
+        struct Timer {
+            Driver* hpet;
+            uint8_t index;
+
+            uint64_t config, comparator, period, fsb;
+            uint64_t target; // Main counter value the armed VCPU timer is for
+
+            bool asserted;
+            uint8_t asserted_irq;
+        };
+
+        static uint64_t ticks_to_tsc(uint64_t ticks) { return ((unsigned __int128)ticks * cpu::tsc_ticks_per_ms()) / ticks_per_ms; }
+        static uint64_t tsc_to_ticks(uint64_t tsc) { return ((unsigned __int128)tsc * ticks_per_ms) / cpu::tsc_ticks_per_ms(); }
+
+        uint64_t counter() const {
+            if(!(general_config & config::enable))
+                return counter_base;
+
+            return counter_base + tsc_to_ticks(cpu::rdtsc() - tsc_base);
+        }
+
+        void arm(Timer& timer) {
+            auto& vcpu = vm->cpus[0];
+            vcpu.stop_timer(expire, &timer);
+
+            if(!(general_config & config::enable) || !(timer.config & timer_config::int_enable))
+                return;
+
+            // Comparators match on equality, so one that was already passed only fires after the counter wraps
+            auto now = counter();
+            uint64_t delta = timer.comparator - now;
+            if(timer.config & timer_config::mode_32)
+                delta = (uint32_t)delta;
+
+            timer.target = now + delta;
+            vcpu.start_timer(tsc_base + ticks_to_tsc(timer.target - counter_base), expire, &timer);
+        }
+
+        static void expire(VCPU*, void* userptr) {
+            auto& timer = *(Timer*)userptr;
+            auto& self = *timer.hpet;
+
+            if((timer.config & timer_config::level) && !(timer.config & timer_config::fsb_enable))
+                self.isr |= (1 << timer.index);
+            self.raise(timer);
+
+            if((timer.config & timer_config::periodic) && timer.period) {
+                // Skip periods that were missed, instead of delivering them all at once
+                auto missed = (self.counter() - timer.target) / timer.period;
+                timer.comparator += (missed + 1) * timer.period;
+                if(timer.config & timer_config::mode_32)
+                    timer.comparator = (uint32_t)timer.comparator;
+
+                self.arm(timer);
+            }
+        }
+
+        uint8_t route(const Timer& timer) const {
+            if(general_config & config::legacy_replacement) {
+                if(timer.index == 0)
+                    return 0;
+                else if(timer.index == 1)
+                    return 8;
+            }
+
+            return (timer.config & timer_config::route_mask) >> timer_config::route_shift;
+        }
+
+        void raise(Timer& timer) {
+            if(!(timer.config & timer_config::int_enable))
+                return;
+
+            if(timer.config & timer_config::fsb_enable) {
+                vm->send_msi(timer.fsb >> 32, timer.fsb & 0xFFFF'FFFF);
+                return;
+            }
+
+            auto irq = route(timer);
+            if(irq >= 16 || !(timer_config::route_cap & (1 << irq))) {
+                print("hpet: Timer {} routed to unsupported IRQ {}\n", (uint16_t)timer.index, (uint16_t)irq);
+                return;
+            }
+
+            vm->set_irq(irq, true);
+            if(timer.config & timer_config::level) {
+                timer.asserted = true;
+                timer.asserted_irq = irq;
+            } else {
+                vm->set_irq(irq, false);
+            }
+        }
+
+        void lower(Timer& timer) {
+            if(!timer.asserted)
+                return;
+
+            vm->set_irq(timer.asserted_irq, false);
+            timer.asserted = false;
+        }
+
         vm::Vm* vm;
+
+        uint64_t general_config = 0, isr = 0;
+        uint64_t counter_base = 0, tsc_base = 0; // Counter value at tsc_base, when the counter was last started
+        Timer timers[n_timers] = {};
     };
 } // namespace vm::hpet
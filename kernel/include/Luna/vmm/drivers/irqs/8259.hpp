@@ -148,7 +148,7 @@ namespace vm::irqs::pic {
         private:
         void inject_irq(int device, uint8_t irq) {
             print("pic: Raising IRQ{}\n", irq + device * 8);
-            vm->cpus[0].vcpu->inject_int(vm::AbstractVm::InjectType::ExtInt, pics[device].vector + irq); // PIC always sends IRQs to CPU 0
+            vm->cpus[0].inject_irq(pics[device].vector + irq); // PIC always sends IRQs to CPU 0
         }
 
         uint8_t get_priority(int dev, uint8_t mask) {
@@ -6,15 +6,30 @@
 
 #include <Luna/misc/log.hpp>
 #include <Luna/vmm/drivers/pci/pci_driver.hpp>
+#include <Luna/vmm/drivers/pci/msix.hpp>
 
 #include <Luna/fs/vfs.hpp>
 
 
 namespace vm::nvme {
     constexpr size_t bar_size = 0x4000;
+    constexpr size_t msix_bar_size = 0x2000; // BAR4, Table at 0, PBA at 0x1000
 
 
     constexpr size_t max_queue_entries = 256;
+    constexpr uint16_t max_io_queues = 63; // Per type, so up to 63 IO queue pairs
+    constexpr uint16_t n_msix_vectors = max_io_queues + 1;
+    static_assert(n_msix_vectors <= 64); // Pin based status is tracked in a uint64_t
+
+    constexpr size_t page_size = 0x1000;
+    constexpr size_t sector_size = 512; // Granularity of the write back cache, LBAs are a multiple of this
+    constexpr size_t max_dirty_sectors = 2048; // Write back cache size, 1MiB
+
+    constexpr uint8_t mdts = 8; // Max transfer is 2^mdts pages, 1MiB
+    constexpr size_t max_transfer_size = (1 << mdts) * page_size;
+
+    // Supported LBA Formats, selected by Format NVM
+    constexpr uint8_t lba_formats[] = {9, 12}; // 512 byte, and 4KiB LBAs
 
     // Max 64 Queue Entries, Queues have to be contiguous, 4 byte db stride, 
     // NVM Command Set supported, 4KiB min page size, 4KiB max page size
@@ -31,15 +46,41 @@ namespace vm::nvme {
 
         constexpr size_t cc = 0x14;
         constexpr uint32_t cc_en = (1 << 0);
+        constexpr uint32_t cc_shn = (3 << 14);
 
         constexpr size_t csts = 0x1C;
         constexpr uint32_t csts_rdy = (1 << 0);
+        constexpr uint32_t csts_shst_mask = (3 << 2);
+        constexpr uint32_t csts_shst_complete = (2 << 2);
 
         constexpr size_t aqa = 0x24;
         constexpr size_t asq = 0x28;
         constexpr size_t acq = 0x30;
     } // namespace regs
 
+    namespace status {
+        constexpr uint16_t success = 0;
+        constexpr uint16_t invalid_opcode = 0x1;
+        constexpr uint16_t invalid_field = 0x2;
+        constexpr uint16_t internal_error = 0x6;
+        constexpr uint16_t lba_out_of_range = 0x80;
+
+        // Command specific, SCT = 1
+        constexpr uint16_t completion_queue_invalid = (1 << 8) | 0x0;
+        constexpr uint16_t invalid_queue_identifier = (1 << 8) | 0x1;
+        constexpr uint16_t invalid_queue_size = (1 << 8) | 0x2;
+        constexpr uint16_t invalid_interrupt_vector = (1 << 8) | 0x8;
+        constexpr uint16_t invalid_format = (1 << 8) | 0xA;
+        constexpr uint16_t invalid_queue_deletion = (1 << 8) | 0xC;
+    } // namespace status
+
+    namespace features {
+        constexpr uint8_t volatile_write_cache = 0x6;
+        constexpr uint8_t number_of_queues = 0x7;
+        constexpr uint8_t interrupt_coalescing = 0x8;
+        constexpr uint8_t interrupt_vector_configuration = 0x9;
+    } // namespace features
+
 
     struct [[gnu::packed]] SubmissionEntry {
         uint32_t opcode : 8;
@@ -81,9 +122,17 @@ namespace vm::nvme {
         uint8_t cmic;
         uint8_t mdts;
 
-        uint8_t ignored[516 - 78];
+        uint8_t ignored[256 - 78];
+
+        uint16_t oacs;
+
+        uint8_t ignored_0[516 - 258];
 
         uint32_t nn;
+        uint16_t oncs;
+        uint16_t fuses;
+        uint8_t fna;
+        uint8_t vwc;
     };
 
     struct NamespaceIdentify {
@@ -105,7 +154,7 @@ namespace vm::nvme {
     };
 
     struct Driver : vm::pci::PCIDriver, public vm::AbstractMMIODriver {
-        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs::File* file): PCIDriver{vm}, vm{vm}, file{file} {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint8_t func, vfs::File* file): PCIDriver{vm}, msix{vm, pci_space, 0x40, n_msix_vectors, 4, 0, 0x1000}, vm{vm}, file{file} {
             bridge->register_pci_driver(pci::DeviceID{0, 0, slot, func}, this);
 
             pci_space.header.vendor_id = 0x8086;
@@ -125,29 +174,54 @@ namespace vm::nvme {
                 pci_space.header.header_type = 0x80;
 
             pci_init_bar(0, bar_size, true, true); // MMIO, 64bit
+            pci_init_bar(4, msix_bar_size, true); // MSI-X Table and PBA
         }
 
         void register_mmio_driver([[maybe_unused]] Vm* vm) { }
 
         void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+            if(msix_enabled && addr >= msix_base && addr < (msix_base + msix_bar_size)) {
+                if(msix.handles_mmio(addr - msix_base))
+                    msix.mmio_write(addr - msix_base, value, size);
+                return;
+            }
+
             auto reg = addr - mmio_base;
 
             if(reg == regs::cc && size == 4) {
                 if((cc & regs::cc_en) && !(value & regs::cc_en)) { // On to Off
                     csts &= ~regs::csts_rdy;
+                    flush();
 
-                    auto admin = queues[0];
-                    queues.clear();
+                    auto asq = sqs[0];
+                    auto acq = cqs[0];
+                    sqs.clear();
+                    cqs.clear();
 
                     // ASQ, ACQ, and AQA are preserved
-                    queues[0].sq_base = admin.sq_base;
-                    queues[0].cq_base = admin.cq_base;
-                    queues[0].sqs = admin.sqs;
-                    queues[0].cqs = admin.cqs;
+                    sqs[0] = {.base = asq.base, .size = asq.size};
+                    cqs[0] = {.base = acq.base, .size = acq.size};
+
+                    n_io_sqs = max_io_queues;
+                    n_io_cqs = max_io_queues;
+
+                    vm->cpus[0].stop_timer(coalescing_timer, this);
+                    coalescing_timer_armed = false;
+                    aggregation_threshold = 0;
+                    aggregation_time = 0;
+                    for(auto& disabled : coalescing_disabled)
+                        disabled = false;
                 }
                 
-                if(!(cc & regs::cc_en) && (value & regs::cc_en)) // Off to On
+                if(!(cc & regs::cc_en) && (value & regs::cc_en)) { // Off to On
                     csts |= regs::csts_rdy;
+                    csts &= ~regs::csts_shst_mask;
+                }
+
+                if(!(cc & regs::cc_shn) && (value & regs::cc_shn)) { // Shutdown notification, make sure everything hits the disk
+                    flush();
+                    csts = (csts & ~regs::csts_shst_mask) | regs::csts_shst_complete;
+                }
 
                 ASSERT(((value >> 4) & 7) == 0); // NVM Command Set not selected
                 ASSERT(((value >> 7) & 0xF) == 0); // Pagesize != 4KiB
@@ -164,40 +238,42 @@ namespace vm::nvme {
                 irq_mask &= ~value; // Write 1 = clear, 0 = no effect
                 check_irq();
             } else if(reg == regs::aqa && size == 4) {
-                queues[0].cqs = ((value >> 16) & 0xFFF) + 1;
-                queues[0].sqs = (value & 0xFFF) + 1;
+                cqs[0].size = ((value >> 16) & 0xFFF) + 1;
+                sqs[0].size = (value & 0xFFF) + 1;
 
-                ASSERT(queues[0].cqs <= max_queue_entries);
-                ASSERT(queues[0].sqs <= max_queue_entries);
+                ASSERT(cqs[0].size <= max_queue_entries);
+                ASSERT(sqs[0].size <= max_queue_entries);
             } else if(reg == regs::asq) {
-                queues[0].sq_base = value;
+                sqs[0].base = value;
 
-                ASSERT((queues[0].sq_base & 0xFFF) == 0);
+                ASSERT((sqs[0].base & 0xFFF) == 0);
             } else if(reg == (regs::asq + 4) && size == 4) {
-                queues[0].sq_base &= ~0xFFFF'FFFF'0000'0000;
-                queues[0].sq_base |= (value << 32);
+                sqs[0].base &= ~0xFFFF'FFFF'0000'0000;
+                sqs[0].base |= (value << 32);
             } else if(reg == regs::acq) {
-                queues[0].cq_base = value;
+                cqs[0].base = value;
 
-                ASSERT((queues[0].cq_base & 0xFFF) == 0);
+                ASSERT((cqs[0].base & 0xFFF) == 0);
             } else if(reg == (regs::acq + 4) && size == 4) {
-                queues[0].cq_base &= ~0xFFFF'FFFF'0000'0000;
-                queues[0].cq_base |= (value << 32);
-            } else if((reg & ~0xFFF) >= 1) {
-                auto db = reg - 0x1000;
-
-                db /= 4;
+                cqs[0].base &= ~0xFFFF'FFFF'0000'0000;
+                cqs[0].base |= (value << 32);
+            } else if(reg >= 0x1000) { // Doorbells
+                auto db = (reg - 0x1000) / 4;
 
-                auto qid = (db & ~1) / 2;
+                auto qid = db / 2;
                 bool completion = db & 1;
 
-                if(!completion)
-                    kick_queue(qid, value);
-                else {
-                    queues[qid].cq_head = value;
-
-                    if(queues[qid].cq_head == queues[qid].cq_tail && queues[qid].send_irqs)
-                        update_irqs(qid, false);
+                if(!completion) {
+                    if(sqs.contains(qid))
+                        kick_queue(qid, value);
+                    else
+                        print("nvme: Doorbell write to non-existent SQ {}\n", qid);
+                } else if(cqs.contains(qid)) {
+                    auto& queue = cqs[qid];
+                    queue.head = value;
+
+                    if(queue.head == queue.tail && queue.send_irqs)
+                        update_irqs(queue.vector, false);
                 }
             } else {
                 print("nvme: Unknown MMIO write {:#x} <- {:#x} ({})\n", reg, value, size);
@@ -206,6 +282,9 @@ namespace vm::nvme {
         }
 
         uint64_t mmio_read(uintptr_t addr, uint8_t size) {
+            if(msix_enabled && addr >= msix_base && addr < (msix_base + msix_bar_size))
+                return msix.handles_mmio(addr - msix_base) ? msix.mmio_read(addr - msix_base, size) : 0;
+
             auto reg = addr - mmio_base;
 
             if(reg == regs::cap_low)
@@ -219,15 +298,15 @@ namespace vm::nvme {
             else if(reg == regs::cc && size == 4) 
                 return cc;
             else if(reg == regs::aqa)
-                return (((queues[0].cqs + 1) & 0xFFF) << 16) | ((queues[0].sqs + 1) & 0xFFF);
+                return (((cqs[0].size - 1) & 0xFFF) << 16) | ((sqs[0].size - 1) & 0xFFF);
             else if(reg == regs::asq)
-                return queues[0].sq_base;
+                return sqs[0].base;
             else if(reg == (regs::asq + 4) && size == 4)
-                return queues[0].sq_base >> 32;
+                return sqs[0].base >> 32;
             else if(reg == regs::acq)
-                return queues[0].cq_base;
+                return cqs[0].base;
             else if(reg == (regs::acq + 4) && size == 4)
-                return queues[0].cq_base >> 32;
+                return cqs[0].base >> 32;
             else {
                 print("nvme: Unknown MMIO read from {:#x}, size: {}\n", reg, size);
                 PANIC("Unknown reg");
@@ -236,111 +315,194 @@ namespace vm::nvme {
             return 0;
         }
 
-        void pci_handle_write(uint16_t reg, uint32_t value, [[maybe_unused]] uint8_t size) {
+        void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
+            if(msix.handles_pci(reg)) {
+                msix.pci_write(reg, value, size);
+                return;
+            }
+
             print("nvme: Unhandled PCI write, reg: {:#x}, value: {:#x}\n", reg, value);
         }
 
         uint32_t pci_handle_read(uint16_t reg, uint8_t size) {
+            if(msix.handles_pci(reg))
+                return msix.pci_read(reg, size);
+
             print("nvme: Unhandled PCI read, reg: {:#x}, size: {:#x}\n", reg, (uint16_t)size);
 
             return 0;
         }
 
         void pci_update_bars() {
+            if(mmio_enabled)
+                vm->mmio_map.erase(mmio_base);
+            if(msix_enabled)
+                vm->mmio_map.erase(msix_base);
+            mmio_enabled = false;
+            msix_enabled = false;
+
             if(!(pci_space.header.command & (1 << 1)))
                 return;
 
             uint64_t base = (pci_space.header.bar[0] & ~0xF) | ((uint64_t)pci_space.header.bar[1] << 32);
-            
-            if(mmio_enabled)
-                vm->mmio_map[mmio_base] = {nullptr, 0};
-
             vm->mmio_map[base] = {this, bar_size};
             mmio_base = base;
             mmio_enabled = true;
+
+            if(uint64_t table = pci_space.header.bar[4] & ~0xF; table) {
+                vm->mmio_map[table] = {this, msix_bar_size};
+                msix_base = table;
+                msix_enabled = true;
+            }
         }
 
+        // The disk as the guest sees it, through the write back cache, for anything else on the host that accesses it
+        vfs::File* get_file() { return &cached_file; }
+
         private:
+        // Only whole sector accesses, anything else would need a read-modify-write through the cache
+        struct CachedFile : public vfs::File {
+            CachedFile(Driver* self): self{self} {}
+
+            vfs::FileType get_type() { return vfs::FileType::File; }
+            size_t get_size() { return self->file->get_size(); }
+            void close() {}
+
+            size_t read(size_t offset, size_t count, uint8_t* data) {
+                if(!aligned(offset, count) || !self->read_sectors(offset / sector_size, count / sector_size, data))
+                    return 0;
+                return count;
+            }
+
+            size_t write(size_t offset, size_t count, uint8_t* data) {
+                if(!aligned(offset, count) || !self->write_sectors(offset / sector_size, count / sector_size, data))
+                    return 0;
+                return count;
+            }
+
+            private:
+            bool aligned(size_t offset, size_t count) { return (offset % sector_size) == 0 && (count % sector_size) == 0 && offset <= get_size() && count <= (get_size() - offset); }
+
+            Driver* self;
+        };
+
         void kick_queue(uint16_t qid, uint32_t value) {
-            auto& queue = queues[qid];
-            queue.sq_tail = value;
+            sqs[qid].tail = value;
+            auto cqid = sqs[qid].cqid;
 
             auto* cmd_data = new uint8_t[sq_entry_size];
             auto& cmd = *(SubmissionEntry*)cmd_data;
 
-            while(queue.sq_head != queue.sq_tail) {
-                vm->cpus[0].dma_read(queue.sq_base + (queue.sq_head * sq_entry_size), {cmd_data, sq_entry_size});
+            // Admin commands can delete this queue, so look it up again every iteration
+            while(sqs.contains(qid) && sqs[qid].head != sqs[qid].tail) {
+                auto& queue = sqs[qid];
+                vm->cpus[0].dma_read(queue.base + (queue.head * sq_entry_size), {cmd_data, sq_entry_size});
+
+                auto next_head = (queue.head + 1) % queue.size;
+                queue.head = next_head;
 
-                auto next_head = (queue.sq_head + 1) % queue.sqs;
-                    
                 auto res = qid == 0 ? admin_queue_handle(cmd) : nvm_queue_handle(cmd);
                 res.cid = cmd.cid;
                 res.sq_id = qid;
                 res.sq_head = next_head;
-                cq_push(qid, res);
-
-                queue.sq_head = next_head;
+                cq_push(cqid, res);
             }
 
             delete[] cmd_data;
-        }
 
-        struct Queue;
+            // Completions are batched, everything this doorbell write completed is signalled with at most one interrupt
+            cq_signal(cqid);
+        }
 
         CompletionEntry admin_queue_handle(const SubmissionEntry& cmd) {
             CompletionEntry c{};
 
             auto opcode = cmd.opcode;
-            if(opcode == 1) { // Create IO Submission Queue
-                ASSERT(cmd.cmd_data[1] & (1 << 0)); // Physically Contiguous
+            if(opcode == 0) { // Delete IO Submission Queue
+                auto qid = cmd.cmd_data[0] & 0xFFFF;
 
+                if(qid == 0 || !sqs.contains(qid))
+                    c.status = status::invalid_queue_identifier;
+                else
+                    sqs.erase(qid);
+            } else if(opcode == 1) { // Create IO Submission Queue
                 auto qid = cmd.cmd_data[0] & 0xFFFF;
                 auto size = (cmd.cmd_data[0] >> 16) + 1;
 
+                bool contiguous = cmd.cmd_data[1] & (1 << 0);
                 auto cqid = cmd.cmd_data[1] >> 16;
 
-                ASSERT(qid == cqid);
-
-                if(!queues.contains(cqid)) {
-                    c.status = (1 << 8) | 0;
-                } else if(qid == 0) {
-                    c.status = (1 << 8) | 1;
-                } else if(size == 1 || cq_entry_size == 0) { // Size cannot be 0, and minimum is 2
-                    c.status = (1 << 8) | 2;
+                if(qid == 0 || qid > n_io_sqs || sqs.contains(qid)) {
+                    c.status = status::invalid_queue_identifier;
+                } else if(cqid == 0 || !cqs.contains(cqid)) {
+                    c.status = status::completion_queue_invalid;
+                } else if(size < 2 || size > max_queue_entries || sq_entry_size == 0) {
+                    c.status = status::invalid_queue_size;
+                } else if(!contiguous) { // CAP.CQR is set
+                    c.status = status::invalid_field;
                 } else {
-                    auto& queue = queues[qid];
+                    sqs[qid] = {.base = cmd.prp0, .size = size, .cqid = (uint16_t)cqid};
+                }
+            } else if(opcode == 4) { // Delete IO Completion Queue
+                auto qid = cmd.cmd_data[0] & 0xFFFF;
 
-                    queue.sq_base = cmd.prp0;
-                    queue.sqs = size;
+                bool in_use = false;
+                for(uint16_t i = 1; i <= n_io_sqs; i++)
+                    if(sqs.contains(i) && sqs[i].cqid == qid)
+                        in_use = true;
 
-                    c.status = 0;
+                if(qid == 0 || !cqs.contains(qid)) {
+                    c.status = status::invalid_queue_identifier;
+                } else if(in_use) {
+                    c.status = status::invalid_queue_deletion;
+                } else {
+                    if(cqs[qid].send_irqs)
+                        update_irqs(cqs[qid].vector, false);
+
+                    cqs.erase(qid);
                 }
             } else if(opcode == 5) { // Create IO Completion Queue
-                ASSERT(cmd.cmd_data[1] & (1 << 0)); // Physically Contiguous
+                bool contiguous = cmd.cmd_data[1] & (1 << 0);
                 bool send_irqs = (cmd.cmd_data[1] >> 1) & 1;
+                uint16_t vector = cmd.cmd_data[1] >> 16;
 
                 auto qid = cmd.cmd_data[0] & 0xFFFF;
                 auto size = (cmd.cmd_data[0] >> 16) + 1;
-                
-                if(qid == 0 || queues.contains(qid)) {
-                    c.status = (1 << 8) | 1;
-                } else if(size == 0 || cq_entry_size == 0) {
-                    c.status = (1 << 8) | 2;
-                } else {
-                    Queue queue{};
-                    queue.cq_base = cmd.prp0;
-                    queue.cqs = size;
-                    queue.send_irqs = send_irqs;
-
-                    queues[qid] = queue;
 
-                    c.status = 0;
+                if(qid == 0 || qid > n_io_cqs || cqs.contains(qid)) {
+                    c.status = status::invalid_queue_identifier;
+                } else if(size < 2 || size > max_queue_entries || cq_entry_size == 0) {
+                    c.status = status::invalid_queue_size;
+                } else if(vector >= (msix.enabled() ? n_msix_vectors : 1)) { // INTx only has a single vector
+                    c.status = status::invalid_interrupt_vector;
+                } else if(!contiguous) {
+                    c.status = status::invalid_field;
+                } else {
+                    cqs[qid] = {.base = cmd.prp0, .size = size, .send_irqs = send_irqs, .vector = vector};
                 }
             } else if(opcode == 6) { // Identify
                 c.status = handle_admin_identify(cmd) ? 0 : 0xB;
+            } else if(opcode == 0x80) { // Format NVM
+                auto format = cmd.cmd_data[0] & 0xF;
+                auto ses = (cmd.cmd_data[0] >> 9) & 0x7;
+
+                if(cmd.nsid != 1 && cmd.nsid != 0xFFFF'FFFF) {
+                    c.status = 0xB; // Invalid Namespace
+                } else if(format >= sizeof(lba_formats)) {
+                    c.status = status::invalid_format;
+                } else if(ses != 0) { // No Secure Erase
+                    c.status = status::invalid_field;
+                } else if(!flush()) {
+                    c.status = status::internal_error;
+                } else {
+                    lba_format = format;
+                    lba_shift = lba_formats[format];
+                }
+            } else if(opcode == 9 || opcode == 0xA) { // Set Features, Get Features
+                c = handle_admin_features(cmd, opcode == 9);
             } else {
                 print("nvme: Unknown Admin Opcode: {}\n", opcode);
-                PANIC("Unknown op");
+                c.status = status::invalid_opcode;
             }
 
             return c;
@@ -349,58 +511,383 @@ namespace vm::nvme {
         CompletionEntry nvm_queue_handle(const SubmissionEntry& cmd) {
             CompletionEntry c{};
 
+            auto lba = cmd.cmd_data[0] | ((uint64_t)cmd.cmd_data[1] << 32);
+            auto n_lbas = (cmd.cmd_data[2] & 0xFFFF) + 1;
+            auto in_range = [&]() { return lba < n_disk_lbas() && n_lbas <= (n_disk_lbas() - lba); };
+
+            // The cache and backing store work in sectors
+            auto sector_shift = lba_shift - 9;
+            auto sector = lba << sector_shift;
+            size_t n_sectors = n_lbas << sector_shift;
+
             auto opcode = cmd.opcode;
-            if(opcode == 2) { // Read
-                auto lba = cmd.cmd_data[0] | ((uint64_t)cmd.cmd_data[1] << 32);
-                auto n_lbas = (cmd.cmd_data[2] & 0xFFFF) + 1;
+            if(opcode == 0) { // Flush
+                c.status = flush() ? status::success : status::internal_error;
+            } else if(opcode == 1 || opcode == 2) { // Write, Read
+                if(!in_range()) {
+                    c.status = status::lba_out_of_range;
+                    return c;
+                }
+
+                size_t len = n_lbas << lba_shift;
+                if(len > max_transfer_size) {
+                    c.status = status::invalid_field;
+                    return c;
+                }
+
+                if(opcode == 2 && can_read_direct(sector, n_sectors)) {
+                    c.status = read_direct(cmd, sector, len) ? status::success : status::internal_error;
+                    return c;
+                }
+
+                // One backing store request per command, and one DMA per physically contiguous run of guest memory
+                auto* buf = new uint8_t[len];
+
+                bool success = true;
+                if(opcode == 1) {
+                    prp_walk(cmd, len, [&](uintptr_t gpa, size_t offset, size_t size) { vm->cpus[0].dma_read(gpa, {buf + offset, size}); });
+                    success = write_sectors(sector, n_sectors, buf);
+                } else {
+                    success = read_sectors(sector, n_sectors, buf);
+                    prp_walk(cmd, len, [&](uintptr_t gpa, size_t offset, size_t size) { vm->cpus[0].dma_write(gpa, {buf + offset, size}); });
+                }
+
+                delete[] buf;
+                c.status = success ? status::success : status::internal_error;
+            } else if(opcode == 8) { // Write Zeroes
+                if(!in_range()) {
+                    c.status = status::lba_out_of_range;
+                    return c;
+                }
+
+                constexpr size_t chunk_sectors = page_size / sector_size;
+                auto* zero = new uint8_t[page_size]{};
 
-                ASSERT(cmd.prp == 0); // Use PRPs
+                bool success = true;
+                for(size_t i = 0; i < n_sectors && success; i += chunk_sectors)
+                    success = write_sectors(sector + i, min(chunk_sectors, n_sectors - i), zero);
 
-                uint64_t dst = cmd.prp0;
+                delete[] zero;
 
-                uint64_t prp_list = cmd.prp1;
-                uint64_t prp_i = 0;
+                c.status = success ? status::success : status::internal_error;
+            } else if(opcode == 9) { // Dataset Management
+                auto n_ranges = (cmd.cmd_data[0] & 0xFF) + 1;
+                bool deallocate = (cmd.cmd_data[1] >> 2) & 1;
 
-                auto* buf = new uint8_t[512];
+                struct [[gnu::packed]] Range {
+                    uint32_t attributes;
+                    uint32_t n_lbas;
+                    uint64_t lba;
+                };
 
-                size_t count = 0;
-                while(count != n_lbas) {
-                    file->read((lba + count) * 512, 512, buf);
+                auto* ranges = new Range[n_ranges];
+                prp_walk(cmd, n_ranges * sizeof(Range), [&](uintptr_t gpa, size_t offset, size_t size) { vm->cpus[0].dma_read(gpa, {(uint8_t*)ranges + offset, size}); });
 
-                    vm->cpus[0].dma_write(dst, {buf, 512});
-                    count++;
+                // Deallocated LBAs read back as unspecified data (DLFEAT = 0), so the only thing to do is not waste time writing back data the guest doesn't care about
+                // Ranges are guest sized, so walk whichever is smaller, the range or the cache
+                for(size_t i = 0; deallocate && n_dirty && i < n_ranges; i++) {
+                    auto start = ranges[i].lba << sector_shift;
+                    auto n = (uint64_t)ranges[i].n_lbas << sector_shift;
 
-                    if((count % 8) == 0) { // 8 Sectors in 1 page
-                        vm->cpus[0].dma_read(prp_list + (prp_i * 8), {(uint8_t*)&dst, 8});
-                        prp_i++;
+                    if(n <= dirty_order.size()) {
+                        for(uint64_t j = 0; j < n; j++)
+                            drop_dirty(start + j);
                     } else {
-                        dst += 512;
+                        for(auto dirty_sector : dirty_order)
+                            if(dirty_sector >= start && (dirty_sector - start) < n)
+                                drop_dirty(dirty_sector);
                     }
                 }
 
-                delete[] buf;
-
-                c.status = 0;
+                delete[] ranges;
+                c.status = status::success;
             } else {
                 print("nvme: Unknown NVM Command {}\n", opcode);
-                PANIC("Unknown cmd");
+                c.status = status::invalid_opcode;
+            }
+
+            return c;
+        }
+
+        // Calls f(gpa, offset, size) for every physically contiguous run of a len byte transfer described by the PRPs of cmd
+        // Adjacent PRP entries that point to adjacent pages are merged into a single run
+        template<typename F>
+        void prp_walk(const SubmissionEntry& cmd, size_t len, F f) {
+            ASSERT(cmd.prp == 0); // Use PRPs
+
+            uintptr_t run_gpa = 0;
+            size_t run_offset = 0, run_size = 0;
+            auto add = [&](uintptr_t gpa, size_t size) {
+                if(run_size && gpa == (run_gpa + run_size)) {
+                    run_size += size;
+                    return;
+                }
+
+                if(run_size)
+                    f(run_gpa, run_offset, run_size);
+
+                run_gpa = gpa;
+                run_offset += run_size;
+                run_size = size;
+            };
+
+            // PRP1 can start at an offset into its page
+            size_t offset = min(page_size - (cmd.prp0 & (page_size - 1)), len);
+            add(cmd.prp0, offset);
+
+            if(offset < len && (len - offset) <= page_size) { // PRP2 is a data pointer
+                add(cmd.prp1, len - offset);
+                offset = len;
+            }
+
+            // Otherwise PRP2 points to a PRP list, the last entry of a list page chains to the next one
+            uint64_t list = cmd.prp1 & ~(page_size - 1);
+            size_t list_i = (cmd.prp1 & (page_size - 1)) / sizeof(uint64_t);
+            constexpr size_t entries_per_list = page_size / sizeof(uint64_t);
+
+            constexpr size_t batch_size = 64;
+            uint64_t entries[batch_size];
+            while(offset < len) {
+                auto pages_left = div_ceil(len - offset, page_size);
+                auto n = min(min(entries_per_list - list_i, pages_left), batch_size);
+                vm->cpus[0].dma_read(list + list_i * sizeof(uint64_t), {(uint8_t*)entries, n * sizeof(uint64_t)});
+
+                size_t i = 0;
+                for(; i < n; i++) {
+                    if((list_i + i) == (entries_per_list - 1) && (pages_left - i) > 1)
+                        break; // Pointer to the next list
+
+                    auto chunk = min(page_size, len - offset);
+                    add(entries[i], chunk);
+                    offset += chunk;
+                }
+
+                if(i < n) {
+                    list = entries[i] & ~(page_size - 1);
+                    list_i = 0;
+                } else {
+                    list_i += n;
+                }
+            }
+
+            if(run_size)
+                f(run_gpa, run_offset, run_size);
+        }
+
+        // Reads can go straight from the backing store into guest memory, unless the cache has newer data or the replay log has to see the payload
+        bool can_read_direct(uint64_t sector, size_t n) {
+            if(vm->replay_log.get_mode() != replay::Mode::Off)
+                return false;
+
+            if(n_dirty)
+                for(size_t i = 0; i < n; i++)
+                    if(dirty.contains(sector + i))
+                        return false;
+
+            return true;
+        }
+
+        bool read_direct(const SubmissionEntry& cmd, uint64_t sector, size_t len) {
+            std::vector<std::span<uint8_t>> segments;
+            prp_walk(cmd, len, [&](uintptr_t gpa, size_t, size_t size) { vm->cpus[0].dma_map(gpa, size, segments); });
+
+            return file->read_sg(sector * sector_size, {segments.data(), segments.size()}) == len;
+        }
+
+        uint64_t n_disk_lbas() { return file->get_size() >> lba_shift; }
+
+        bool read_sectors(uint64_t sector, size_t n, uint8_t* buf) {
+            if(file->read(sector * sector_size, n * sector_size, buf) != (n * sector_size))
+                return false;
+
+            // Dirty data in the cache is newer than what's on disk
+            if(n_dirty)
+                for(size_t i = 0; i < n; i++)
+                    if(dirty.contains(sector + i))
+                        memcpy(buf + i * sector_size, dirty[sector + i], sector_size);
+
+            return true;
+        }
+
+        bool write_sectors(uint64_t sector, size_t n, const uint8_t* buf) {
+            if(!write_cache)
+                return file->write(sector * sector_size, n * sector_size, (uint8_t*)buf) == (n * sector_size);
+
+            for(size_t i = 0; i < n; i++) {
+                if(!dirty.contains(sector + i)) {
+                    dirty[sector + i] = new uint8_t[sector_size];
+                    dirty_order.push_back(sector + i);
+                    n_dirty++;
+                }
+
+                memcpy(dirty[sector + i], buf + i * sector_size, sector_size);
+            }
+
+            if(n_dirty > max_dirty_sectors || dirty_order.size() > (2 * max_dirty_sectors))
+                return flush();
+
+            return true;
+        }
+
+        void drop_dirty(uint64_t sector) {
+            if(!n_dirty || !dirty.contains(sector))
+                return;
+
+            delete[] dirty[sector];
+            dirty.erase(sector);
+            n_dirty--;
+        }
+
+        // Write back the cache, contiguous dirty sectors are coalesced into a single write
+        bool flush() {
+            if(!n_dirty) {
+                dirty_order.clear();
+                return true;
+            }
+
+            constexpr size_t max_run = 256;
+            auto* run = new uint8_t[max_run * sector_size];
+
+            bool success = true;
+            for(auto sector : dirty_order) {
+                if(!dirty.contains(sector))
+                    continue; // Already written as part of an earlier run, or dropped
+
+                // At most max_run - 1 back, so the run always reaches sector itself
+                auto start = sector;
+                while(start > 0 && (sector - start) < (max_run - 1) && dirty.contains(start - 1))
+                    start--;
+
+                size_t n = 0;
+                while(n < max_run && dirty.contains(start + n)) {
+                    memcpy(run + n * sector_size, dirty[start + n], sector_size);
+                    drop_dirty(start + n);
+                    n++;
+                }
+
+                if(file->write(start * sector_size, n * sector_size, run) != (n * sector_size))
+                    success = false;
+            }
+
+            delete[] run;
+            dirty_order.clear();
+            ASSERT(n_dirty == 0);
+            return success;
+        }
+
+        CompletionEntry handle_admin_features(const SubmissionEntry& cmd, bool set) {
+            CompletionEntry c{};
+
+            auto fid = cmd.cmd_data[0] & 0xFF;
+            if(fid == features::number_of_queues) {
+                if(set) {
+                    auto n_sqs = cmd.cmd_data[1] & 0xFFFF;
+                    auto n_cqs = cmd.cmd_data[1] >> 16;
+                    if(n_sqs == 0xFFFF || n_cqs == 0xFFFF) {
+                        c.status = status::invalid_field;
+                        return c;
+                    }
+
+                    // Both are 0's based
+                    n_io_sqs = min(n_sqs + 1, max_io_queues);
+                    n_io_cqs = min(n_cqs + 1, max_io_queues);
+                }
+
+                c.cmd_specific = ((n_io_cqs - 1) << 16) | (n_io_sqs - 1);
+            } else if(fid == features::interrupt_coalescing) {
+                if(set) {
+                    aggregation_threshold = cmd.cmd_data[1] & 0xFF;
+                    aggregation_time = (cmd.cmd_data[1] >> 8) & 0xFF;
+                }
+
+                c.cmd_specific = (aggregation_time << 8) | aggregation_threshold;
+            } else if(fid == features::interrupt_vector_configuration) {
+                auto vector = cmd.cmd_data[1] & 0xFFFF;
+                if(vector >= n_msix_vectors) {
+                    c.status = status::invalid_field;
+                    return c;
+                }
+
+                if(set)
+                    coalescing_disabled[vector] = (cmd.cmd_data[1] >> 16) & 1;
+
+                c.cmd_specific = (coalescing_disabled[vector] << 16) | vector;
+            } else if(fid == features::volatile_write_cache) {
+                if(set) {
+                    bool enable = cmd.cmd_data[1] & 1;
+                    if(!enable && !flush()) {
+                        c.status = status::internal_error;
+                        return c;
+                    }
+
+                    write_cache = enable;
+                }
+
+                c.cmd_specific = write_cache;
+            } else {
+                print("nvme: Unknown {} Features FID {:#x}\n", set ? "Set" : "Get", fid);
+                c.status = status::invalid_field;
             }
 
             return c;
         }
 
         void cq_push(uint16_t qid, CompletionEntry entry) {
-            auto& queue = queues[qid];
+            if(!cqs.contains(qid))
+                return; // Deleted while the command was in flight
+
+            auto& queue = cqs[qid];
             entry.phase = queue.phase;
 
-            vm->cpus[0].dma_write(queue.cq_base + (queue.cq_tail * cq_entry_size), {(uint8_t*)&entry, cq_entry_size});
-            queue.cq_tail = (queue.cq_tail + 1) % queue.cqs;
+            vm->cpus[0].dma_write(queue.base + (queue.tail * cq_entry_size), {(uint8_t*)&entry, cq_entry_size});
+            queue.tail = (queue.tail + 1) % queue.size;
 
-            if(queue.cq_tail == 0) // Just wrapped around
+            if(queue.tail == 0) // Just wrapped around
                 queue.phase = !queue.phase;
 
-            if(queue.cq_tail != queue.cq_head && queue.send_irqs)
-                update_irqs(qid, true);
+            queue.n_unsignalled++;
+        }
+
+        // Raise the interrupt for completions posted to a CQ, unless Interrupt Coalescing says to wait for more of them
+        void cq_signal(uint16_t qid) {
+            if(!cqs.contains(qid))
+                return;
+
+            auto& queue = cqs[qid];
+            if(!queue.n_unsignalled || !queue.send_irqs)
+                return;
+
+            // Completions on the Admin CQ are never coalesced
+            bool coalesce = qid != 0 && !coalescing_disabled[queue.vector] && aggregation_time != 0;
+            if(!coalesce || queue.n_unsignalled > aggregation_threshold) { // Threshold is 0's based
+                cq_raise(qid);
+                return;
+            }
+
+            // Arm the timer on the first held back completion, it bounds the latency of all of them
+            if(!coalescing_timer_armed) {
+                auto ticks = div_ceil(cpu::tsc_ticks_per_ms() * aggregation_time, 10); // In 100us units
+                vm->cpus[0].start_timer(cpu::rdtsc() + ticks, coalescing_timer, this);
+                coalescing_timer_armed = true;
+            }
+        }
+
+        void cq_raise(uint16_t qid) {
+            auto& queue = cqs[qid];
+            queue.n_unsignalled = 0;
+
+            // The guest might have polled the entries already
+            if(queue.tail != queue.head)
+                update_irqs(queue.vector, true);
+        }
+
+        static void coalescing_timer(VCPU*, void* userptr) {
+            auto& self = *(Driver*)userptr;
+            self.coalescing_timer_armed = false;
+
+            for(uint16_t i = 1; i <= self.n_io_cqs; i++)
+                if(self.cqs.contains(i) && self.cqs[i].n_unsignalled && self.cqs[i].send_irqs)
+                    self.cq_raise(i);
         }
 
         bool handle_admin_identify(const SubmissionEntry& cmd) {
@@ -411,15 +898,16 @@ namespace vm::nvme {
                     return false;
 
                 NamespaceIdentify data{};
-                auto blocks = file->get_size() / 512;
+                auto blocks = n_disk_lbas();
                 data.nsze = blocks;
                 data.ncap = blocks;
                 data.nuse = blocks;
 
-                data.nlbaf = 0;
-                data.flbas = 0;
+                data.nlbaf = sizeof(lba_formats) - 1; // 0's based
+                data.flbas = lba_format;
 
-                data.lbaf[0] = {.lbads = 9};
+                for(size_t i = 0; i < sizeof(lba_formats); i++)
+                    data.lbaf[i] = {.lbads = lba_formats[i]};
 
                 vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
             } else if(cns == 1) {
@@ -429,8 +917,11 @@ namespace vm::nvme {
                 memcpy(data.serial, "000000000000000000", 20);
                 memcpy(data.model, "Luna NVMe Controller", 22);
                 memcpy(data.revision, "Luna NVMe 1.0", 15);
-                data.mdts = 0;
+                data.mdts = mdts;
+                data.oacs = (1 << 1); // Format NVM
                 data.nn = 1; // 1 Namespace
+                data.oncs = (1 << 2) | (1 << 3); // Dataset Management, Write Zeroes
+                data.vwc = 1; // Volatile Write Cache present
 
                 vm->cpus[0].dma_write(cmd.prp0, {(uint8_t*)&data, sizeof(data)});
             } else {
@@ -442,7 +933,7 @@ namespace vm::nvme {
         }
 
         void check_irq() {
-            uint32_t v = irq_status & ~irq_mask;
+            uint64_t v = irq_status & ~(uint64_t)irq_mask;
 
             if(v)
                 pci_set_irq_line(true);
@@ -450,36 +941,69 @@ namespace vm::nvme {
                 pci_set_irq_line(false);
         }   
 
-        void update_irqs(uint16_t qid, bool status) { // TODO: MSI-X/MSI
-            ASSERT(qid < 32);
+        void update_irqs(uint16_t vector, bool status) {
+            // MSI-X is edge triggered, every completion sends a message
+            if(msix.enabled()) {
+                if(status)
+                    msix.trigger(vector);
+                return;
+            }
 
+            // A CQ created while MSI-X was on can keep a vector past 31 after it's turned off, those all share the pin but INTMS can't mask them
             if(status)
-                irq_status |= (1 << qid);
+                irq_status |= (1ull << vector);
             else
-                irq_status &= ~(1 << qid);
+                irq_status &= ~(1ull << vector);
             
             check_irq();
         }
 
-        bool mmio_enabled = false;
-        uintptr_t mmio_base;
+        bool mmio_enabled = false, msix_enabled = false;
+        uintptr_t mmio_base = 0, msix_base = 0;
 
-        uint32_t cc, csts, irq_mask = 0, irq_status = 0;
+        uint32_t cc, csts, irq_mask = 0;
+        uint64_t irq_status = 0; // Per vector, up to n_msix_vectors
+
+        struct SubmissionQueue {
+            uintptr_t base = 0;
+            size_t size = 0;
+            uint16_t head = 0, tail = 0;
+            uint16_t cqid = 0;
+        };
 
-        struct Queue {
-            uintptr_t cq_base, sq_base;
-            size_t cqs, sqs;
+        struct CompletionQueue {
+            uintptr_t base = 0;
+            size_t size = 0;
+            uint16_t head = 0, tail = 0;
 
-            uint16_t cq_head, cq_tail;
-            uint16_t sq_head, sq_tail;
+            bool phase = true, send_irqs = true; // The Admin CQ always has interrupts enabled
+            uint16_t vector = 0;
 
-            bool phase = true, send_irqs = false;
+            size_t n_unsignalled = 0; // Completions posted since the last interrupt
         };
-        std::unordered_map<uint16_t, Queue> queues;
+
+        std::unordered_map<uint16_t, SubmissionQueue> sqs;
+        std::unordered_map<uint16_t, CompletionQueue> cqs;
+        uint16_t n_io_sqs = max_io_queues, n_io_cqs = max_io_queues; // Allocated by Set Features Number of Queues
+
+        pci::msix::Capability msix;
+
+        // Interrupt Coalescing, aggregation time is in 100us units, 0 disables coalescing
+        uint8_t aggregation_threshold = 0, aggregation_time = 0;
+        bool coalescing_disabled[n_msix_vectors] = {}; // Per vector
+        bool coalescing_timer_armed = false;
 
         uint8_t cq_entry_size, sq_entry_size;
 
+        uint8_t lba_format = 0, lba_shift = lba_formats[0];
+
+        bool write_cache = true;
+        std::unordered_map<uint64_t, uint8_t*> dirty; // Sector -> Data
+        std::vector<uint64_t> dirty_order;
+        size_t n_dirty = 0;
+
         vm::Vm* vm;
         vfs::File* file;
+        CachedFile cached_file{this};
     };
 } // namespace vm::nvme
\ No newline at end of file
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/pci/pci.hpp>
+
+#include <std/vector.hpp>
+
+// MSI-X capability emulation, for use by PCIDriver's
+// The capability lives in the device's config space at cap_offset, the table and PBA live in one of its BARs, the device forwards accesses to both
+namespace vm::pci::msix {
+    constexpr uint8_t cap_id = 0x11;
+    constexpr size_t cap_size = 12;
+    constexpr size_t entry_size = 16;
+
+    namespace control {
+        constexpr uint16_t function_mask = (1 << 14);
+        constexpr uint16_t enable = (1 << 15);
+    } // namespace control
+
+    struct [[gnu::packed]] TableEntry {
+        uint32_t addr_low, addr_high;
+        uint32_t data;
+        uint32_t control; // Bit 0: Masked
+    };
+    static_assert(sizeof(TableEntry) == entry_size);
+
+    struct Capability {
+        // table_offset and pba_offset are relative to the start of BAR bir
+        Capability(Vm* vm, ConfigSpace& space, uint8_t cap_offset, uint16_t n_vectors, uint8_t bir, uint32_t table_offset, uint32_t pba_offset): vm{vm}, space{space}, cap_offset{cap_offset}, table_offset{table_offset}, pba_offset{pba_offset} {
+            ASSERT(n_vectors > 0 && n_vectors <= 2048);
+            ASSERT(cap_offset >= sizeof(ConfigSpaceHeader) && (cap_offset + cap_size) <= sizeof(ConfigSpace) && (cap_offset % 4) == 0);
+
+            table.resize(n_vectors);
+            for(auto& entry : table)
+                entry = {.addr_low = 0, .addr_high = 0, .data = 0, .control = 1}; // All vectors start out masked
+
+            pending.resize(div_ceil(n_vectors, 64));
+
+            space.data8[cap_offset] = cap_id;
+            space.data8[cap_offset + 1] = space.header.capabilities; // Link in front of any existing capabilities
+            space.data16[(cap_offset + 2) / 2] = n_vectors - 1;
+            space.data32[(cap_offset + 4) / 4] = table_offset | bir;
+            space.data32[(cap_offset + 8) / 4] = pba_offset | bir;
+
+            space.header.capabilities = cap_offset;
+            space.header.status |= (1 << 4); // Capabilities List
+        }
+
+        bool enabled() const { return space.data16[(cap_offset + 2) / 2] & control::enable; }
+
+        // Config space
+        bool handles_pci(uint16_t reg) const { return reg >= cap_offset && reg < (cap_offset + cap_size); }
+
+        uint32_t pci_read(uint16_t reg, uint8_t size) const {
+            switch (size) {
+                case 1: return space.data8[reg];
+                case 2: return space.data16[reg / 2];
+                case 4: return space.data32[reg / 4];
+                default: PANIC("Unknown PCI Access size");
+            }
+        }
+
+        void pci_write(uint16_t reg, uint32_t value, uint8_t size) {
+            // Only Message Control is writable, and only its enable and function mask bits
+            if(!ranges_overlap(reg, size, cap_offset + 2, 2))
+                return;
+
+            auto shift = (reg - cap_offset) * 8;
+            uint32_t mask = (size == 4) ? ~0u : ((1u << (size * 8)) - 1);
+            uint32_t dword = (space.data32[cap_offset / 4] & ~(mask << shift)) | ((value & mask) << shift);
+
+            uint16_t ctl = dword >> 16;
+            uint16_t curr = space.data16[(cap_offset + 2) / 2];
+            space.data16[(cap_offset + 2) / 2] = (curr & ~(control::enable | control::function_mask)) | (ctl & (control::enable | control::function_mask));
+
+            deliver_pending();
+        }
+
+        // Table and PBA, offset is relative to the start of the BAR
+        bool handles_mmio(uintptr_t offset) const {
+            return (offset >= table_offset && offset < (table_offset + table.size() * entry_size)) || (offset >= pba_offset && offset < (pba_offset + pending.size() * sizeof(uint64_t)));
+        }
+
+        // Accesses that straddle the end of the table or PBA are cut short there
+        uint64_t mmio_read(uintptr_t offset, uint8_t size) const {
+            const uint8_t* src = nullptr;
+            size_t left = 0;
+            if(offset >= table_offset && offset < (table_offset + table.size() * entry_size)) {
+                src = (const uint8_t*)table.data() + (offset - table_offset);
+                left = table.size() * entry_size - (offset - table_offset);
+            } else if(offset >= pba_offset && offset < (pba_offset + pending.size() * sizeof(uint64_t))) {
+                src = (const uint8_t*)pending.data() + (offset - pba_offset);
+                left = pending.size() * sizeof(uint64_t) - (offset - pba_offset);
+            } else {
+                return 0;
+            }
+
+            uint64_t value = 0;
+            memcpy(&value, src, min(min(size, sizeof(value)), left));
+            return value;
+        }
+
+        void mmio_write(uintptr_t offset, uint64_t value, uint8_t size) {
+            if(offset < table_offset || offset >= (table_offset + table.size() * entry_size))
+                return; // PBA is read-only
+
+            auto left = table.size() * entry_size - (offset - table_offset);
+            memcpy((uint8_t*)table.data() + (offset - table_offset), &value, min(min(size, sizeof(value)), left));
+            deliver_pending();
+        }
+
+        // Device API, returns false if MSI-X is disabled and the device should use its INTx line instead
+        bool trigger(uint16_t vector) {
+            if(!enabled())
+                return false;
+
+            ASSERT(vector < table.size());
+            if(masked(vector))
+                pending[vector / 64] |= (1ull << (vector % 64));
+            else
+                send(vector);
+
+            return true;
+        }
+
+        private:
+        bool masked(uint16_t vector) const { return (space.data16[(cap_offset + 2) / 2] & control::function_mask) || (table[vector].control & 1); }
+
+        void send(uint16_t vector) {
+            const auto& entry = table[vector];
+            vm->send_msi(entry.addr_low | ((uint64_t)entry.addr_high << 32), entry.data);
+        }
+
+        void deliver_pending() {
+            if(!enabled())
+                return;
+
+            for(uint16_t i = 0; i < table.size(); i++) {
+                if((pending[i / 64] & (1ull << (i % 64))) && !masked(i)) {
+                    pending[i / 64] &= ~(1ull << (i % 64));
+                    send(i);
+                }
+            }
+        }
+
+        Vm* vm;
+        ConfigSpace& space;
+
+        uint8_t cap_offset;
+        uint32_t table_offset, pba_offset;
+
+        std::vector<TableEntry> table;
+        std::vector<uint64_t> pending;
+    };
+} // namespace vm::pci::msix
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/pci/pci_driver.hpp>
+#include <Luna/vmm/drivers/pci/msix.hpp>
+
+#include <Luna/drivers/pci.hpp>
+#include <Luna/drivers/iommu/iommu.hpp>
+#include <Luna/cpu/idt.hpp>
+#include <Luna/cpu/pio.hpp>
+#include <Luna/mm/vmm.hpp>
+
+// Hands a host PCI function to the guest
+// The config space is a shadow, BARs are placed wherever the guest puts them, MMIO BARs are mapped straight into the guest, apart from the pages holding the MSI-X table and PBA
+// DMA goes through an IOMMU domain mirroring guest RAM, so the device sees GPAs, and guest RAM stays pinned for as long as the VM lives
+// The host function always uses MSI-X or MSI with its own vectors, every host interrupt is forwarded to the MSI or MSI-X vector the guest programmed into the shadow, there's no INTx
+namespace vm::pci::passthrough {
+    constexpr size_t max_vectors = 32; // Host IDT vectors are scarce
+    constexpr uint8_t msix_cap_offset = 0x40;
+    constexpr uint8_t msi_cap_offset = 0x50;
+    constexpr size_t msi_cap_size = 0xE; // 64bit, no per vector masking
+
+    struct Driver : vm::pci::PCIDriver, public vm::AbstractMMIODriver, public vm::AbstractPIODriver {
+        // The host interrupts are routed to the current CPU, which should be the one running the VM
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, ::pci::Device& device): PCIDriver{vm}, vm{vm}, device{device} {
+            ASSERT(!device.driver);
+            bridge->register_pci_driver(pci::DeviceID{0, 0, slot, 0}, this);
+
+            pci_space.header.vendor_id = device.read<uint16_t>(0x0);
+            pci_space.header.device_id = device.read<uint16_t>(0x2);
+            pci_space.header.revision = device.read<uint8_t>(0x8);
+            pci_space.header.prog_if = device.read<uint8_t>(0x9);
+            pci_space.header.subclass = device.read<uint8_t>(0xA);
+            pci_space.header.class_id = device.read<uint8_t>(0xB);
+            pci_space.header.subsystem_vendor_id = device.read<uint16_t>(0x2C);
+            pci_space.header.subsystem_device_id = device.read<uint16_t>(0x2E);
+            pci_space.header.header_type = 0; // Only ever a single function to the guest
+
+            // Nothing is decoded and nothing is DMA'd until the guest turns it on
+            device.set_privileges(0);
+            device.write<uint16_t>(4, device.read<uint16_t>(4) | (1 << 10)); // INTx Disable
+
+            for(uint8_t i = 0; i < 6; i++) {
+                auto raw = device.read<uint32_t>(0x10 + i * 4);
+                auto bar = device.read_bar(i);
+                if(bar.type == ::pci::Bar::Type::Invalid || bar.len == 0)
+                    continue;
+
+                bool is_mmio = bar.type == ::pci::Bar::Type::Mmio;
+                bool is64 = is_mmio && ((raw >> 1) & 3) == 2;
+
+                // MMIO BARs are mapped with page granularity, so sub-page ones are rounded up and fully trapped
+                auto size = is_mmio ? max(bar.len, pmm::block_size) : bar.len;
+                pci_init_bar(i, size, is_mmio, is64, is_mmio && (raw & (1 << 3)));
+                bars[i] = {.host = bar.base, .len = bar.len, .size = size, .guest = 0, .mapped = false};
+
+                if(is64)
+                    i++;
+            }
+
+            init_irqs();
+            map_trapped();
+            mirror_ram();
+
+            vm->cpus[0].add_kick_handler(deliver, this);
+
+            print("passthrough: {}:{}.{} -> 00:{}.0, {:#x}:{:#x}\n", (uint16_t)device.bus, (uint16_t)device.slot, (uint16_t)device.func, (uint16_t)slot, (uint16_t)pci_space.header.vendor_id, (uint16_t)pci_space.header.device_id);
+        }
+
+        void pci_write(const vm::pci::DeviceID dev, uint16_t reg, uint32_t value, uint8_t size) {
+            PCIDriver::pci_write(dev, reg, value, size);
+
+            // Bus Mastering is only given to the device when the guest driver wants it, the decode bits just follow the guest's so nothing stays enabled behind its back
+            if(ranges_overlap(reg, size, 4, 2))
+                device.set_privileges(pci_space.header.command & (::pci::privileges::Pio | ::pci::privileges::Mmio | ::pci::privileges::Dma));
+        }
+
+        void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
+            if(msix && msix->handles_pci(reg))
+                msix->pci_write(reg, value, size);
+            else if(has_msi && reg >= msi_cap_offset && reg < (msi_cap_offset + msi_cap_size))
+                msi_write(reg, value, size);
+            // Everything else of the host config space is hidden, and writes to it are dropped
+        }
+
+        uint32_t pci_handle_read(uint16_t reg, uint8_t size) {
+            if(msix && msix->handles_pci(reg))
+                return msix->pci_read(reg, size);
+
+            if(has_msi && reg >= msi_cap_offset && reg < (msi_cap_offset + msi_cap_size)) {
+                switch (size) {
+                    case 1: return pci_space.data8[reg];
+                    case 2: return pci_space.data16[reg / 2];
+                    case 4: return pci_space.data32[reg / 4];
+                    default: PANIC("Unknown PCI Access size");
+                }
+            }
+
+            return 0;
+        }
+
+        void pci_update_bars() {
+            for(uint8_t i = 0; i < 6; i++) {
+                auto& bar = bars[i];
+                if(!bar.len)
+                    continue;
+
+                if(bar.mapped)
+                    unmap_bar(i);
+
+                bool is_mmio = pci_bars[i].is_mmio;
+                if(!(pci_space.header.command & (is_mmio ? (1 << 1) : (1 << 0))))
+                    continue;
+
+                uint64_t base = pci_space.header.bar[i] & (is_mmio ? ~0xFull : ~0x3ull);
+                if(pci_bars[i].is64)
+                    base |= (uint64_t)pci_space.header.bar[i + 1] << 32;
+
+                if(base == 0)
+                    continue; // Not placed yet
+
+                bar.guest = base;
+                map_bar(i);
+            }
+        }
+
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+            uint8_t i = 0;
+            auto offset = bar_offset(addr, i);
+
+            if(is_msix_bar(i) && msix->handles_mmio(offset))
+                msix->mmio_write(offset, value, size);
+            else if(!hits_host_msix(i, offset, size)) // The rest of the host table stays under host control
+                mmio_forward(i, offset, value, size, true);
+        }
+
+        uint64_t mmio_read(uintptr_t addr, uint8_t size) {
+            uint8_t i = 0;
+            auto offset = bar_offset(addr, i);
+
+            if(is_msix_bar(i) && msix->handles_mmio(offset))
+                return msix->mmio_read(offset, size);
+            else if(hits_host_msix(i, offset, size))
+                return 0;
+
+            return mmio_forward(i, offset, 0, size, false);
+        }
+
+        void pio_write(uint16_t port, uint32_t value, uint8_t size) {
+            auto host = pio_host_port(port);
+            switch (size) {
+                case 1: pio::outb(host, value); break;
+                case 2: pio::outw(host, value); break;
+                case 4: pio::outd(host, value); break;
+                default: PANIC("Unknown PIO size");
+            }
+        }
+
+        uint32_t pio_read(uint16_t port, uint8_t size) {
+            auto host = pio_host_port(port);
+            switch (size) {
+                case 1: return pio::inb(host);
+                case 2: return pio::inw(host);
+                case 4: return pio::ind(host);
+                default: PANIC("Unknown PIO size");
+            }
+        }
+
+        private:
+        struct Bar {
+            uint64_t host;
+            size_t len, size; // Host decoded length, and the length the guest sees
+            uint64_t guest;
+            bool mapped;
+        };
+
+        void init_irqs() {
+            // The emulated MSI-X table uses the host layout, and is only trapped if both live in the same BAR
+            if(device.msix.supported && device.msix.table.bar == device.msix.pending.bar) {
+                n_vectors = min(device.msix.n_messages, max_vectors);
+                msix = new pci::msix::Capability{vm, pci_space, msix_cap_offset, (uint16_t)n_vectors, device.msix.table.bar, device.msix.table.offset, device.msix.pending.offset};
+            } else if(device.msi.supported) {
+                n_vectors = 1; // The host only does single message MSI
+                has_msi = true;
+
+                pci_space.data8[msi_cap_offset] = ::pci::msi::id;
+                pci_space.data8[msi_cap_offset + 1] = pci_space.header.capabilities;
+                pci_space.data16[(msi_cap_offset + 2) / 2] = (1 << 7); // 64bit capable, 1 message
+
+                pci_space.header.capabilities = msi_cap_offset;
+                pci_space.header.status |= (1 << 4); // Capabilities List
+            } else {
+                print("passthrough: Device has no MSI or MSI-X, guest won't get any interrupts\n");
+                return;
+            }
+
+            device.set_privileges(::pci::privileges::Mmio); // For the host MSI-X table
+            for(size_t i = 0; i < n_vectors; i++) {
+                host_vectors[i] = {.self = this, .index = (uint8_t)i};
+
+                auto vector = idt::allocate_vector();
+                idt::set_handler(vector, idt::handler{.f = [](uint8_t, idt::regs*, void* userptr) {
+                    auto& host_vector = *(HostVector*)userptr;
+
+                    __atomic_fetch_or(&host_vector.self->irq_pending, 1u << host_vector.index, __ATOMIC_RELEASE);
+                    host_vector.self->vm->cpus[0].kick();
+                }, .is_irq = true, .should_iret = true, .userptr = &host_vectors[i]});
+
+                device.enable_irq(i, vector);
+            }
+            device.set_privileges(0);
+        }
+
+        // Trapped accesses that aren't emulated are forwarded through the host mapping of the BAR
+        void map_trapped() {
+            auto& kvmm = vmm::kernel_vmm::get_instance();
+            for(uint8_t i = 0; i < 6; i++) {
+                if(!bars[i].len || !pci_bars[i].is_mmio)
+                    continue;
+
+                for(size_t off = 0; off < bars[i].len; off += pmm::block_size)
+                    if(bars[i].len < pmm::block_size || is_trapped_page(i, off))
+                        kvmm.map(bars[i].host + off, bars[i].host + off + phys_mem_map, paging::mapPagePresent | paging::mapPageWrite, msr::pat::uc);
+            }
+        }
+
+        // The device DMAs to GPAs, so its IOMMU domain maps them to the same host pages the EPT/NPT does
+        void mirror_ram() {
+            vm->ram_pinned = true;
+            print("passthrough: Guest RAM is pinned for DMA, ballooning is disabled\n");
+
+            for(const auto& [base, size] : vm->ram) {
+                for(size_t off = 0; off < size; off += pmm::block_size) {
+                    auto hpa = vm->get_phys(base + off); // Also populates discarded pages
+                    if(hpa)
+                        iommu::map(device, hpa, base + off, paging::mapPagePresent | paging::mapPageWrite);
+                }
+            }
+        }
+
+        static void deliver(VCPU*, void* userptr) {
+            auto& self = *(Driver*)userptr;
+
+            auto pending = __atomic_exchange_n(&self.irq_pending, 0, __ATOMIC_ACQ_REL);
+            for(uint8_t i = 0; i < self.n_vectors; i++) {
+                if(!(pending & (1u << i)))
+                    continue;
+
+                if(self.msix)
+                    self.msix->trigger(i);
+                else if(self.has_msi && (self.pci_space.data16[(msi_cap_offset + 2) / 2] & 1)) // MSI Enable
+                    self.vm->send_msi(self.pci_space.data32[(msi_cap_offset + 4) / 4] | ((uint64_t)self.pci_space.data32[(msi_cap_offset + 8) / 4] << 32), self.pci_space.data16[(msi_cap_offset + 0xC) / 2]);
+            }
+        }
+
+        void msi_write(uint16_t reg, uint32_t value, uint8_t size) {
+            for(uint8_t i = 0; i < size; i++) {
+                uint16_t byte_reg = reg + i;
+                uint8_t byte = value >> (i * 8);
+
+                if(byte_reg == (msi_cap_offset + 2)) // Only MSI Enable, the host does a single message regardless of MME
+                    pci_space.data8[byte_reg] = (pci_space.data8[byte_reg] & ~1) | (byte & 1);
+                else if(byte_reg >= (msi_cap_offset + 4) && byte_reg < (msi_cap_offset + msi_cap_size))
+                    pci_space.data8[byte_reg] = byte;
+            }
+        }
+
+        // Host MSI-X table and PBA pages of a BAR, these are trapped instead of mapped
+        bool is_trapped_page(uint8_t i, size_t offset) const {
+            if(!msix || i != device.msix.table.bar)
+                return false;
+
+            auto page = offset & ~(pmm::block_size - 1);
+            auto table_end = device.msix.table.offset + device.msix.n_messages * pci::msix::entry_size;
+            auto pba_end = device.msix.pending.offset + div_ceil(device.msix.n_messages, 64) * sizeof(uint64_t);
+
+            return ranges_overlap(page, pmm::block_size, device.msix.table.offset, table_end - device.msix.table.offset) || ranges_overlap(page, pmm::block_size, device.msix.pending.offset, pba_end - device.msix.pending.offset);
+        }
+
+        bool is_msix_bar(uint8_t i) const { return msix && i == device.msix.table.bar; }
+
+        bool hits_host_msix(uint8_t i, size_t offset, uint8_t size) const {
+            if(!is_msix_bar(i))
+                return false;
+
+            auto table_size = device.msix.n_messages * pci::msix::entry_size;
+            auto pba_size = div_ceil(device.msix.n_messages, 64) * sizeof(uint64_t);
+
+            return ranges_overlap(offset, size, device.msix.table.offset, table_size) || ranges_overlap(offset, size, device.msix.pending.offset, pba_size);
+        }
+
+        void map_bar(uint8_t i) {
+            auto& bar = bars[i];
+
+            if(!pci_bars[i].is_mmio) {
+                for(size_t port = 0; port < bar.len; port++)
+                    vm->pio_map[bar.guest + port] = this;
+            } else if(bar.len < pmm::block_size) {
+                vm->mmio_map[bar.guest] = {this, bar.size}; // The whole guest BAR, accesses to the padding are dropped by mmio_forward
+            } else {
+                // Guests map MMIO uncached through their PAT, which takes precedence over the write-back EPT/NPT type
+                for(size_t off = 0; off < bar.len; off += pmm::block_size) {
+                    if(is_trapped_page(i, off))
+                        vm->mmio_map[bar.guest + off] = {this, pmm::block_size};
+                    else
+                        vm->mm->map(bar.host + off, bar.guest + off, paging::mapPagePresent | paging::mapPageWrite);
+                }
+            }
+
+            bar.mapped = true;
+        }
+
+        void unmap_bar(uint8_t i) {
+            auto& bar = bars[i];
+
+            if(!pci_bars[i].is_mmio) {
+                for(size_t port = 0; port < bar.len; port++)
+                    vm->pio_map.erase(bar.guest + port);
+            } else if(bar.len < pmm::block_size) {
+                vm->mmio_map.erase(bar.guest);
+            } else {
+                for(size_t off = 0; off < bar.len; off += pmm::block_size) {
+                    if(is_trapped_page(i, off))
+                        vm->mmio_map.erase(bar.guest + off);
+                    else
+                        vm->mm->unmap(bar.guest + off);
+                }
+            }
+
+            bar.mapped = false;
+        }
+
+        size_t bar_offset(uintptr_t addr, uint8_t& i) const {
+            for(i = 0; i < 6; i++)
+                if(bars[i].mapped && pci_bars[i].is_mmio && addr >= bars[i].guest && addr < (bars[i].guest + bars[i].size))
+                    return addr - bars[i].guest;
+
+            PANIC("MMIO access outside of any BAR");
+        }
+
+        uint16_t pio_host_port(uint16_t port) const {
+            for(uint8_t i = 0; i < 6; i++)
+                if(bars[i].mapped && !pci_bars[i].is_mmio && port >= bars[i].guest && port < (bars[i].guest + bars[i].len))
+                    return bars[i].host + (port - bars[i].guest);
+
+            PANIC("PIO access outside of any BAR");
+        }
+
+        uint64_t mmio_forward(uint8_t i, size_t offset, uint64_t value, uint8_t size, bool write) {
+            if(offset + size > bars[i].len)
+                return 0; // Padding of a sub-page BAR
+
+            auto va = bars[i].host + offset + phys_mem_map;
+            if(write) {
+                switch (size) {
+                    case 1: *(volatile uint8_t*)va = value; break;
+                    case 2: *(volatile uint16_t*)va = value; break;
+                    case 4: *(volatile uint32_t*)va = value; break;
+                    case 8: *(volatile uint64_t*)va = value; break;
+                    default: PANIC("Unknown MMIO size");
+                }
+                return 0;
+            }
+
+            switch (size) {
+                case 1: return *(volatile uint8_t*)va;
+                case 2: return *(volatile uint16_t*)va;
+                case 4: return *(volatile uint32_t*)va;
+                case 8: return *(volatile uint64_t*)va;
+                default: PANIC("Unknown MMIO size");
+            }
+        }
+
+        Vm* vm;
+        ::pci::Device& device;
+
+        Bar bars[6] = {};
+
+        pci::msix::Capability* msix = nullptr;
+        bool has_msi = false;
+
+        struct HostVector {
+            Driver* self;
+            uint8_t index;
+        } host_vectors[max_vectors] = {};
+        size_t n_vectors = 0;
+        uint32_t irq_pending = 0;
+    };
+} // namespace vm::pci::passthrough
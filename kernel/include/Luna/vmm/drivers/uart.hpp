@@ -4,7 +4,11 @@
 #include <Luna/vmm/vm.hpp>
 
 #include <Luna/misc/log.hpp>
+#include <Luna/drivers/uart.hpp>
 
+// 16550A with 16 byte FIFOs, transmitted bytes leave the THR immediately, so the transmitter is always empty and THRE fires right after every write
+// Output is buffered on the host side and handed to the logger on a VCPU timer, so a chatty guest causes a bounded number of redraws instead of one per line
+// Input is polled from a host UART on the same timer, which also drives the character timeout interrupt
 namespace vm::uart {
     constexpr uint32_t clock = 115200;
 
@@ -18,8 +22,57 @@ namespace vm::uart {
     constexpr uint8_t modem_status_reg = 6;
     constexpr uint8_t scratch_reg = 7;
 
+    constexpr size_t fifo_size = 16;
+    constexpr size_t output_buf_size = 0x1000;
+    constexpr uint64_t poll_interval_ms = 25;
+
+    namespace ier {
+        constexpr uint8_t rx_available = (1 << 0);
+        constexpr uint8_t thr_empty = (1 << 1);
+        constexpr uint8_t line_status = (1 << 2);
+        constexpr uint8_t modem_status = (1 << 3);
+    } // namespace ier
+
+    namespace iir {
+        constexpr uint8_t none = 0x1;
+        constexpr uint8_t modem_status = 0x0;
+        constexpr uint8_t thr_empty = 0x2;
+        constexpr uint8_t rx_available = 0x4;
+        constexpr uint8_t line_status = 0x6;
+        constexpr uint8_t timeout = 0xC;
+        constexpr uint8_t fifo_enabled = 0xC0;
+    } // namespace iir
+
+    namespace fcr {
+        constexpr uint8_t enable = (1 << 0);
+        constexpr uint8_t clear_rx = (1 << 1);
+        constexpr uint8_t clear_tx = (1 << 2);
+    } // namespace fcr
+
+    namespace lsr {
+        constexpr uint8_t data_ready = (1 << 0);
+        constexpr uint8_t overrun = (1 << 1);
+        constexpr uint8_t thr_empty = (1 << 5);
+        constexpr uint8_t tx_empty = (1 << 6);
+    } // namespace lsr
+
+    namespace mcr {
+        constexpr uint8_t dtr = (1 << 0);
+        constexpr uint8_t rts = (1 << 1);
+        constexpr uint8_t out1 = (1 << 2);
+        constexpr uint8_t out2 = (1 << 3); // Gates the IRQ on PCs
+        constexpr uint8_t loopback = (1 << 4);
+    } // namespace mcr
+
+    namespace msr {
+        constexpr uint8_t cts = (1 << 4);
+        constexpr uint8_t dsr = (1 << 5);
+        constexpr uint8_t ri = (1 << 6);
+        constexpr uint8_t dcd = (1 << 7);
+    } // namespace msr
+
     struct Driver : public vm::AbstractPIODriver {
-        Driver(Vm* vm, uint16_t base, log::Logger* logger): base{base}, baud{3}, dlab{false}, logger{logger} {
+        Driver(Vm* vm, uint16_t base, uint8_t irq, log::Logger* logger, const ::uart::Writer* input = nullptr): vm{vm}, base{base}, irq{irq}, baud{3}, dlab{false}, logger{logger}, input{input} {
             vm->pio_map[base + data_reg] = this;
             vm->pio_map[base + irq_enable_reg] = this;
             vm->pio_map[base + fifo_control_reg] = this;
@@ -29,77 +82,233 @@ namespace vm::uart {
             vm->pio_map[base + modem_status_reg] = this;
             vm->pio_map[base + scratch_reg] = this;
 
-            iir = 2;
+            arm_poll();
         }
 
         void pio_write(uint16_t port, uint32_t value, [[maybe_unused]] uint8_t size) {
             if(port == (base + data_reg)) {
                 if(!dlab) {
-                    logger->putc(value);
+                    thre_pending = false;
+                    update_irq();
+
+                    if(mcr & mcr::loopback)
+                        receive(value);
+                    else
+                        transmit(value);
 
-                    if(value == '\n')
-                        logger->flush();
+                    thre_pending = true;
                 } else {
                     baud &= ~0xFF;
                     baud |= value;
                 }
             } else if(port == (base + irq_enable_reg)) {
                 if(!dlab) {
-                    ier = value;
+                    // Enabling THRE with an empty transmitter raises it straight away, drivers kick off transmission like that
+                    if((value & ier::thr_empty) && !(ier & ier::thr_empty))
+                        thre_pending = true;
+
+                    ier = value & 0xF;
                 } else {
                     baud &= ~0xFF00;
                     baud |= (value << 8);
                 }
+            } else if(port == (base + fifo_control_reg)) {
+                bool enable = value & fcr::enable;
+                if(enable != fifo_enabled || (value & fcr::clear_rx))
+                    rx_clear();
+
+                fifo_enabled = enable;
+                rx_trigger = fifo_enabled ? rx_triggers[(value >> 6) & 3] : 1;
             } else if(port == (base + line_control_reg)) {
                 auto new_dlab = (value >> 7) & 1;
-                if(dlab && !new_dlab)
-                    print("uart: New baudrate {:d}\n", clock * baud);
+                if(dlab && !new_dlab && baud)
+                    print("uart: New baudrate {:d}\n", clock / baud);
 
                 dlab = new_dlab;
-
-                /*char parity = 'U';
-                switch ((value >> 3) & 0b111) {
-                    case 0b000: parity = 'N'; break;
-                    case 0b001: parity = 'O'; break;
-                    case 0b011: parity = 'E'; break;
-                }
-                print("uart: Set config {}{}{}\n", (value & 0b11) + 5, parity, (value & (1 << 2)) ? 2 : 1);*/
+                lcr = value;
+            } else if(port == (base + modem_control_reg)) {
+                mcr = value & 0x1F;
+            } else if(port == (base + scratch_reg)) {
+                scratch = value;
             } else {
                 print("uart: Unhandled write to reg {} (Port: {:#x}): {:#x}\n", port - base, port, value);
             }
+
+            update_irq();
         }
 
         uint32_t pio_read(uint16_t port, [[maybe_unused]] uint8_t size) {
+            uint32_t ret = 0;
             if(port == (base + data_reg)) {
-                if(!dlab)
-                    return ' '; // Just send spaces for now
-                else
-                    return baud & 0xFF;
+                if(!dlab) {
+                    ret = rx_pop();
+                    rx_activity = true;
+                    timeout_pending = false;
+                } else {
+                    ret = baud & 0xFF;
+                }
             } else if(port == (base + irq_enable_reg)) {
                 if(!dlab)
-                    return ier;
+                    ret = ier;
                 else
-                    return (baud >> 8) & 0xFF;
+                    ret = (baud >> 8) & 0xFF;
             } else if(port == (base + irq_identification_reg)) {
-                return iir;
+                ret = irq_identification() | (fifo_enabled ? iir::fifo_enabled : 0);
+                if((ret & 0xF) == iir::thr_empty)
+                    thre_pending = false; // Reading IIR acknowledges THRE when that's what it reports
             } else if(port == (base + line_control_reg)) {
-                return (dlab << 7);
+                ret = (lcr & 0x7F) | (dlab << 7);
+            } else if(port == (base + modem_control_reg)) {
+                ret = mcr;
             } else if(port == (base + line_status_reg)) {
-                return (1 << 6) | (1 << 5); // Transmitter Idle, can send bits
+                ret = lsr::thr_empty | lsr::tx_empty | (rx_count ? lsr::data_ready : 0) | (overrun ? lsr::overrun : 0);
+                overrun = false;
+            } else if(port == (base + modem_status_reg)) {
+                if(mcr & mcr::loopback) // Modem outputs are wired back to the inputs
+                    ret = ((mcr & mcr::rts) ? msr::cts : 0) | ((mcr & mcr::dtr) ? msr::dsr : 0) | ((mcr & mcr::out1) ? msr::ri : 0) | ((mcr & mcr::out2) ? msr::dcd : 0);
+                else
+                    ret = msr::dcd | msr::dsr | msr::cts;
+            } else if(port == (base + scratch_reg)) {
+                ret = scratch;
+            } else {
+                print("uart: Unhandled read from reg {} (Port: {:#x})\n", port - base, port);
             }
 
-            print("uart: Unhandled read from reg {} (Port: {:#x})\n", port - base, port);
-            return 0;
+            update_irq();
+            return ret;
         }
 
         private:
+        static constexpr uint8_t rx_triggers[] = {1, 4, 8, 14};
+
+        void transmit(uint8_t c) {
+            if(output_size == output_buf_size)
+                drain(false); // Keeps memory bounded, the redraw still waits for the timer
+
+            output[output_size++] = c;
+        }
+
+        // Hands everything to the logger except an unfinished escape sequence, which the log window can't parse in halves
+        void drain(bool flush) {
+            size_t end = output_size;
+            for(size_t i = output_size; i > 0 && (output_size - i) < 16; i--) {
+                if(output[i - 1] == 0x1B) {
+                    bool complete = false;
+                    for(size_t j = i + 1; j < output_size; j++)
+                        if(output[j] >= 0x40 && output[j] <= 0x7E)
+                            complete = true;
+
+                    if(!complete)
+                        end = i - 1;
+                    break;
+                }
+            }
+
+            for(size_t i = 0; i < end; i++)
+                logger->putc(output[i]);
+
+            output_size -= end;
+            for(size_t i = 0; i < output_size; i++)
+                output[i] = output[end + i];
+
+            if(flush && end)
+                logger->flush();
+        }
+
+        void receive(uint8_t c) {
+            rx_activity = true;
+
+            if(rx_count == rx_capacity()) {
+                overrun = true;
+                return;
+            }
+
+            rx_fifo[(rx_head + rx_count) % fifo_size] = c;
+            rx_count++;
+        }
+
+        uint8_t rx_pop() {
+            if(!rx_count)
+                return 0;
+
+            auto c = rx_fifo[rx_head];
+            rx_head = (rx_head + 1) % fifo_size;
+            rx_count--;
+            return c;
+        }
+
+        size_t rx_capacity() const { return fifo_enabled ? fifo_size : 1; }
+
+        void rx_clear() {
+            rx_head = 0;
+            rx_count = 0;
+            timeout_pending = false;
+        }
+
+        uint8_t irq_identification() const {
+            if((ier & ier::line_status) && overrun)
+                return iir::line_status;
+            else if((ier & ier::rx_available) && rx_count >= rx_trigger)
+                return iir::rx_available;
+            else if((ier & ier::rx_available) && timeout_pending && rx_count)
+                return iir::timeout;
+            else if((ier & ier::thr_empty) && thre_pending)
+                return iir::thr_empty;
+
+            return iir::none;
+        }
+
+        void update_irq() {
+            bool level = (irq_identification() != iir::none) && (mcr & mcr::out2);
+            if(level != irq_level)
+                vm->set_irq(irq, level);
+
+            irq_level = level;
+        }
+
+        void arm_poll() {
+            vm->cpus[0].start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * poll_interval_ms, poll, this);
+        }
+
+        static void poll(VCPU*, void* userptr) {
+            auto& self = *(Driver*)userptr;
+            self.arm_poll();
+
+            if(self.output_size)
+                self.drain(true);
+
+            // Data sitting below the trigger level without anything happening to it for a whole interval times out
+            if(self.rx_count && self.rx_count < self.rx_trigger && !self.rx_activity)
+                self.timeout_pending = true;
+            self.rx_activity = false;
+
+            uint8_t c = 0;
+            while(self.input && !(self.mcr & mcr::loopback) && self.rx_count < self.rx_capacity() && self.input->getc(c))
+                self.receive(c);
+
+            self.update_irq();
+        }
+
+        Vm* vm;
         uint16_t base;
-        uint8_t ier, iir;
+        uint8_t irq;
 
+        uint8_t ier = 0, lcr = 0, mcr = 0, scratch = 0;
         uint16_t baud;
-
         bool dlab;
 
+        bool fifo_enabled = false;
+        uint8_t rx_trigger = 1;
+        uint8_t rx_fifo[fifo_size] = {};
+        size_t rx_head = 0, rx_count = 0;
+        bool rx_activity = false, overrun = false;
+
+        bool thre_pending = false, timeout_pending = false, irq_level = false;
+
         log::Logger* logger;
+        const ::uart::Writer* input;
+
+        uint8_t output[output_buf_size];
+        size_t output_size = 0;
     };
 } // namespace vm::uart
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+
+#include <Luna/fs/vfs.hpp>
+
+// Paravirtual block device, every queue is independent, so guests can give each CPU its own
+// Requests are a header, the data buffers, and a status byte, one notify can submit a whole batch of them
+namespace vm::virtio::blk {
+    constexpr uint16_t device_type = 2;
+    constexpr uint16_t n_queues = 4;
+    constexpr size_t sector_size = 512;
+
+    // Chain lengths come from the guest, so bound the transfer size, every segment is at most size_max and a request at most seg_max of them
+    constexpr uint32_t size_max = 0x1'0000;
+    constexpr uint32_t seg_max = 64;
+    constexpr size_t max_transfer_size = size_max * seg_max;
+    constexpr size_t chunk_size = 0x1'0000; // Bounce buffer size when the data can't go straight to guest memory
+    constexpr uint32_t max_discard_segments = 64;
+    constexpr uint32_t max_zeroes_sectors = 0x10000;
+
+    namespace features {
+        constexpr uint64_t size_max = (1 << 1);
+        constexpr uint64_t seg_max = (1 << 2);
+        constexpr uint64_t blk_size = (1 << 6);
+        constexpr uint64_t flush = (1 << 9);
+        constexpr uint64_t mq = (1 << 12);
+        constexpr uint64_t discard = (1 << 13);
+        constexpr uint64_t write_zeroes = (1 << 14);
+    } // namespace features
+
+    namespace types {
+        constexpr uint32_t in = 0;
+        constexpr uint32_t out = 1;
+        constexpr uint32_t flush = 4;
+        constexpr uint32_t get_id = 8;
+        constexpr uint32_t discard = 11;
+        constexpr uint32_t write_zeroes = 13;
+    } // namespace types
+
+    namespace status {
+        constexpr uint8_t ok = 0;
+        constexpr uint8_t io_error = 1;
+        constexpr uint8_t unsupported = 2;
+    } // namespace status
+
+    struct [[gnu::packed]] Config {
+        uint64_t capacity; // In 512 byte sectors, regardless of blk_size
+        uint32_t size_max;
+        uint32_t seg_max;
+        struct [[gnu::packed]] {
+            uint16_t cylinders;
+            uint8_t heads, sectors;
+        } geometry;
+        uint32_t blk_size;
+        struct [[gnu::packed]] {
+            uint8_t physical_block_exp, alignment_offset;
+            uint16_t min_io_size;
+            uint32_t opt_io_size;
+        } topology;
+        uint8_t writeback, unused0;
+        uint16_t num_queues;
+        uint32_t max_discard_sectors, max_discard_seg, discard_sector_alignment;
+        uint32_t max_write_zeroes_sectors, max_write_zeroes_seg;
+        uint8_t write_zeroes_may_unmap, unused1[3];
+    };
+    static_assert(sizeof(Config) == 60);
+
+    struct [[gnu::packed]] RequestHeader {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+    };
+
+    struct [[gnu::packed]] DiscardSegment {
+        uint64_t sector;
+        uint32_t n_sectors;
+        uint32_t flags;
+    };
+
+    struct Driver : public virtio::Device {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, vfs::File* file): virtio::Device{vm, bridge, slot, device_type, n_queues,
+                                                                                                 features::size_max | features::seg_max | features::blk_size | features::flush | features::mq | features::discard | features::write_zeroes}, file{file} {
+            pci_space.header.class_id = 1; // Storage
+            pci_space.header.subclass = 0; // SCSI, what other virtio-blk devices report
+
+            config.capacity = file->get_size() / sector_size;
+            config.size_max = size_max;
+            config.seg_max = seg_max;
+            config.blk_size = sector_size;
+            config.num_queues = n_queues;
+            config.max_discard_sectors = max_zeroes_sectors;
+            config.max_discard_seg = max_discard_segments;
+            config.discard_sector_alignment = 1;
+            config.max_write_zeroes_sectors = max_zeroes_sectors;
+            config.max_write_zeroes_seg = max_discard_segments;
+        }
+
+        private:
+        uint32_t config_read(uint16_t offset, uint8_t size) {
+            if(offset >= sizeof(Config))
+                return 0;
+
+            uint32_t value = 0;
+            memcpy(&value, (uint8_t*)&config + offset, min(min(size, sizeof(value)), sizeof(Config) - offset));
+            return value;
+        }
+
+        void queue_notify(uint16_t q) {
+            process(q, [this](Queue& queue, const Chain& chain) { handle(queue, chain); });
+        }
+
+        void handle(Queue& queue, const Chain& chain) {
+            RequestHeader header{};
+            if(chain.readable < sizeof(header) || chain.writable < 1) {
+                print("virtio-blk: Request without header or status\n");
+                queue.push(chain, 0);
+                return;
+            }
+            queue.read(chain, 0, {(uint8_t*)&header, sizeof(header)});
+
+            // The status byte is always the last writable byte
+            size_t in_len = chain.writable - 1, out_len = chain.readable - sizeof(header);
+            uint32_t written = 1;
+
+            uint8_t res = status::ok;
+            switch (header.type) {
+                case types::in:
+                    res = read(queue, chain, header.sector, in_len);
+                    written += in_len;
+                    break;
+                case types::out:
+                    res = write(queue, chain, header.sector, out_len);
+                    break;
+                case types::flush:
+                    break; // Writes go straight to the backing file
+                case types::get_id: {
+                    char id[20] = "luna-virtio-blk";
+                    written += queue.write(chain, 0, {(uint8_t*)id, min(in_len, sizeof(id))});
+                    break;
+                }
+                case types::discard:
+                case types::write_zeroes:
+                    res = handle_segments(queue, chain, header.type, out_len);
+                    break;
+                default:
+                    res = status::unsupported;
+                    break;
+            }
+
+            queue.write(chain, chain.writable - 1, {&res, 1});
+            queue.push(chain, written);
+        }
+
+        bool in_range(uint64_t sector, size_t len) {
+            return (len % sector_size) == 0 && sector <= config.capacity && (len / sector_size) <= (config.capacity - sector);
+        }
+
+        uint8_t read(Queue& queue, const Chain& chain, uint64_t sector, size_t len) {
+            if(len > max_transfer_size || !in_range(sector, len))
+                return status::io_error;
+
+            // Straight into guest memory, unless the replay log has to see the payload
+            if(vm->replay_log.get_mode() == replay::Mode::Off) {
+                std::vector<std::span<uint8_t>> segments;
+                queue.map(chain, true, 0, len, segments);
+
+                return file->read_sg(sector * sector_size, {segments.data(), segments.size()}) == len ? status::ok : status::io_error;
+            }
+
+            auto* buf = new uint8_t[chunk_size];
+
+            bool success = true;
+            for(size_t offset = 0; offset < len && success; offset += chunk_size) {
+                auto chunk = min(chunk_size, len - offset);
+                success = file->read(sector * sector_size + offset, chunk, buf) == chunk;
+                if(success)
+                    queue.write(chain, offset, {buf, chunk});
+            }
+
+            delete[] buf;
+            return success ? status::ok : status::io_error;
+        }
+
+        uint8_t write(Queue& queue, const Chain& chain, uint64_t sector, size_t len) {
+            if(len > max_transfer_size || !in_range(sector, len))
+                return status::io_error;
+
+            auto* buf = new uint8_t[chunk_size];
+
+            bool success = true;
+            for(size_t offset = 0; offset < len && success; offset += chunk_size) {
+                auto chunk = min(chunk_size, len - offset);
+                queue.read(chain, sizeof(RequestHeader) + offset, {buf, chunk});
+                success = file->write(sector * sector_size + offset, chunk, buf) == chunk;
+            }
+
+            delete[] buf;
+            return success ? status::ok : status::io_error;
+        }
+
+        uint8_t handle_segments(Queue& queue, const Chain& chain, uint32_t type, size_t len) {
+            auto n = len / sizeof(DiscardSegment);
+            if(n == 0 || n > max_discard_segments || (len % sizeof(DiscardSegment)) != 0)
+                return status::unsupported;
+
+            DiscardSegment segments[max_discard_segments];
+            queue.read(chain, sizeof(RequestHeader), {(uint8_t*)segments, len});
+
+            for(size_t i = 0; i < n; i++) {
+                auto sector = segments[i].sector;
+                size_t n_sectors = segments[i].n_sectors;
+                if(n_sectors > max_zeroes_sectors || !in_range(sector, n_sectors * sector_size))
+                    return status::io_error;
+
+                // Backing files can't be made sparse, so there's nothing to do for discards
+                if(type == types::discard)
+                    continue;
+
+                constexpr size_t chunk_sectors = pmm::block_size / sector_size;
+                auto* zero = new uint8_t[pmm::block_size]{};
+
+                bool success = true;
+                for(size_t j = 0; j < n_sectors && success; j += chunk_sectors) {
+                    auto chunk = min(chunk_sectors, n_sectors - j) * sector_size;
+                    success = file->write((sector + j) * sector_size, chunk, zero) == chunk;
+                }
+
+                delete[] zero;
+                if(!success)
+                    return status::io_error;
+            }
+
+            return status::ok;
+        }
+
+        Config config{};
+        vfs::File* file;
+    };
+} // namespace vm::virtio::blk
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+
+#include <Luna/fs/vfs.hpp>
+#include <std/vector.hpp>
+
+// Paravirtual console, a guest can hand over as much output as fits in its buffers with a single notify instead of exiting for every byte
+// With multiport every port gets its own pair of queues, port 0 is the console, the other ports are named and show up as /dev/vport* in guests
+// Output goes to a logger, which is only flushed once per batch, and optionally to a file
+namespace vm::virtio::console {
+    constexpr uint16_t device_type = 3;
+    constexpr uint32_t max_ports = 4;
+    constexpr uint16_t n_queues = 2 * (max_ports + 1); // Port 0, control, ports 1 and up
+
+    constexpr uint16_t control_rx_queue = 2, control_tx_queue = 3;
+
+    namespace features {
+        constexpr uint64_t multiport = (1 << 1);
+        constexpr uint64_t emerg_write = (1 << 2);
+    } // namespace features
+
+    namespace events {
+        constexpr uint16_t device_ready = 0;
+        constexpr uint16_t device_add = 1;
+        constexpr uint16_t port_ready = 3;
+        constexpr uint16_t console_port = 4;
+        constexpr uint16_t port_open = 6;
+        constexpr uint16_t port_name = 7;
+    } // namespace events
+
+    struct [[gnu::packed]] Config {
+        uint16_t cols, rows;
+        uint32_t max_nr_ports;
+        uint32_t emerg_wr;
+    };
+    static_assert(sizeof(Config) == 12);
+
+    struct [[gnu::packed]] ControlMsg {
+        uint32_t id;
+        uint16_t event, value;
+    };
+
+    struct Driver : public virtio::Device {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot): virtio::Device{vm, bridge, slot, device_type, n_queues, features::multiport | features::emerg_write} {
+            pci_space.header.class_id = 7; // Communication Controller
+            pci_space.header.subclass = 0x80; // Other
+
+            config.max_nr_ports = max_ports;
+        }
+
+        // The first port added is the console, file is written from the start and not grown, as echfs files can't be
+        void add_port(const char* name, log::Logger* logger, vfs::File* file = nullptr) {
+            ASSERT(n_ports < max_ports);
+            ports[n_ports++] = {.name = name, .logger = logger, .file = file, .file_offset = 0};
+        }
+
+        private:
+        struct Port {
+            const char* name;
+            log::Logger* logger;
+            vfs::File* file;
+            size_t file_offset;
+        };
+
+        uint32_t config_read(uint16_t offset, uint8_t size) {
+            if(offset >= sizeof(Config))
+                return 0;
+
+            uint32_t value = 0;
+            memcpy(&value, (uint8_t*)&config + offset, min(min(size, sizeof(value)), sizeof(Config) - offset));
+            return value;
+        }
+
+        void config_write(uint16_t offset, uint64_t value, [[maybe_unused]] uint8_t size) {
+            if(offset != offsetof(Config, emerg_wr) || !n_ports)
+                return;
+
+            uint8_t c = value;
+            output(ports[0], {&c, 1});
+            ports[0].logger->flush();
+        }
+
+        void queue_notify(uint16_t q) {
+            if(q == control_tx_queue) {
+                process(q, [this](Queue& queue, const Chain& chain) { control(queue, chain); });
+                flush_control();
+            } else if(q == control_rx_queue) {
+                flush_control(); // New buffers for queued up messages
+            } else if(q & 1) { // TX queue of a port
+                uint32_t id = (q == 1) ? 0 : ((q - 2) / 2);
+                if(id >= n_ports || (id != 0 && !has_feature(features::multiport)))
+                    return;
+
+                auto& port = ports[id];
+                process(q, [this, &port](Queue& queue, const Chain& chain) { transmit(port, queue, chain); });
+                port.logger->flush();
+            }
+
+            // Nothing is ever sent to guests, so RX buffers just sit there
+        }
+
+        void device_reset() {
+            pending.clear();
+            pending_head = 0;
+        }
+
+        void transmit(Port& port, Queue& queue, const Chain& chain) {
+            for(size_t offset = 0; offset < chain.readable;) {
+                auto chunk = queue.read(chain, offset, {buf, min(sizeof(buf), chain.readable - offset)});
+                if(!chunk)
+                    break;
+
+                output(port, {buf, chunk});
+                offset += chunk;
+            }
+
+            queue.push(chain, 0);
+        }
+
+        void output(Port& port, std::span<uint8_t> data) {
+            for(auto c : data)
+                port.logger->putc(c);
+
+            if(port.file && port.file_offset < port.file->get_size())
+                port.file_offset += port.file->write(port.file_offset, data.size(), data.data());
+        }
+
+        void control(Queue& queue, const Chain& chain) {
+            ControlMsg msg{};
+            if(queue.read(chain, 0, {(uint8_t*)&msg, sizeof(msg)}) != sizeof(msg)) {
+                queue.push(chain, 0);
+                return;
+            }
+            queue.push(chain, 0);
+
+            switch (msg.event) {
+                case events::device_ready:
+                    if(msg.value != 1) {
+                        print("virtio-console: Guest failed to initialize\n");
+                        break;
+                    }
+
+                    for(uint32_t i = 0; i < n_ports; i++)
+                        send_control(i, events::device_add, 0);
+                    break;
+                case events::port_ready:
+                    if(msg.id >= n_ports || msg.value != 1)
+                        break;
+
+                    if(msg.id == 0)
+                        send_control(0, events::console_port, 1);
+                    else if(ports[msg.id].name)
+                        send_control(msg.id, events::port_name, 0, ports[msg.id].name);
+
+                    send_control(msg.id, events::port_open, 1);
+                    break;
+                case events::port_open:
+                    break; // Host side is always open
+                default:
+                    print("virtio-console: Unknown control event {} for port {}\n", (uint16_t)msg.event, (uint32_t)msg.id);
+                    break;
+            }
+        }
+
+        void send_control(uint32_t id, uint16_t event, uint16_t value, const char* name = nullptr) {
+            pending.push_back({.msg = {.id = id, .event = event, .value = value}, .name = name});
+        }
+
+        // Messages wait for buffers from the driver, which might not have posted enough of them yet
+        void flush_control() {
+            auto& queue = queues[control_rx_queue];
+            if(!queue.enabled)
+                return;
+
+            bool delivered = false;
+            while(pending_head < pending.size()) {
+                Chain chain{};
+                if(!queue.pop(chain))
+                    break;
+
+                auto& msg = pending[pending_head++];
+                auto written = queue.write(chain, 0, {(uint8_t*)&msg.msg, sizeof(ControlMsg)});
+                if(msg.name)
+                    written += queue.write(chain, sizeof(ControlMsg), {(uint8_t*)msg.name, strlen(msg.name)});
+
+                queue.push(chain, written);
+                delivered = true;
+            }
+
+            if(pending_head == pending.size()) {
+                pending.clear();
+                pending_head = 0;
+            }
+
+            if(queue.broken)
+                set_needs_reset();
+
+            if(delivered)
+                queue_interrupt(control_rx_queue);
+        }
+
+        Config config{};
+
+        Port ports[max_ports] = {};
+        uint32_t n_ports = 0;
+
+        struct Pending {
+            ControlMsg msg;
+            const char* name;
+        };
+        std::vector<Pending> pending;
+        size_t pending_head = 0;
+
+        uint8_t buf[pmm::block_size];
+    };
+} // namespace vm::virtio::console
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/virtio/virtio.hpp>
+#include <Luna/vmm/vswitch.hpp>
+
+#include <std/vector.hpp>
+
+// Paravirtual NIC connected to a port of a vswitch
+// TX is drained in batches on notify, RX frames wait in the port's inbox until the device drains it, which happens when the switch kicks the VCPU and whenever the driver posts buffers
+namespace vm::virtio::net {
+    constexpr uint16_t device_type = 1;
+    constexpr uint16_t rx_queue = 0, tx_queue = 1;
+    constexpr uint16_t mtu = 1500;
+
+    namespace features {
+        constexpr uint64_t mtu = (1 << 3);
+        constexpr uint64_t mac = (1 << 5);
+        constexpr uint64_t mrg_rxbuf = (1 << 15);
+        constexpr uint64_t status = (1 << 16);
+    } // namespace features
+
+    struct [[gnu::packed]] Config {
+        uint8_t mac[6];
+        uint16_t status; // Bit 0: Link Up
+        uint16_t max_virtqueue_pairs;
+        uint16_t mtu;
+    };
+
+    // Version 1 devices always have num_buffers, even without mergeable RX buffers
+    struct [[gnu::packed]] Header {
+        uint8_t flags, gso_type;
+        uint16_t hdr_len, gso_size;
+        uint16_t csum_start, csum_offset;
+        uint16_t num_buffers;
+    };
+    static_assert(sizeof(Header) == 12);
+
+    struct Driver : public virtio::Device {
+        Driver(Vm* vm, pci::HostBridge* bridge, uint8_t slot, vswitch::Switch* sw, const ::net::Mac& mac): virtio::Device{vm, bridge, slot, device_type, 2, features::mtu | features::mac | features::mrg_rxbuf | features::status}, sw{sw} {
+            pci_space.header.class_id = 2; // Network Controller
+            pci_space.header.subclass = 0; // Ethernet
+
+            memcpy(config.mac, mac.data, 6);
+            config.status = 1;
+            config.max_virtqueue_pairs = 1;
+            config.mtu = mtu;
+
+            port = sw->add_port(&vm->cpus[0]);
+            vm->cpus[0].add_kick_handler(kicked, this);
+        }
+
+        private:
+        uint32_t config_read(uint16_t offset, uint8_t size) {
+            if(offset >= sizeof(Config))
+                return 0;
+
+            uint32_t value = 0;
+            memcpy(&value, (uint8_t*)&config + offset, min(min(size, sizeof(value)), sizeof(Config) - offset));
+            return value;
+        }
+
+        void queue_notify(uint16_t q) {
+            if(q == tx_queue)
+                process(q, [this](Queue& queue, const Chain& chain) { transmit(queue, chain); });
+            else if(q == rx_queue)
+                receive(); // New buffers, there might be frames waiting for them
+        }
+
+        void device_reset() {
+            held.clear();
+        }
+
+        void transmit(Queue& queue, const Chain& chain) {
+            size_t len = chain.readable - sizeof(Header);
+            if(chain.readable < sizeof(Header) || len > vswitch::max_frame_size) {
+                print("virtio-net: Dropping TX chain of {} bytes\n", chain.readable);
+                queue.push(chain, 0);
+                return;
+            }
+
+            queue.read(chain, sizeof(Header), {tx_buf, len});
+            sw->send(port, {tx_buf, len});
+
+            queue.push(chain, 0);
+        }
+
+        void receive() {
+            if(!driver_ok() || !queues[rx_queue].enabled)
+                return;
+
+            auto& queue = queues[rx_queue];
+
+            bool delivered = false;
+            while(auto* frame = port->front()) {
+                if(!fill(queue, *frame))
+                    break; // Out of buffers, the frame stays in the inbox until the driver posts more
+
+                port->pop();
+                delivered = true;
+            }
+
+            if(queue.broken)
+                set_needs_reset();
+
+            if(delivered)
+                queue_interrupt(rx_queue);
+        }
+
+        // Returns false if there aren't enough buffers for the frame yet, chains popped in the meantime are held on to
+        bool fill(Queue& queue, const vswitch::Frame& frame) {
+            bool mergeable = has_feature(features::mrg_rxbuf);
+            size_t needed = sizeof(Header) + frame.len;
+
+            size_t have = 0;
+            for(const auto& chain : held)
+                have += chain.writable;
+
+            while(have < needed && (mergeable || held.size() == 0)) {
+                Chain chain{};
+                if(!queue.pop(chain))
+                    break;
+
+                have += chain.writable;
+                held.push_back(chain);
+            }
+
+            // Hand the buffer back unused, holding on to it would drop every frame after this one too
+            if(!mergeable && held.size() && held[0].writable < needed) {
+                print("virtio-net: Dropping RX frame of {} bytes, buffers are too small\n", frame.len);
+                queue.push(held[0], 0);
+                held.clear();
+                return true;
+            }
+
+            if(have < needed)
+                return false;
+
+            Header header{};
+            header.num_buffers = held.size();
+            memcpy(rx_buf, &header, sizeof(header));
+            memcpy(rx_buf + sizeof(header), frame.data, frame.len);
+
+            size_t offset = 0;
+            for(const auto& chain : held) {
+                auto chunk = min(chain.writable, needed - offset);
+                queue.write(chain, 0, {rx_buf + offset, chunk});
+                queue.push(chain, chunk);
+
+                offset += chunk;
+            }
+
+            held.clear();
+            return true;
+        }
+
+        static void kicked(VCPU*, void* userptr) {
+            ((Driver*)userptr)->receive();
+        }
+
+        Config config{};
+
+        vswitch::Switch* sw;
+        vswitch::Port* port;
+
+        std::vector<Chain> held;
+
+        uint8_t tx_buf[vswitch::max_frame_size];
+        uint8_t rx_buf[sizeof(Header) + vswitch::max_frame_size];
+    };
+} // namespace vm::virtio::net
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <Luna/vmm/drivers/pci/pci_driver.hpp>
+#include <Luna/vmm/drivers/pci/msix.hpp>
+#include <Luna/vmm/drivers/virtio/virtqueue.hpp>
+
+#include <std/vector.hpp>
+
+// Virtio 1.x PCI transport, device types derive from Device and handle their queues and device specific config
+// Everything lives in BAR0, the regions are found by the driver through vendor specific capabilities
+namespace vm::virtio {
+    constexpr uint16_t vendor_id = 0x1AF4;
+    constexpr uint16_t pci_device_id_base = 0x1040; // + Virtio Device ID
+    constexpr uint16_t no_vector = 0xFFFF;
+
+    constexpr size_t bar_size = 0x8000;
+    namespace layout {
+        constexpr uintptr_t common = 0x0;
+        constexpr uintptr_t isr = 0x1000;
+        constexpr uintptr_t device = 0x2000;
+        constexpr uintptr_t notify = 0x3000;
+        constexpr uintptr_t msix_table = 0x4000;
+        constexpr uintptr_t msix_pba = 0x6000;
+
+        constexpr size_t region_size = 0x1000;
+    } // namespace layout
+
+    constexpr uint32_t notify_off_multiplier = 4; // Every queue gets its own doorbell
+
+    namespace features {
+        constexpr uint64_t ring_indirect_desc = (1ull << 28);
+        constexpr uint64_t ring_event_idx = (1ull << 29);
+        constexpr uint64_t version_1 = (1ull << 32);
+        constexpr uint64_t ring_packed = (1ull << 34);
+
+        constexpr uint64_t transport = ring_indirect_desc | ring_event_idx | version_1 | ring_packed;
+    } // namespace features
+
+    namespace status {
+        constexpr uint8_t acknowledge = (1 << 0);
+        constexpr uint8_t driver = (1 << 1);
+        constexpr uint8_t driver_ok = (1 << 2);
+        constexpr uint8_t features_ok = (1 << 3);
+        constexpr uint8_t needs_reset = (1 << 6);
+        constexpr uint8_t failed = (1 << 7);
+    } // namespace status
+
+    namespace isr {
+        constexpr uint8_t queue = (1 << 0);
+        constexpr uint8_t config = (1 << 1);
+    } // namespace isr
+
+    namespace cap_type {
+        constexpr uint8_t common = 1;
+        constexpr uint8_t notify = 2;
+        constexpr uint8_t isr = 3;
+        constexpr uint8_t device = 4;
+    } // namespace cap_type
+
+    struct [[gnu::packed]] PciCap {
+        uint8_t cap_vndr, cap_next, cap_len, cfg_type;
+        uint8_t bar, id;
+        uint8_t padding[2];
+        uint32_t offset, length;
+    };
+    static_assert(sizeof(PciCap) == 16);
+
+    struct [[gnu::packed]] CommonConfig {
+        uint32_t device_feature_select, device_feature;
+        uint32_t driver_feature_select, driver_feature;
+        uint16_t config_msix_vector, num_queues;
+        uint8_t device_status, config_generation;
+
+        // Selected by queue_select
+        uint16_t queue_select, queue_size, queue_msix_vector, queue_enable, queue_notify_off;
+        uint64_t queue_desc, queue_driver, queue_device;
+        uint16_t queue_notify_data, queue_reset;
+    };
+    static_assert(sizeof(CommonConfig) == 0x3C);
+
+    struct Device : vm::pci::PCIDriver, public vm::AbstractMMIODriver {
+        Device(Vm* vm, pci::HostBridge* bridge, uint8_t slot, uint16_t type, uint16_t n_queues, uint64_t device_features): PCIDriver{vm}, vm{vm}, msix{vm, pci_space, 0x40, (uint16_t)(n_queues + 1), 0, layout::msix_table, layout::msix_pba}, device_features{device_features | features::transport} {
+            ASSERT(n_queues > 0 && n_queues <= (layout::region_size / notify_off_multiplier));
+            bridge->register_pci_driver(pci::DeviceID{0, 0, slot, 0}, this);
+
+            pci_space.header.vendor_id = vendor_id;
+            pci_space.header.device_id = pci_device_id_base + type;
+            pci_space.header.revision = 1; // Modern only
+
+            pci_space.header.subsystem_vendor_id = vendor_id;
+            pci_space.header.subsystem_device_id = type;
+
+            pci_space.header.irq_pin = 1;
+
+            pci_init_bar(0, bar_size, true, true); // MMIO, 64bit
+
+            add_cap(0x50, cap_type::common, layout::common, sizeof(CommonConfig));
+            add_cap(0x60, cap_type::isr, layout::isr, 1);
+            add_cap(0x70, cap_type::device, layout::device, layout::region_size);
+            add_cap(0x80, cap_type::notify, layout::notify, n_queues * notify_off_multiplier, notify_off_multiplier);
+
+            queues.resize(n_queues);
+        }
+
+        void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) {
+            auto reg = addr - mmio_base;
+
+            if(reg < sizeof(CommonConfig))
+                common_write(reg, value, size);
+            else if(reg >= layout::device && reg < (layout::device + layout::region_size))
+                config_write(reg - layout::device, value, size);
+            else if(reg >= layout::notify && reg < (layout::notify + layout::region_size))
+                notify((reg - layout::notify) / notify_off_multiplier);
+            else if(msix.handles_mmio(reg))
+                msix.mmio_write(reg, value, size);
+            else
+                print("virtio: Unknown MMIO write {:#x} <- {:#x} ({})\n", reg, value, (uint16_t)size);
+        }
+
+        uint64_t mmio_read(uintptr_t addr, uint8_t size) {
+            auto reg = addr - mmio_base;
+
+            if(reg < sizeof(CommonConfig)) {
+                return common_read(reg, size);
+            } else if(reg == layout::isr) { // Read to clear
+                auto v = isr_status;
+                isr_status = 0;
+                pci_set_irq_line(false);
+                return v;
+            } else if(reg >= layout::device && reg < (layout::device + layout::region_size)) {
+                return config_read(reg - layout::device, size);
+            } else if(reg >= layout::notify && reg < (layout::notify + layout::region_size)) {
+                return 0;
+            } else if(msix.handles_mmio(reg)) {
+                return msix.mmio_read(reg, size);
+            }
+
+            print("virtio: Unknown MMIO read from {:#x} ({})\n", reg, (uint16_t)size);
+            return 0;
+        }
+
+        void pci_handle_write(uint16_t reg, uint32_t value, uint8_t size) {
+            if(msix.handles_pci(reg)) {
+                msix.pci_write(reg, value, size);
+                return;
+            }
+
+            print("virtio: Unhandled PCI write, reg: {:#x}, value: {:#x}\n", reg, value);
+        }
+
+        uint32_t pci_handle_read(uint16_t reg, uint8_t size) {
+            if(msix.handles_pci(reg))
+                return msix.pci_read(reg, size);
+
+            // Virtio capabilities are read-only
+            switch (size) {
+                case 1: return pci_space.data8[reg];
+                case 2: return pci_space.data16[reg / 2];
+                case 4: return pci_space.data32[reg / 4];
+                default: PANIC("Unknown PCI Access size");
+            }
+        }
+
+        void pci_update_bars() {
+            if(mmio_enabled)
+                vm->mmio_map.erase(mmio_base);
+            mmio_enabled = false;
+
+            if(!(pci_space.header.command & (1 << 1)))
+                return;
+
+            uint64_t base = (pci_space.header.bar[0] & ~0xF) | ((uint64_t)pci_space.header.bar[1] << 32);
+            vm->mmio_map[base] = {this, bar_size};
+            mmio_base = base;
+            mmio_enabled = true;
+        }
+
+        protected:
+        // Device type specific handlers
+        virtual void queue_notify(uint16_t q) = 0;
+        virtual uint32_t config_read(uint16_t offset, uint8_t size) = 0;
+        virtual void config_write(uint16_t offset, uint64_t value, uint8_t size) { print("virtio: Unhandled device config write {:#x} <- {:#x} ({})\n", offset, value, (uint16_t)size); }
+        virtual void device_reset() {}
+
+        bool has_feature(uint64_t feature) const { return driver_features & feature; }
+        bool driver_ok() const { return (device_status & status::driver_ok) && !(device_status & status::needs_reset); }
+
+        // Drains queue q with driver notifications suppressed, f(queue, chain) handles a chain and pushes it back
+        // Afterwards the driver is sent a single interrupt for everything that was completed, if it wants one
+        template<typename F>
+        void process(uint16_t q, F f) {
+            auto& queue = queues[q];
+
+            Chain chain{};
+            do {
+                queue.set_notify(false);
+                while(queue.pop(chain))
+                    f(queue, chain);
+                queue.set_notify(true);
+            } while(queue.available());
+
+            if(queue.broken)
+                set_needs_reset();
+
+            queue_interrupt(q);
+        }
+
+        void queue_interrupt(uint16_t q) {
+            if(queues[q].should_interrupt())
+                raise(queues[q].msix_vector, isr::queue);
+        }
+
+        void config_changed() {
+            config_generation++;
+            raise(config_msix_vector, isr::config);
+        }
+
+        void set_needs_reset() {
+            if(device_status & status::driver_ok) {
+                device_status |= status::needs_reset;
+                config_changed();
+            }
+        }
+
+        std::vector<Queue> queues;
+
+        Vm* vm;
+
+        private:
+        void add_cap(uint8_t offset, uint8_t type, uint32_t bar_offset, uint32_t length, uint32_t multiplier = 0) {
+            PciCap cap{.cap_vndr = 0x9, .cap_next = pci_space.header.capabilities, .cap_len = (uint8_t)(sizeof(PciCap) + (multiplier ? 4 : 0)), .cfg_type = type,
+                       .bar = 0, .id = 0, .padding = {0, 0}, .offset = bar_offset, .length = length};
+            memcpy(pci_space.data8 + offset, &cap, sizeof(cap));
+            if(multiplier)
+                memcpy(pci_space.data8 + offset + sizeof(cap), &multiplier, 4);
+
+            pci_space.header.capabilities = offset;
+            pci_space.header.status |= (1 << 4); // Capabilities List
+        }
+
+        void raise(uint16_t vector, uint8_t cause) {
+            // MSI-X is edge triggered and has no ISR, INTx shares one line for everything
+            if(msix.enabled()) {
+                if(vector != no_vector)
+                    msix.trigger(vector);
+                return;
+            }
+
+            isr_status |= cause;
+            pci_set_irq_line(true);
+        }
+
+        void notify(uint16_t q) {
+            if(q < queues.size() && queues[q].enabled && driver_ok())
+                queue_notify(q);
+        }
+
+        void reset() {
+            device_status = 0;
+            driver_features = 0;
+            device_feature_select = 0;
+            driver_feature_select = 0;
+            config_msix_vector = no_vector;
+            queue_select = 0;
+
+            for(auto& queue : queues)
+                queue.reset();
+
+            isr_status = 0;
+            pci_set_irq_line(false);
+
+            device_reset();
+        }
+
+        CommonConfig common_state() {
+            CommonConfig c{};
+            c.device_feature_select = device_feature_select;
+            c.device_feature = (device_feature_select < 2) ? (device_features >> (device_feature_select * 32)) : 0;
+            c.driver_feature_select = driver_feature_select;
+            c.driver_feature = (driver_feature_select < 2) ? (driver_features >> (driver_feature_select * 32)) : 0;
+            c.config_msix_vector = config_msix_vector;
+            c.num_queues = queues.size();
+            c.device_status = device_status;
+            c.config_generation = config_generation;
+
+            c.queue_select = queue_select;
+            if(queue_select < queues.size()) {
+                const auto& queue = queues[queue_select];
+                c.queue_size = queue.size;
+                c.queue_msix_vector = queue.msix_vector;
+                c.queue_enable = queue.enabled;
+                c.queue_notify_off = queue_select;
+                c.queue_desc = queue.desc;
+                c.queue_driver = queue.driver;
+                c.queue_device = queue.device;
+                c.queue_notify_data = queue_select;
+            }
+
+            return c;
+        }
+
+        uint64_t common_read(uintptr_t reg, uint8_t size) {
+            auto c = common_state();
+
+            uint64_t value = 0;
+            memcpy(&value, (uint8_t*)&c + reg, min(size, sizeof(CommonConfig) - reg));
+            return value;
+        }
+
+        void common_write(uintptr_t reg, uint64_t value, uint8_t size) {
+            // Merge the write into the current state, then apply whatever fields it touched
+            auto c = common_state();
+            memcpy((uint8_t*)&c + reg, &value, min(size, sizeof(CommonConfig) - reg));
+
+            auto wrote = [&](size_t offset, size_t len) { return ranges_overlap(reg, size, offset, len); };
+            #define WROTE(field) wrote(offsetof(CommonConfig, field), sizeof(CommonConfig::field))
+
+            if(WROTE(device_feature_select))
+                device_feature_select = c.device_feature_select;
+
+            if(WROTE(driver_feature_select))
+                driver_feature_select = c.driver_feature_select;
+
+            if(WROTE(driver_feature) && driver_feature_select < 2 && !(device_status & status::features_ok)) {
+                auto shift = driver_feature_select * 32;
+                driver_features = (driver_features & ~(0xFFFF'FFFFull << shift)) | ((uint64_t)c.driver_feature << shift);
+            }
+
+            if(WROTE(config_msix_vector))
+                config_msix_vector = (c.config_msix_vector < (queues.size() + 1)) ? c.config_msix_vector : no_vector;
+
+            if(WROTE(device_status)) {
+                if(c.device_status == 0) {
+                    reset();
+                } else {
+                    auto new_status = c.device_status;
+
+                    // Only accept features we offered, and only modern drivers
+                    if((new_status & status::features_ok) && !(device_status & status::features_ok)) {
+                        if((driver_features & ~device_features) || !(driver_features & features::version_1)) {
+                            print("virtio: Driver negotiated unsupported features {:#x}\n", driver_features);
+                            new_status &= ~status::features_ok;
+                        }
+                    }
+
+                    device_status = new_status | (device_status & status::needs_reset);
+                }
+            }
+
+            if(WROTE(queue_select))
+                queue_select = c.queue_select;
+
+            if(queue_select < queues.size() && !queues[queue_select].enabled) {
+                auto& queue = queues[queue_select];
+
+                if(WROTE(queue_size))
+                    queue.size = (c.queue_size > 0 && c.queue_size <= max_queue_size) ? c.queue_size : queue.size;
+                if(WROTE(queue_msix_vector))
+                    queue.msix_vector = (c.queue_msix_vector < (queues.size() + 1)) ? c.queue_msix_vector : no_vector;
+                if(WROTE(queue_desc))
+                    queue.desc = c.queue_desc;
+                if(WROTE(queue_driver))
+                    queue.driver = c.queue_driver;
+                if(WROTE(queue_device))
+                    queue.device = c.queue_device;
+
+                if(WROTE(queue_enable) && c.queue_enable == 1) {
+                    bool packed = has_feature(features::ring_packed);
+                    if(!packed && (queue.size & (queue.size - 1))) {
+                        print("virtio: Split queue {} size {} is not a power of 2\n", queue_select, queue.size);
+                        set_needs_reset();
+                    } else {
+                        queue.enable(vm, packed, has_feature(features::ring_event_idx), has_feature(features::ring_indirect_desc));
+                    }
+                }
+            }
+
+            #undef WROTE
+        }
+
+        pci::msix::Capability msix;
+
+        bool mmio_enabled = false;
+        uintptr_t mmio_base = 0;
+
+        uint64_t device_features, driver_features = 0;
+        uint32_t device_feature_select = 0, driver_feature_select = 0;
+
+        uint16_t config_msix_vector = no_vector, queue_select = 0;
+        uint8_t device_status = 0, config_generation = 0, isr_status = 0;
+    };
+} // namespace vm::virtio
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+
+#include <std/span.hpp>
+#include <std/vector.hpp>
+
+// Device side of a virtqueue, in both the split and packed layout
+// The driver describes buffers with descriptor chains, the device pops a chain, does the request, and pushes it back with the amount of bytes it wrote
+namespace vm::virtio {
+    constexpr uint16_t max_queue_size = 256;
+    constexpr size_t max_chain_length = 1024; // Indirect tables can make a chain longer than the queue
+
+    namespace desc_flags {
+        constexpr uint16_t next = (1 << 0);
+        constexpr uint16_t write = (1 << 1);
+        constexpr uint16_t indirect = (1 << 2);
+
+        // Packed only
+        constexpr uint16_t avail = (1 << 7);
+        constexpr uint16_t used = (1 << 15);
+    } // namespace desc_flags
+
+    struct [[gnu::packed]] SplitDescriptor {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+        uint16_t next;
+    };
+    static_assert(sizeof(SplitDescriptor) == 16);
+
+    struct [[gnu::packed]] PackedDescriptor {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t id;
+        uint16_t flags;
+    };
+    static_assert(sizeof(PackedDescriptor) == 16);
+
+    namespace split {
+        constexpr uint16_t avail_no_interrupt = (1 << 0);
+        constexpr uint16_t used_no_notify = (1 << 0);
+    } // namespace split
+
+    namespace packed {
+        // Event Suppression Structure flags
+        constexpr uint16_t event_enable = 0;
+        constexpr uint16_t event_disable = 1;
+        constexpr uint16_t event_desc = 2;
+    } // namespace packed
+
+    struct Buffer {
+        uintptr_t gpa;
+        uint32_t len;
+        bool write; // Device writable
+    };
+
+    struct Chain {
+        uint16_t id;
+        uint16_t n_descs; // Ring slots the chain takes up, needed to advance the packed used index
+        size_t readable, writable; // Total bytes of each kind
+
+        std::vector<Buffer> buffers; // Device readable buffers come first
+    };
+
+    // Same as vring_need_event() in the spec, true if the driver asked for an event at an index between old and new
+    constexpr bool need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) { return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx); }
+
+    struct Queue {
+        // Set by the driver through the common config while the queue is disabled
+        uint16_t size = max_queue_size;
+        uint16_t msix_vector = 0xFFFF;
+        uint64_t desc = 0, driver = 0, device = 0;
+
+        bool enabled = false, broken = false;
+
+        void enable(Vm* vm, bool packed_layout, bool event_idx, bool indirect) {
+            this->vm = vm;
+            packed_ring = packed_layout;
+            use_event_idx = event_idx;
+            allow_indirect = indirect;
+
+            last_avail = 0; used_idx = 0;
+            avail_wrap = true; used_wrap = true;
+            signalled_valid = false;
+            pushed = false;
+            broken = false;
+
+            enabled = true;
+        }
+
+        void reset() {
+            size = max_queue_size;
+            msix_vector = 0xFFFF;
+            desc = driver = device = 0;
+            enabled = false;
+            broken = false;
+        }
+
+        // Returns false if there are no available chains, or the chain is malformed, in which case broken is set
+        bool pop(Chain& chain) {
+            if(!enabled || broken)
+                return false;
+
+            chain.buffers.clear();
+            chain.readable = 0;
+            chain.writable = 0;
+
+            return packed_ring ? pop_packed(chain) : pop_split(chain);
+        }
+
+        void push(const Chain& chain, uint32_t written) {
+            if(packed_ring) {
+                // The flags mark the element as used, so they're written after the rest of it
+                struct [[gnu::packed]] { uint32_t len; uint16_t id; } elem{.len = written, .id = chain.id};
+                auto gpa = desc + used_idx * sizeof(PackedDescriptor);
+                vm->cpus[0].dma_write(gpa + offsetof(PackedDescriptor, len), {(uint8_t*)&elem, sizeof(elem)});
+
+                uint16_t flags = (used_wrap ? (desc_flags::avail | desc_flags::used) : 0) | (written ? desc_flags::write : 0);
+                write<uint16_t>(gpa + offsetof(PackedDescriptor, flags), flags);
+
+                used_idx += chain.n_descs;
+                if(used_idx >= size) {
+                    used_idx -= size;
+                    used_wrap = !used_wrap;
+                }
+            } else {
+                struct [[gnu::packed]] { uint32_t id, len; } elem{.id = chain.id, .len = written};
+                vm->cpus[0].dma_write(device + 4 + (used_idx % size) * sizeof(elem), {(uint8_t*)&elem, sizeof(elem)});
+
+                used_idx++;
+                write<uint16_t>(device + 2, used_idx);
+            }
+
+            pushed = true;
+        }
+
+        bool available() {
+            if(!enabled || broken)
+                return false;
+
+            if(packed_ring)
+                return is_avail(read<uint16_t>(desc + last_avail * sizeof(PackedDescriptor) + offsetof(PackedDescriptor, flags)));
+            else
+                return read<uint16_t>(driver + 2) != last_avail;
+        }
+
+        // Ask the driver to notify us about new chains or not, turned off while the device is draining the queue anyway
+        void set_notify(bool enable) {
+            if(!enabled)
+                return;
+
+            if(packed_ring) {
+                write<uint16_t>(device + 2, enable ? packed::event_enable : packed::event_disable);
+            } else if(use_event_idx) {
+                if(enable)
+                    write<uint16_t>(device + 4 + size * 8, last_avail); // avail_event
+            } else {
+                write<uint16_t>(device, enable ? 0 : split::used_no_notify);
+            }
+        }
+
+        // Returns true if the driver wants an interrupt for the chains pushed since the last time this returned true
+        bool should_interrupt() {
+            if(!enabled)
+                return false;
+
+            if(!pushed)
+                return false; // Nothing new
+            pushed = false;
+
+            auto old = signalled_used;
+            bool valid = signalled_valid;
+            signalled_used = used_idx;
+            signalled_valid = true;
+
+            if(packed_ring) {
+                auto flags = read<uint16_t>(driver + 2);
+                if(flags == packed::event_disable)
+                    return false;
+                else if(flags == packed::event_enable || !use_event_idx || !valid)
+                    return true;
+
+                auto off_wrap = read<uint16_t>(driver);
+                uint16_t off = off_wrap & 0x7FFF;
+                if((bool)(off_wrap >> 15) != used_wrap)
+                    off -= size;
+
+                return need_event(off, used_idx, old);
+            } else {
+                if(!use_event_idx)
+                    return !(read<uint16_t>(driver) & split::avail_no_interrupt);
+
+                return !valid || need_event(read<uint16_t>(driver + 4 + size * 2), used_idx, old); // used_event
+            }
+        }
+
+        // Copy between a chain and a host buffer, offset is relative to the start of the readable or writable part of the chain
+        size_t read(const Chain& chain, size_t offset, std::span<uint8_t> buf) { return copy(chain, false, offset, buf); }
+        size_t write(const Chain& chain, size_t offset, std::span<uint8_t> buf) { return copy(chain, true, offset, buf); }
+
+        // Appends host mappings of len bytes of the readable or writable part of a chain, bypasses the replay log like VCPU::dma_map
+        void map(const Chain& chain, bool writable, size_t offset, size_t len, std::vector<std::span<uint8_t>>& segments) {
+            for(const auto& buffer : chain.buffers) {
+                if(buffer.write != writable)
+                    continue;
+
+                if(offset >= buffer.len) {
+                    offset -= buffer.len;
+                    continue;
+                }
+
+                auto chunk = min(buffer.len - offset, len);
+                vm->cpus[0].dma_map(buffer.gpa + offset, chunk, segments);
+
+                offset = 0;
+                len -= chunk;
+                if(len == 0)
+                    break;
+            }
+        }
+
+        private:
+        template<typename T>
+        T read(uintptr_t gpa) {
+            T v{};
+            vm->cpus[0].dma_read(gpa, {(uint8_t*)&v, sizeof(T)});
+            return v;
+        }
+
+        template<typename T>
+        void write(uintptr_t gpa, T v) { vm->cpus[0].dma_write(gpa, {(uint8_t*)&v, sizeof(T)}); }
+
+        bool add(Chain& chain, uint64_t addr, uint32_t len, bool writable) {
+            if(!writable && chain.writable) {
+                print("virtio: Device readable descriptor after a writable one\n");
+                return false;
+            }
+
+            if(chain.buffers.size() >= max_chain_length) {
+                print("virtio: Descriptor chain too long\n");
+                return false;
+            }
+
+            chain.buffers.push_back({.gpa = addr, .len = len, .write = writable});
+            (writable ? chain.writable : chain.readable) += len;
+            return true;
+        }
+
+        bool add_indirect(Chain& chain, uint64_t table, uint32_t len) {
+            if(!allow_indirect || len == 0 || (len % sizeof(SplitDescriptor)) != 0) {
+                print("virtio: Invalid indirect descriptor\n");
+                return false;
+            }
+
+            // Both layouts have 16 byte descriptors with the address and length in the same place
+            auto n = len / sizeof(SplitDescriptor);
+            if(n > max_chain_length) {
+                print("virtio: Indirect table too long\n");
+                return false;
+            }
+
+            std::vector<SplitDescriptor> descs{};
+            descs.resize(n);
+            vm->cpus[0].dma_read(table, {(uint8_t*)descs.data(), len});
+
+            // Split indirect tables are chained with next, packed ones are just walked in order
+            size_t i = 0;
+            for(size_t n_walked = 0; n_walked < n; n_walked++) {
+                const auto& d = descs[i];
+                if(d.flags & desc_flags::indirect) {
+                    print("virtio: Nested indirect descriptor\n");
+                    return false;
+                }
+
+                if(!add(chain, d.addr, d.len, d.flags & desc_flags::write))
+                    return false;
+
+                if(packed_ring) {
+                    if(++i == n)
+                        return true;
+                } else {
+                    if(!(d.flags & desc_flags::next))
+                        return true;
+
+                    i = d.next;
+                    if(i >= n)
+                        break;
+                }
+            }
+
+            print("virtio: Malformed indirect table\n");
+            return false;
+        }
+
+        bool pop_split(Chain& chain) {
+            auto avail_idx = read<uint16_t>(driver + 2);
+            if(avail_idx == last_avail)
+                return false;
+
+            if((uint16_t)(avail_idx - last_avail) > size) {
+                print("virtio: Driver made {} chains available on a queue of size {}\n", (uint16_t)(avail_idx - last_avail), size);
+                broken = true;
+                return false;
+            }
+
+            auto head = read<uint16_t>(driver + 4 + (last_avail % size) * 2);
+            last_avail++;
+
+            chain.id = head;
+            chain.n_descs = 1;
+
+            auto i = head;
+            for(size_t n = 0; n < size; n++) {
+                if(i >= size)
+                    break;
+
+                auto d = read<SplitDescriptor>(desc + i * sizeof(SplitDescriptor));
+                if(d.flags & desc_flags::indirect) { // Always ends the chain
+                    if((d.flags & desc_flags::next) || !add_indirect(chain, d.addr, d.len))
+                        break;
+
+                    return true;
+                }
+
+                if(!add(chain, d.addr, d.len, d.flags & desc_flags::write))
+                    break;
+
+                if(!(d.flags & desc_flags::next))
+                    return true;
+
+                i = d.next;
+            }
+
+            print("virtio: Malformed descriptor chain at head {}\n", head);
+            broken = true;
+            return false;
+        }
+
+        bool is_avail(uint16_t flags) const { return (bool)(flags & desc_flags::avail) == avail_wrap && (bool)(flags & desc_flags::used) != avail_wrap; }
+
+        bool pop_packed(Chain& chain) {
+            chain.n_descs = 0;
+
+            for(size_t n = 0; n < size; n++) {
+                auto gpa = desc + last_avail * sizeof(PackedDescriptor);
+
+                // The driver writes the flags last, so read them before the rest of the descriptor
+                auto flags = read<uint16_t>(gpa + offsetof(PackedDescriptor, flags));
+                if(n == 0 && !is_avail(flags))
+                    return false;
+
+                auto d = read<PackedDescriptor>(gpa);
+                chain.id = d.id;
+                chain.n_descs++;
+
+                if(++last_avail == size) {
+                    last_avail = 0;
+                    avail_wrap = !avail_wrap;
+                }
+
+                if(flags & desc_flags::indirect) {
+                    if((flags & desc_flags::next) || n != 0 || !add_indirect(chain, d.addr, d.len))
+                        break;
+
+                    return true;
+                }
+
+                if(!add(chain, d.addr, d.len, flags & desc_flags::write))
+                    break;
+
+                if(!(flags & desc_flags::next))
+                    return true;
+            }
+
+            print("virtio: Malformed packed descriptor chain\n");
+            broken = true;
+            return false;
+        }
+
+        size_t copy(const Chain& chain, bool writable, size_t offset, std::span<uint8_t> buf) {
+            size_t done = 0;
+            for(const auto& buffer : chain.buffers) {
+                if(buffer.write != writable)
+                    continue;
+
+                if(offset >= buffer.len) {
+                    offset -= buffer.len;
+                    continue;
+                }
+
+                auto chunk = min(buffer.len - offset, buf.size() - done);
+                if(writable)
+                    vm->cpus[0].dma_write(buffer.gpa + offset, {buf.data() + done, chunk});
+                else
+                    vm->cpus[0].dma_read(buffer.gpa + offset, {buf.data() + done, chunk});
+
+                offset = 0;
+                done += chunk;
+                if(done == buf.size())
+                    break;
+            }
+
+            return done;
+        }
+
+        Vm* vm = nullptr;
+        bool packed_ring = false, use_event_idx = false, allow_indirect = false;
+
+        uint16_t last_avail = 0, used_idx = 0; // For packed rings these are ring positions, with separate wrap counters
+        bool avail_wrap = true, used_wrap = true;
+
+        uint16_t signalled_used = 0;
+        bool signalled_valid = false, pushed = false;
+    };
+} // namespace vm::virtio
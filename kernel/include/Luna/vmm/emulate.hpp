@@ -4,7 +4,7 @@
 #include <Luna/vmm/vm.hpp>
 
 namespace vm::emulate {
-    enum class r64 { Rax = 0, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi };
+    enum class r64 { Rax = 0, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi, R8, R9, R10, R11, R12, R13, R14, R15 };
     enum class sreg { Es = 0, Cs, Ss, Ds, Fs, Gs };
 
     void emulate_instruction(vm::VCPU* vcpu, uintptr_t gpa, std::pair<uintptr_t, size_t> mmio_region, uint8_t instruction[max_x86_instruction_size], vm::RegisterState& regs, vm::AbstractMMIODriver* driver);
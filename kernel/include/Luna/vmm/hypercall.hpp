@@ -0,0 +1,89 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/fs/vfs.hpp>
+#include <Luna/misc/log.hpp>
+
+namespace vm {
+    struct VCPU;
+} // namespace vm
+
+// Luna hypercall ABI
+// RAX holds the call number and receives the result, RBX and RCX hold the arguments, all of them are truncated to 32bits outside of long mode
+// Both VMCALL and VMMCALL are accepted, guests should use the one native to their vendor, the other one costs an extra #UD exit
+//
+// Services are requested through a ring in guest memory, so a guest can batch any amount of work into a single Notify exit
+// The ring is laid out as a RingHeader, followed by n_entries Requests, followed by n_entries Completions
+// The guest produces Requests at sq_tail and consumes Completions at cq_head, the VMM consumes Requests at sq_head and produces Completions at cq_tail
+namespace vm::hypercall {
+    constexpr uint64_t magic = 0x4C55'0000; // Calls outside of [magic, magic + 0xFFFF] go to the HypercallCallback
+
+    namespace calls {
+        enum : uint64_t {
+            Nop = magic, // Returns 0, useful for measuring exit latency
+            SetupRing = magic + 1, // RBX = 64 byte aligned GPA of the ring, RCX = Number of entries, a power of 2, 0 disables the ring
+            Notify = magic + 2 // Process all pending requests, returns the amount of requests completed
+        };
+    } // namespace calls
+
+    namespace ops {
+        enum : uint16_t {
+            Nop = 0,
+            ConsoleWrite = 1, // args[0] = GPA of buffer, args[1] = Length
+            GetTime = 2, // Returns nanoseconds since VM creation
+            BlockRead = 3, // args[0] = LBA, args[1] = Number of blocks, args[2] = GPA of buffer
+            BlockWrite = 4 // args[0] = LBA, args[1] = Number of blocks, args[2] = GPA of buffer
+        };
+    } // namespace ops
+
+    namespace errors {
+        enum : int64_t {
+            Success = 0,
+            InvalidCall = -1,
+            InvalidArgument = -2,
+            Unsupported = -3,
+            IoError = -4,
+            PermissionDenied = -5
+        };
+    } // namespace errors
+
+    constexpr size_t block_size = 512;
+    constexpr size_t max_console_write = 0x1000;
+    constexpr size_t max_block_count = 256;
+    constexpr uint32_t max_ring_entries = 256;
+
+    struct [[gnu::packed]] RingHeader {
+        uint32_t sq_head, sq_tail;
+        uint32_t cq_head, cq_tail;
+        uint8_t reserved[48];
+    };
+    static_assert(sizeof(RingHeader) == 64);
+
+    struct [[gnu::packed]] Request {
+        uint16_t op;
+        uint16_t reserved;
+        uint32_t reserved_0;
+        uint64_t user_data; // Copied into the Completion
+        uint64_t args[4];
+    };
+    static_assert(sizeof(Request) == 48);
+
+    struct [[gnu::packed]] Completion {
+        uint64_t user_data;
+        int64_t result;
+    };
+    static_assert(sizeof(Completion) == 16);
+
+    struct Ring {
+        uintptr_t gpa = 0;
+        uint32_t n_entries = 0;
+    };
+
+    // Host side backing of the ring services, unset services fail with errors::Unsupported
+    struct Services {
+        log::Logger* console = nullptr;
+        vfs::File* disk = nullptr;
+    };
+
+    bool handle(VCPU* vcpu); // Returns false if RAX doesn't contain a Luna hypercall
+} // namespace vm::hypercall
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/fs/vfs.hpp>
+#include <Luna/misc/log.hpp>
+
+#include <Luna/cpu/cpu.hpp>
+#include <std/mutex.hpp>
+#include <std/vector.hpp>
+
+namespace vm {
+    struct VCPU;
+} // namespace vm
+
+// Guest RIP sampling profiler
+// The backends force a Preempt exit at the sample deadline, the same way they do for the end of a timeslice, so sampling costs one exit per period
+// Samples go into a per VCPU ring, which can be exported as folded stacks ("cr3;mode;rip count" per line), ready for flamegraph.pl
+namespace vm::profiler {
+    constexpr size_t default_ring_size = 4096;
+    constexpr uint64_t default_period_us = 1000;
+    constexpr size_t max_line_size = 72; // Widest possible folded stack line, cr3 and rip in hex, the mode, the count and a newline
+
+    enum class Mode : uint8_t { Real, Protected, Long };
+    constexpr const char* mode_to_string(Mode mode) {
+        switch (mode) {
+            case Mode::Real: return "real";
+            case Mode::Protected: return "protected";
+            case Mode::Long: return "long";
+            default: return "unknown";
+        }
+    }
+
+    struct Sample {
+        uint64_t rip, cr3;
+        Mode mode;
+        uint8_t cpl;
+    };
+
+    struct Profiler {
+        void start(uint64_t period_us, size_t ring_size = default_ring_size);
+        void stop();
+
+        uint64_t get_deadline() const { return deadline; } // Host TSC at which the next sample is due, 0 if disabled
+        uint64_t get_n_samples() const { return n_samples; }
+
+        bool sample(VCPU* vcpu, uint64_t now); // Returns true if a sample was due and recorded
+
+        void dump(const log::Logger& out);
+        // echfs files can't grow, so file has to be preallocated, ring_size * max_line_size bytes always fit
+        // The rest of the file is blanked, so it can be dumped to over and over
+        bool dump(vfs::File* file);
+
+        private:
+        TicketLock lock{};
+
+        std::vector<Sample> ring;
+        size_t head = 0;
+        uint64_t n_samples = 0;
+
+        uint64_t period = 0, deadline = 0; // In TSC ticks
+    };
+} // namespace vm::profiler
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Luna/common.hpp>
+
+namespace vm {
+    struct VCPU;
+    struct Vm;
+} // namespace vm
+
+// Paravirtual clock, guests read time from the TSC scaled by the parameters in a shared page instead of exiting for every PM Timer or HPET read
+// The layout is the same as KVM's pvclock_vcpu_time_info, so existing pvclock readers can be reused:
+//   ns = system_time + (((rdtsc() - tsc_timestamp) << tsc_shift) * tsc_to_system_mul) >> 32, with a negative shift shifting right
+namespace vm::pvclock {
+    constexpr uint32_t msr_system_time = 0x4C55'0001; // GPA of the TimeInfo struct | Enable
+
+    namespace flags {
+        enum {
+            TscStable = (1 << 0) // system_time is monotonic across VCPUs without any further correction
+        };
+    } // namespace flags
+
+    struct [[gnu::packed]] TimeInfo {
+        uint32_t version; // Odd while an update is in progress
+        uint32_t reserved;
+        uint64_t tsc_timestamp; // Guest TSC at which system_time was sampled
+        uint64_t system_time; // Nanoseconds since VM creation
+        uint32_t tsc_to_system_mul;
+        int8_t tsc_shift;
+        uint8_t flags;
+        uint8_t reserved_0[2];
+    };
+    static_assert(sizeof(TimeInfo) == 32);
+
+    uint32_t supported_features(); // Luna CPUID features implemented by this module
+    uint64_t system_time(Vm* vm); // Nanoseconds since VM creation, the same clock the guest sees
+
+    void write_msr(VCPU* vcpu, uint64_t value);
+    void update(VCPU* vcpu); // Republish the clock parameters, needed whenever the guest TSC offset changes
+} // namespace vm::pvclock
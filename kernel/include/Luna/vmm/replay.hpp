@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/fs/vfs.hpp>
+
+#include <Luna/cpu/cpu.hpp>
+#include <std/mutex.hpp>
+#include <std/span.hpp>
+#include <std/vector.hpp>
+
+namespace vm {
+    struct VCPU;
+    struct Vm;
+} // namespace vm
+
+// Deterministic record and replay of a VM
+// Everything the guest can observe that doesn't follow from its own execution goes through the Log: PIO and MMIO read results, RDTSC values,
+// DMA payloads and external interrupts, which are keyed by the amount of guest visible exits that happened before them
+// Device timers and kick handlers fire at host timed Preempt exits, so the exit count at which each callback ran is logged as well
+// In Replay mode devices still run, but the values they return are replaced by the logged ones, live external interrupts are dropped,
+// and timer and kick callbacks only run at the points the log says they did
+// If the guest diverges from the log, replay stops and the VM continues live
+namespace vm::replay {
+    constexpr uint32_t magic = 0x4345'524C; // "LREC"
+    constexpr uint32_t version = 2;
+
+    enum class Mode { Off, Record, Replay };
+
+    namespace records {
+        enum : uint8_t {
+            PioRead = 1, // u16 port, u8 size, u32 value
+            MmioRead = 2, // u64 gpa, u8 size, u64 value
+            Rdtsc = 3, // u64 value
+            Interrupt = 4, // u64 exit, u8 cpu, u8 vector
+            Dma = 5, // u64 gpa, u32 len, len bytes of payload
+            Timer = 6, // u64 exit, u8 cpu, u32 timer source, see VCPU::timer_sources
+            Kick = 7 // u64 exit, u8 cpu, u32 kick handler index
+        };
+    } // namespace records
+
+    struct [[gnu::packed]] FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t size; // Bytes of records following the header
+    };
+    static_assert(sizeof(FileHeader) == 16);
+
+    struct Log {
+        Log(Vm* vm): vm{vm} {}
+
+        // With a file the log is written to it once it fills it, and recording stops, echfs files can't grow
+        void start_record(vfs::File* file = nullptr);
+        bool start_replay(vfs::File* file);
+        bool save(vfs::File* file); // Records that don't fit in the file are cut off, replay continues live from there
+        void stop();
+
+        Mode get_mode() const { return mode; }
+        uint64_t get_exits() const { return n_exits; }
+
+        // Filters, they return the value the guest should see
+        uint32_t pio_read(uint16_t port, uint8_t size, uint32_t value);
+        uint64_t mmio_read(uintptr_t gpa, uint8_t size, uint64_t value);
+        uint64_t rdtsc(uint64_t value);
+        std::span<uint8_t> dma_write(uintptr_t gpa, std::span<uint8_t> buf);
+        bool interrupt(uint8_t cpu, uint8_t vector); // Returns false if the live interrupt should be dropped
+
+        // Called before running a timer or kick callback from a Preempt exit, when drives_callbacks() is true they aren't run live at all
+        void timer(uint8_t cpu, uint32_t source);
+        void kick(uint8_t cpu, uint32_t handler);
+        bool drives_callbacks() const { return mode == Mode::Replay; }
+
+        void on_exit(); // Called for every guest visible exit
+        void inject_pending(VCPU* vcpu); // Called before guest entry, injects logged interrupts and runs logged callbacks for vcpu that are due
+
+        private:
+        void put(const void* data, size_t size);
+        bool get(void* data, size_t size);
+        bool expect(uint8_t type);
+        void inject_due();
+        bool callback_due(uint8_t cpu, uint8_t& type, uint32_t& source);
+        void diverged(const char* what);
+        bool write(vfs::File* file);
+        void set_rdtsc_exiting(bool exiting);
+
+        Vm* vm;
+        Mode mode = Mode::Off;
+
+        std::vector<uint8_t> data;
+        size_t offset = 0; // Replay cursor into data
+        uint64_t n_exits = 0;
+        vfs::File* record_file = nullptr;
+
+        TicketLock lock{};
+    };
+} // namespace vm::replay
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Luna/common.hpp>
+
+namespace vm {
+    struct VCPU;
+} // namespace vm
+
+namespace vm::sched {
+    constexpr uint64_t timeslice_ms = 10;
+    constexpr uint64_t accounting_period_ms = 30;
+
+    constexpr uint16_t default_weight = 256;
+
+    struct Entity {
+        uint16_t weight = default_weight;
+        uint8_t cap = 0; // Percentage of a single physical CPU per accounting period, 0 means uncapped
+
+        int64_t credits = 0; // In TSC ticks
+        uint64_t used = 0; // TSC ticks used in the current accounting period
+        uint64_t slice_start = 0;
+
+        bool registered = false;
+    };
+
+    void add(VCPU* vcpu, uint16_t weight = default_weight, uint8_t cap = 0);
+    void remove(VCPU* vcpu);
+    void set_params(VCPU* vcpu, uint16_t weight, uint8_t cap);
+
+    void start_slice(VCPU* vcpu);
+    void end_slice(VCPU* vcpu);
+} // namespace vm::sched
@@ -8,6 +8,11 @@
 #include <Luna/cpu/regs.hpp>
 #include <Luna/vmm/drivers.hpp>
 #include <Luna/vmm/drivers/irqs/lapic.hpp>
+#include <Luna/vmm/sched.hpp>
+#include <Luna/vmm/cpuid.hpp>
+#include <Luna/vmm/hypercall.hpp>
+#include <Luna/vmm/profiler.hpp>
+#include <Luna/vmm/replay.hpp>
 
 namespace vm {
     struct RegisterState {
@@ -46,7 +51,7 @@ namespace vm {
 
     constexpr size_t max_x86_instruction_size = 15;
     struct VmExit {
-        enum class Reason { Unknown, Hlt, Vmcall, MMUViolation, PIO, MSR, CPUID, RSM, CrMov };
+        enum class Reason { Unknown, Hlt, Vmcall, MMUViolation, PIO, MSR, CPUID, RSM, CrMov, Preempt, Xsetbv, Rdtsc };
         static constexpr const char* reason_to_string(const Reason& reason) {
             switch (reason) {
                 case Reason::Unknown: return "Unknown";
@@ -58,6 +63,9 @@ namespace vm {
                 case Reason::CPUID: return "CPUID";
                 case Reason::RSM: return "RSM";
                 case Reason::CrMov: return "Move {to, from} CR";
+                case Reason::Preempt: return "Preemption";
+                case Reason::Xsetbv: return "XSETBV";
+                case Reason::Rdtsc: return "RDTSC{P}";
                 default: return "Unknown";
             }
         }
@@ -93,7 +101,14 @@ namespace vm {
             struct {
                 uint8_t cr, gpr;
                 bool write;
+
+                bool clts, lmsw; // Not a MOV, but CLTS or LMSW, for which gpr and write are meaningless
+                uint16_t lmsw_source;
             } cr;
+
+            struct {
+                bool rdtscp;
+            } rdtsc;
         };
     };
 
@@ -110,7 +125,7 @@ namespace vm {
         virtual uint8_t get_levels() const = 0;
     };
 
-    enum class VmCap { FullPIOAccess, SMMEntryCallback, SMMLeaveCallback, HypercallCallback };
+    enum class VmCap { FullPIOAccess, SMMEntryCallback, SMMLeaveCallback, HypercallCallback, RdtscExiting };
     namespace VmRegs {
         enum {
             General = (1 << 0),
@@ -181,7 +196,9 @@ namespace vm {
 
         void dma_write(uintptr_t gpa, std::span<uint8_t> buf);
         void dma_read(uintptr_t gpa, std::span<uint8_t> buf);
+        void dma_map(uintptr_t gpa, size_t size, std::vector<std::span<uint8_t>>& segments); // Appends the host mappings of a guest range, bypasses the replay log
 
+        void inject_irq(uint8_t vector); // External interrupt from a device model, goes through the replay log
 
         
         PageWalkInfo walk_guest_paging(uintptr_t gva);
@@ -209,13 +226,48 @@ namespace vm {
             uint8_t default_type;
         } mtrr;
         uint64_t apicbase;
-        uint64_t tsc;
+        uint64_t tsc_offset; // Guest TSC = Host TSC + tsc_offset, kept constant so the guest TSC is invariant
+        uint64_t pvclock_msr = 0;
+        uint64_t xcr0 = xcr0::X87; // Switched in by the backends around guest entry
         uint64_t smbase;
 
         bool is_in_smm, should_exit;
 
+        sched::Entity sched_entity;
+        uint64_t timeslice_deadline = 0; // Host TSC value at which the backend should force an exit, 0 if none
+        profiler::Profiler profiler;
+
+        // One-shot timers for device models, they fire from a Preempt exit on this VCPU, so callbacks run in the same context as MMIO and PIO handlers
+        // Starting a timer with the same fn and userptr as an armed one re-arms it
+        void start_timer(uint64_t deadline, void (*fn)(VCPU*, void*), void* userptr);
+        void stop_timer(void (*fn)(VCPU*, void*), void* userptr);
+
+        struct Timer {
+            uint64_t deadline; // Host TSC
+            void (*fn)(VCPU*, void*);
+            void* userptr;
+            uint32_t source; // Index into timer_sources
+        };
+        std::vector<Timer> timers;
+
+        // Every fn and userptr pair that was ever started, in order of first use, so the replay log can name a timer across runs
+        std::vector<std::pair<void (*)(VCPU*, void*), void*>> timer_sources;
+        bool run_timer(uint32_t source); // Fires an armed timer now, returns false if it isn't armed
+        bool run_kick_handler(uint32_t handler);
+
+        // Host interrupt sources of device models, kick() is the only IRQ safe part, it makes the VCPU take a Preempt exit as soon as possible and run the kick handlers from there
+        // Handlers have to be added before the VCPU starts running
+        void add_kick_handler(void (*fn)(VCPU*, void*), void* userptr);
+        void kick() { __atomic_store_n(&kicked, true, __ATOMIC_RELEASE); }
+
+        std::vector<std::pair<void (*)(VCPU*, void*), void*>> kick_handlers;
+        bool kicked = false;
+
+        uint64_t next_deadline() const; // Earliest of the timeslice, profiler and device timer deadlines, 0 if none
+
         uint64_t cr0_constraint = 0, cr4_constraint = 0, efer_constraint = 0;
 
+        uint8_t id;
         Vm* vm;
         AbstractVm* vcpu;
 
@@ -224,12 +276,39 @@ namespace vm {
         void (*smm_entry_callback)(VCPU*, void*); void* smm_entry_userptr;
         void (*smm_leave_callback)(VCPU*, void*); void* smm_leave_userptr;
         void (*hypercall_callback)(VCPU*, void*); void* hypercall_userptr;
+        hypercall::Ring hypercall_ring;
+    };
+
+    // Write tracking for guest memory the host reads on its own schedule, like framebuffers
+    // Pages are write-protected until their first write after every collection, so a range that isn't written to costs nothing
+    struct DirtyLog {
+        uintptr_t base;
+        size_t n_pages;
+        std::vector<uint64_t> bitmap; // Pages written since the last collection
     };
 
     struct Vm {
-        Vm(uint8_t n_cpus);
+        Vm(uint8_t n_cpus, const cpuid::Policy& policy = cpuid::default_policy());
 
         void set_irq(uint8_t irq, bool level);
+        void send_msi(uint64_t address, uint32_t data);
+
+        // Guest RAM that can be given back to the host, pages that are discarded are repopulated with zeroes on the next access
+        void add_ram(uintptr_t gpa, size_t size);
+        bool is_ram(uintptr_t gpa) const;
+        bool discard_page(uintptr_t gpa);
+        bool populate_page(uintptr_t gpa);
+        uintptr_t get_phys(uintptr_t gpa); // Like mm->get_phys, but populates discarded RAM
+
+        DirtyLog* start_dirty_log(uintptr_t gpa, size_t size); // The range has to be mapped writable already
+        void stop_dirty_log(DirtyLog* log);
+        bool collect_dirty_log(DirtyLog& log, std::vector<uint64_t>& dirty); // Swaps out the bitmap and protects those pages again, returns false if nothing was written
+        bool handle_dirty_write(uintptr_t gpa);
+
+        cpuid::Table cpuid_table;
+        uint64_t boot_tsc; // Host TSC at creation, epoch of the paravirtual clock
+        hypercall::Services hypercall_services;
+        replay::Log replay_log;
 
         std::unordered_map<uint16_t, AbstractPIODriver*> pio_map;
         std::unordered_map<uintptr_t, std::pair<AbstractMMIODriver*, size_t>> mmio_map;
@@ -237,6 +316,13 @@ namespace vm {
         std::vector<VCPU> cpus;
         std::vector<AbstractIRQListener*> irq_listeners;
         AbstractMM* mm;
+
+        std::vector<std::pair<uintptr_t, size_t>> ram;
+        std::unordered_map<uintptr_t, bool> discarded_pages;
+        size_t n_discarded_pages = 0;
+        std::vector<DirtyLog*> dirty_logs;
+
+        bool ram_pinned = false; // Set when a passthrough device can DMA into guest RAM, its pages can't be discarded anymore
     };
 
     void init();
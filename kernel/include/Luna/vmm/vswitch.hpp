@@ -0,0 +1,67 @@
+#pragma once
+
+#include <Luna/common.hpp>
+#include <Luna/net/if.hpp>
+
+#include <Luna/cpu/cpu.hpp>
+#include <std/mutex.hpp>
+#include <std/span.hpp>
+
+// Learning Ethernet switch connecting guest NICs to each other, and optionally to a host NIC as uplink
+// Frames can be sent from any context, including the uplink's IRQ handler, so every port has a locked inbox that its owner drains
+// A port can have an owning VCPU, which is kicked whenever a frame lands in the inbox, so the owner doesn't have to poll
+namespace vm {
+    struct VCPU;
+} // namespace vm
+
+namespace vm::vswitch {
+    constexpr size_t max_frame_size = 1514; // Without FCS
+    constexpr size_t inbox_size = 128;
+    constexpr size_t max_ports = 16;
+    constexpr size_t mac_table_size = 64;
+
+    struct Frame {
+        size_t len;
+        uint8_t data[max_frame_size];
+    };
+
+    struct Port {
+        // Owner API, front() stays valid until pop()
+        Frame* front();
+        void pop();
+
+        private:
+        bool push(std::span<uint8_t> frame);
+
+        Frame inbox[inbox_size];
+        size_t head = 0, tail = 0; // Owner consumes at head, the switch produces at tail
+        TicketLock lock{};
+
+        VCPU* owner = nullptr;
+
+        friend struct Switch;
+    };
+
+    struct Switch {
+        Port* add_port(VCPU* owner = nullptr);
+        void attach_uplink(net::Nic* nic);
+
+        void send(Port* from, std::span<uint8_t> frame); // from is nullptr for frames from the uplink
+
+        private:
+        void learn(const net::Mac& mac, Port* port);
+        bool lookup(const net::Mac& mac, Port*& port);
+
+        Port* ports[max_ports] = {};
+        size_t n_ports = 0;
+        net::Nic* uplink = nullptr;
+
+        struct {
+            net::Mac mac;
+            Port* port; // nullptr for the uplink
+        } mac_table[mac_table_size] = {};
+        size_t n_macs = 0, next_evict = 0;
+
+        TicketLock lock{};
+    };
+} // namespace vm::vswitch
@@ -47,6 +47,18 @@ namespace std
             return false;
         }
 
+        bool erase(const Key& key) {
+            auto& list = _map[_hasher(key) % bucket_size];
+
+            for(auto it = list.begin(); it != list.end(); ++it) {
+                if(it->first == key) {
+                    list.erase(it);
+                    return true;
+                }
+            }
+            return false;
+        }
+
         struct Iterator {
             using entry_type = std::pair<Key, T>;
 
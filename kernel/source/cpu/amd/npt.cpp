@@ -2,10 +2,14 @@
 #include <Luna/cpu/amd/asid.hpp>
 #include <Luna/cpu/paging.hpp>
 #include <Luna/cpu/cpu.hpp>
+#include <Luna/cpu/idt.hpp>
 
 #include <std/utility.hpp>
 #include <std/string.hpp>
 
+// Only there to cause an INTR intercept on the target CPU
+static uint8_t shootdown_vector = 0;
+
 static std::pair<uintptr_t, uintptr_t> create_table(){
     auto pa = pmm::alloc_block();
     if(!pa)
@@ -44,6 +48,11 @@ npt::context::context(uint8_t levels): levels{levels} {
 
     asid = get_cpu().cpu.svm.asid_manager->alloc();
     ASSERT(asid != ~0u);
+
+    if(shootdown_vector == 0) {
+        shootdown_vector = idt::allocate_vector();
+        idt::set_handler(shootdown_vector, idt::handler{.f = [](uint8_t, idt::regs*, void*) {}, .is_irq = true, .should_iret = true, .userptr = nullptr});
+    }
 }
 
 npt::context::~context(){
@@ -93,7 +102,7 @@ void npt::context::map(uintptr_t pa, uintptr_t va, uint64_t flags) {
     page.no_execute = (flags & paging::mapPageExecute) ? 0 : 1;
     page.frame = (pa >> 12);
 
-    svm::invlpga(asid, va);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST); // invlpga only works on guest virtual addresses, so let the VMCB flush the ASID on the next vmrun
 }
 
 void npt::context::protect(uintptr_t va, uint64_t flags) {
@@ -101,11 +110,17 @@ void npt::context::protect(uintptr_t va, uint64_t flags) {
     if(!page)
         return;
 
+    auto old = *page;
     page->present = (flags & paging::mapPagePresent) ? 1 : 0;
     page->writeable = (flags & paging::mapPageWrite) ? 1 : 0;
     page->no_execute = (flags & paging::mapPageExecute) ? 0 : 1;
 
-    svm::invlpga(asid, va);
+    auto gen = __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+
+    // Upgrades only cause a spurious NPF until the lazy flush, but a stale entry with more permissions would let the guest write past a write-protect
+    bool downgrade = (old.present && !page->present) || (old.writeable && !page->writeable) || (!old.no_execute && page->no_execute);
+    if(downgrade)
+        shootdown(gen);
 }
 
 uintptr_t npt::context::unmap(uintptr_t va) {
@@ -124,11 +139,41 @@ uintptr_t npt::context::unmap(uintptr_t va) {
     entry->user = 0;
     entry->frame = 0;
 
-    svm::invlpga(asid, va);
+    shootdown(__atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST)); // Callers free the frame right after
 
     return ret;
 }
 
+void npt::context::add_user(User* user) {
+    std::lock_guard guard{users_lock};
+    users.push_back(user);
+}
+
+void npt::context::remove_user(User* user) {
+    std::lock_guard guard{users_lock};
+    for(auto it = users.begin(); it != users.end(); ++it) {
+        if(*it == user) {
+            users.erase(it);
+            return;
+        }
+    }
+}
+
+void npt::context::shootdown(uint64_t gen) {
+    std::lock_guard guard{users_lock};
+
+    auto stale = [gen](const User* user) { return __atomic_load_n(&user->in_guest, __ATOMIC_SEQ_CST) && __atomic_load_n(&user->generation, __ATOMIC_SEQ_CST) < gen; };
+
+    for(auto* user : users)
+        if(stale(user))
+            get_cpu().lapic.send_ipi(__atomic_load_n(&user->lapic_id, __ATOMIC_SEQ_CST), shootdown_vector);
+
+    // Either it already entered with this generation and flushed, or it exits on the IPI, which stays pending across clgi until vmrun
+    for(auto* user : users)
+        while(stale(user))
+            asm("pause");
+}
+
 uintptr_t npt::context::get_phys(uintptr_t va) {
     uintptr_t off = va & 0xFFF;
     auto* entry = walk(va, false); // Since we're just getting stuff it wouldn't make sense to make new tables, so we can get null as valid result
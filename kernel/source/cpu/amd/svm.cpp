@@ -1,10 +1,18 @@
 #include <Luna/cpu/amd/svm.hpp>
 #include <Luna/cpu/cpu.hpp>
+#include <Luna/cpu/idt.hpp>
+
+#include <Luna/drivers/hpet.hpp>
 
 #include <std/string.hpp>
 
 #include <Luna/misc/log.hpp>
 
+#include <Luna/vmm/emulate.hpp>
+
+// SVM has no preemption timer, so timeslices are bounded by a one-shot host LAPIC timer, which causes an INTR intercept
+static uint8_t timeslice_vector = 0;
+
 void svm::init() {
     ASSERT(svm::is_supported());
 
@@ -22,6 +30,11 @@ void svm::init() {
     auto& svm = get_cpu().cpu.svm;
     svm.n_asids = b;
 
+    svm.nrip_save = (d >> 3) & 1;
+    svm.vmcb_clean = (d >> 5) & 1;
+    svm.flush_by_asid = (d >> 6) & 1;
+    svm.decode_assists = (d >> 7) & 1;
+
     if(!(d & (1 << 0)))
         PANIC("Required feature NPT is unsupported");
 
@@ -33,6 +46,11 @@ void svm::init() {
     msr::write(msr::vm_hsave_pa, hsave);
 
     svm.asid_manager.init(svm.n_asids);
+
+    if(timeslice_vector == 0) {
+        timeslice_vector = idt::allocate_vector();
+        idt::set_handler(timeslice_vector, idt::handler{.f = [](uint8_t, idt::regs*, void*) {}, .is_irq = true, .should_iret = true, .userptr = nullptr});
+    }
 }
 
 npt::context* svm::create_npt() {
@@ -62,6 +80,8 @@ svm::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
     vmcb_pa = pmm::alloc_block();
     ASSERT(vmcb_pa);
 
+    static_cast<npt::context*>(mm)->add_user(&npt_user);
+
     vmcb = (Vmcb*)(vmcb_pa + phys_mem_map);
     memset((void*)vmcb, 0, pmm::block_size);
 
@@ -103,7 +123,7 @@ svm::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
     vmcb->pat = 0x0007040600070406; // Default PAT
 
     vmcb->guest_asid = mm->get_asid();
-    vmcb->tlb_control = 0; // Do no TLB flushes on vmrun, all TLB flushes are done by the NPT using invlpga
+    vmcb->tlb_control = 0; // Only flush when the NPT changed or we moved to a different CPU, see run()
 
     io_bitmap_pa = pmm::alloc_n_blocks(io_bitmap_size);
     io_bitmap = (uint8_t*)(io_bitmap_pa + phys_mem_map);
@@ -121,6 +141,8 @@ svm::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
 }
 
 svm::Vm::~Vm() {
+    static_cast<npt::context*>(mm)->remove_user(&npt_user);
+
     pmm::free_block(vmcb_pa);
     for(size_t i = 0; i < io_bitmap_size; i++)
         pmm::free_block(io_bitmap_pa + (i * pmm::block_size));
@@ -152,8 +174,14 @@ void svm::Vm::inject_int(vm::AbstractVm::InjectType type, uint8_t vector, bool e
 }
 
 void svm::Vm::set(vm::VmCap cap, bool value) {
-    if(cap == vm::VmCap::FullPIOAccess)
+    if(cap == vm::VmCap::FullPIOAccess) {
         vmcb->icept_io = (value ? 0 : 1);
+        dirty |= clean::Intercepts;
+    } else if(cap == vm::VmCap::RdtscExiting) {
+        vmcb->icept_rdtsc = value;
+        vmcb->icept_rdtscp = value;
+        dirty |= clean::Intercepts;
+    }
 }
 
 bool svm::Vm::run(vm::VmExit& exit) {
@@ -165,12 +193,67 @@ bool svm::Vm::run(vm::VmExit& exit) {
         auto kgs_base = msr::read(msr::kernel_gs_base);
         auto pat = msr::read(msr::ia32_pat);
 
-        vmcb->tsc_offset = -cpu::rdtsc() + vcpu->tsc;
+        if(vcpu->tsc_offset != vmcb->tsc_offset) {
+            vmcb->tsc_offset = vcpu->tsc_offset;
+            dirty |= clean::Intercepts;
+        }
+
+        // Armed again on every entry, the one-shot can fire early as LAPIC and TSC calibration don't agree exactly, and this might be another CPU than last time
+        if(auto deadline = vcpu->next_deadline(); deadline) {
+            auto now = cpu::rdtsc();
+            if(now >= deadline) { // Already due, like a pending kick, there's no point in entering the guest just to arm a 1ms timer
+                asm("stgi");
+
+                exit.reason = vm::VmExit::Reason::Preempt;
+                exit.instruction_len = 0;
+                return true;
+            }
+
+            auto ms = max(div_ceil(deadline - now, cpu::tsc_ticks_per_ms()), 1);
+
+            get_cpu().lapic.start_timer(timeslice_vector, ms, lapic::regs::LapicTimerModes::OneShot, hpet::poll_msleep);
+        }
+
+        {
+            auto& cpu = get_cpu();
+            bool flush = false;
+
+            // Clean bits and TLB entries are only valid for the CPU we last ran on
+            if(cpu.lapic_id != last_cpu) {
+                last_cpu = cpu.lapic_id;
+                dirty = clean::All;
+                flush = true;
+            }
+
+            // Published before the generation is read, so an unmap either sees us in the guest, or we see its generation, see npt::context::shootdown
+            __atomic_store_n(&npt_user.lapic_id, cpu.lapic_id, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&npt_user.in_guest, true, __ATOMIC_SEQ_CST);
+            if(auto generation = static_cast<npt::context*>(mm)->get_generation(); generation != npt_generation) { // This downcast should be safe
+                npt_generation = generation;
+                flush = true;
+            }
+            __atomic_store_n(&npt_user.generation, npt_generation, __ATOMIC_SEQ_CST);
+
+            if(flush)
+                vmcb->tlb_control = cpu.cpu.svm.flush_by_asid ? 3 : 1; // Flush this guest's TLB entries, or everything if we can't
+            else
+                vmcb->tlb_control = 0;
+
+            vmcb->vmcb_clean = cpu.cpu.svm.vmcb_clean ? (~dirty & clean::All) : 0;
+        }
+
+        // XCR0 decides which components xsave and xrstor touch, so the guest value has to be live while its state is loaded
+        auto host_xcr0 = get_cpu().simd_data.xcr0;
+        bool switch_xcr0 = host_xcr0 && (vcpu->xcr0 != host_xcr0);
 
         host_simd.store();
+        if(switch_xcr0)
+            xcr0::write(vcpu->xcr0);
         guest_simd.load();
 
         svm_vmrun(&guest_gprs, vmcb_pa);
+        __atomic_store_n(&npt_user.in_guest, false, __ATOMIC_SEQ_CST);
+        dirty = 0;
 
         msr::write(msr::fs_base, fs_base);
         msr::write(msr::gs_base, gs_base);
@@ -178,10 +261,10 @@ bool svm::Vm::run(vm::VmExit& exit) {
         msr::write(msr::ia32_pat, pat);
 
         guest_simd.store();
+        if(switch_xcr0)
+            xcr0::write(host_xcr0);
         host_simd.load();
 
-        vcpu->tsc = cpu::rdtsc() + vmcb->tsc_offset;
-
         auto& cpu_data = get_cpu();
         cpu_data.tss_table.load(cpu_data.gdt_table.push_tss(&cpu_data.tss_table, cpu_data.tss_sel));
 
@@ -189,8 +272,42 @@ bool svm::Vm::run(vm::VmExit& exit) {
 
         auto next_instruction = [&]() { vmcb->rip += exit.instruction_len; };
 
+        // With NRIP save the CPU tells us where the next instruction is, which also accounts for any prefixes
+        auto instruction_len = [&](uint8_t len) -> uint8_t { return cpu_data.cpu.svm.nrip_save ? (vmcb->next_rip - vmcb->rip) : len; };
+
         auto code = vmcb->exitcode;
         switch (code) {
+        case 0x00 ... 0x1F: { // CR Access
+            exit.reason = vm::VmExit::Reason::CrMov;
+
+            exit.cr.cr = code & 0xF;
+            exit.cr.write = (code >= 0x10);
+
+            if(cpu_data.cpu.svm.decode_assists) {
+                if(!(vmcb->exitinfo1 >> 63)) {
+                    print("svm: CR{} access by CLTS, LMSW or SMSW is unsupported\n", (uint64_t)exit.cr.cr);
+                    return false;
+                }
+
+                exit.cr.gpr = vmcb->exitinfo1 & 0xF;
+                exit.instruction_len = instruction_len(3);
+            } else {
+                auto grip = vmcb->cs.base + vmcb->rip;
+                vcpu->mem_read(grip, {exit.instruction});
+
+                if(exit.instruction[0] != 0x0F || (exit.instruction[1] != 0x20 && exit.instruction[1] != 0x22))
+                    PANIC("Unknown move to cr instruction");
+
+                auto modrm = vm::emulate::parse_modrm(exit.instruction[2]);
+                exit.cr.gpr = modrm.rm;
+                exit.instruction_len = instruction_len(3);
+            }
+
+            next_instruction();
+
+            return true;
+        }
+
         case 0x40 ... 0x5F: { // Exception
             auto int_no = code - 0x40;
             auto grip = vmcb->cs.base + vmcb->rip;
@@ -218,12 +335,35 @@ bool svm::Vm::run(vm::VmExit& exit) {
             return false;
         }
         case 0x60: // External Interrupt
+            // SVM has no acknowledge on exit, the interrupt stays pending while GIF=0 and is taken through the IDT exactly once at stgi
+            if(auto deadline = vcpu->next_deadline(); deadline && cpu::rdtsc() >= deadline) {
+                exit.reason = vm::VmExit::Reason::Preempt;
+                exit.instruction_len = 0;
+
+                return true;
+            }
             break;
 
+        case 0x6E: // RDTSC
+        case 0x87: { // RDTSCP
+            exit.reason = vm::VmExit::Reason::Rdtsc;
+            exit.rdtsc.rdtscp = (code == 0x87);
+
+            exit.instruction_len = instruction_len(exit.rdtsc.rdtscp ? 3 : 2);
+            exit.instruction[0] = 0x0F;
+            exit.instruction[1] = exit.rdtsc.rdtscp ? 0x01 : 0x31;
+            if(exit.rdtsc.rdtscp)
+                exit.instruction[2] = 0xF9;
+
+            next_instruction();
+
+            return true;
+        }
+
         case 0x72: { // CPUID
             exit.reason = vm::VmExit::Reason::CPUID;
 
-            exit.instruction_len = 2;
+            exit.instruction_len = instruction_len(2);
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0xA2;
 
@@ -235,7 +375,7 @@ bool svm::Vm::run(vm::VmExit& exit) {
         case 0x73: { // RSM
             exit.reason = vm::VmExit::Reason::RSM;
 
-            exit.instruction_len = 2;
+            exit.instruction_len = instruction_len(2);
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0xAA;
 
@@ -266,7 +406,7 @@ bool svm::Vm::run(vm::VmExit& exit) {
             exit.reason = vm::VmExit::Reason::MSR;
 
             exit.msr.write = vmcb->exitinfo1 & 1;
-            exit.instruction_len = 2; // Both WRMSR and RDMSR are 2 bytes long
+            exit.instruction_len = instruction_len(2); // Both WRMSR and RDMSR are 2 bytes long
 
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = exit.msr.write ? 0x30 : 0x32;
@@ -279,7 +419,7 @@ bool svm::Vm::run(vm::VmExit& exit) {
         case 0x81: { // VMMCALL
             exit.reason = vm::VmExit::Reason::Vmcall;
 
-            exit.instruction_len = 3;
+            exit.instruction_len = instruction_len(3);
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0x01;
             exit.instruction[2] = 0xD9;
@@ -289,6 +429,19 @@ bool svm::Vm::run(vm::VmExit& exit) {
             return true;
         }
         
+        case 0x8D: { // XSETBV
+            exit.reason = vm::VmExit::Reason::Xsetbv;
+
+            exit.instruction_len = instruction_len(3);
+            exit.instruction[0] = 0x0F;
+            exit.instruction[1] = 0x01;
+            exit.instruction[2] = 0xD1;
+
+            next_instruction();
+
+            return true;
+        }
+        
         case 0x400: { // Nested Page Fault
             auto addr = vmcb->exitinfo2;
             NPTViolationInfo info{.raw = vmcb->exitinfo1};
@@ -311,6 +464,13 @@ bool svm::Vm::run(vm::VmExit& exit) {
             exit.mmu.gpa = addr;
             exit.mmu.reserved_bits_set = info.reserved_bit_set;
 
+            // DecodeAssists fetches the faulting instruction for us, pass it on so the emulator doesn't have to walk the guest page tables
+            if(cpu_data.cpu.svm.decode_assists) {
+                exit.instruction_len = vmcb->instruction_len;
+                for(size_t i = 0; i < vmcb->instruction_len && i < vm::max_x86_instruction_size; i++)
+                    exit.instruction[i] = vmcb->instruction_bytes[i];
+            }
+
             return true;
         }
 
@@ -426,6 +586,8 @@ void svm::Vm::set_regs(const vm::RegisterState& regs, uint64_t flags) {
         guest_gprs.dr3 = regs.dr3;
         vmcb->dr6 = regs.dr6;
         vmcb->dr7 = regs.dr7;
+
+        dirty |= clean::Dr;
     }
     
     if(flags & vm::VmRegs::Control) {
@@ -434,6 +596,8 @@ void svm::Vm::set_regs(const vm::RegisterState& regs, uint64_t flags) {
         vmcb->cr4 = regs.cr4;
 
         vmcb->efer = regs.efer;
+
+        dirty |= clean::Cr;
     }
     
     if(flags & vm::VmRegs::Segment) {
@@ -462,5 +626,7 @@ void svm::Vm::set_regs(const vm::RegisterState& regs, uint64_t flags) {
 
         SET_SEGMENT(ldtr);
         SET_SEGMENT(tr);
+
+        dirty |= clean::Seg | clean::Dt;
     }
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include <Luna/cpu/regs.hpp>
 #include <cpuid.h>
 
+#include <Luna/drivers/hpet.hpp>
+
 void CpuData::set() {
     self = this;
     msr::write(msr::gs_base, (uint64_t)&self);
@@ -29,6 +31,20 @@ uint64_t cpu::rdtsc() {
     return a | ((uint64_t)d << 32);
 }
 
+uint64_t cpu::tsc_ticks_per_ms() {
+    static uint64_t ticks_per_ms = 0;
+    if(auto ticks = __atomic_load_n(&ticks_per_ms, __ATOMIC_SEQ_CST); ticks != 0)
+        return ticks;
+
+    // Calibrate against the HPET, so this can't be used before hpet::init()
+    auto start = rdtsc();
+    hpet::poll_msleep(10);
+    auto ticks = (rdtsc() - start) / 10;
+
+    __atomic_store_n(&ticks_per_ms, ticks, __ATOMIC_SEQ_CST);
+    return ticks;
+}
+
 void cpu::early_init() {
     // NX Support
     {
@@ -133,4 +133,12 @@ extern "C" void isr_handler(idt::regs* regs) {
 
     if(!handlers[int_number].should_iret && !handlers[int_number].is_irq)
         asm("cli; hlt");
-}
\ No newline at end of file
+}
+
+void idt::dispatch(uint8_t vector) {
+    idt::regs regs{};
+    regs.int_num = vector;
+    regs.cs = gdt::kcode;
+
+    isr_handler(&regs);
+}
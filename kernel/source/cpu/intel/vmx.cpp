@@ -12,8 +12,6 @@
 #include <Luna/mm/pmm.hpp>
 #include <Luna/mm/vmm.hpp>
 
-#include <Luna/vmm/emulate.hpp>
-
 extern "C" {
     uint64_t vmx_vmlaunch(vmx::GprState* gprs); // These functions return rflags after vmlaunch or vmresume
     uint64_t vmx_vmresume(vmx::GprState* gprs);
@@ -143,6 +141,11 @@ void vmx::init() {
 
     cpu.vmx.ept_dirty_accessed = (ept >> 21) & 1;
 
+    // The preemption timer counts down at the TSC rate divided by 2^shift
+    auto pin = msr::read(msr::ia32_vmx_pinbased_ctls) >> 32;
+    cpu.vmx.preemption_timer = (pin & (uint32_t)PinBasedControls::VMXPreempt) != 0;
+    cpu.vmx.preemption_timer_shift = msr::read(msr::ia32_vmx_misc) & 0x1F;
+
     ASSERT(ept & (1 << 20)); // Assert invept is supported
     ASSERT(ept & (1 << 25)); // Assert single context invept is supported
 }
@@ -180,7 +183,7 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
 
     {
         uint32_t min = (uint32_t)PinBasedControls::NMI | (uint32_t)PinBasedControls::ExtInt;
-        uint32_t opt = 0;
+        uint32_t opt = get_cpu().cpu.vmx.preemption_timer ? (uint32_t)PinBasedControls::VMXPreempt : 0;
         write(pin_based_vm_exec_controls, adjust_controls(min, opt, msr::ia32_vmx_pinbased_ctls));
     }
 
@@ -207,7 +210,7 @@ vmx::Vm::Vm(vm::AbstractMM* mm, vm::VCPU* vcpu): mm{mm}, vcpu{vcpu} {
     write(cr0_mask, ~0);
 
     {
-        uint32_t min = (uint32_t)VMExitControls::LongMode | (uint32_t)VMExitControls::LoadIA32EFER;
+        uint32_t min = (uint32_t)VMExitControls::LongMode | (uint32_t)VMExitControls::LoadIA32EFER | (uint32_t)VMExitControls::AckIntOnExit;
         uint32_t opt = 0;
         write(vm_exit_control, adjust_controls(min, opt, msr::ia32_vmx_exit_ctls));
     }
@@ -265,6 +268,11 @@ void vmx::Vm::set(vm::VmCap cap, bool value) {
             write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) & ~(uint32_t)ProcBasedControls::VMExitOnPIO);
         else
             write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) | (uint32_t)ProcBasedControls::VMExitOnPIO);
+    } else if(cap == vm::VmCap::RdtscExiting) {
+        if(value)
+            write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) | (uint32_t)ProcBasedControls::VMExitOnRdtsc);
+        else
+            write(proc_based_vm_exec_controls, read(proc_based_vm_exec_controls) & ~(uint32_t)ProcBasedControls::VMExitOnRdtsc);
     }
 }
 
@@ -302,9 +310,27 @@ bool vmx::Vm::run(vm::VmExit& exit) {
 
         vmptrld();
 
-        write(tsc_offset, -cpu::rdtsc() + vcpu->tsc);
+        write(tsc_offset, vcpu->tsc_offset);
+
+        if(get_cpu().cpu.vmx.preemption_timer) {
+            uint64_t value = 0xFFFF'FFFF;
+            if(auto deadline = vcpu->next_deadline(); deadline) {
+                auto now = cpu::rdtsc();
+                auto left = (deadline > now) ? (deadline - now) : 0;
+
+                value = min(left >> get_cpu().cpu.vmx.preemption_timer_shift, 0xFFFF'FFFF);
+            }
+
+            write(guest_preemption_timer_value, value);
+        }
+
+        // XCR0 decides which components xsave and xrstor touch, so the guest value has to be live while its state is loaded
+        auto host_xcr0 = get_cpu().simd_data.xcr0;
+        bool switch_xcr0 = host_xcr0 && (vcpu->xcr0 != host_xcr0);
 
         host_simd.store();
+        if(switch_xcr0)
+            xcr0::write(vcpu->xcr0);
         guest_simd.load();
 
         uint64_t rflags = 0;
@@ -316,14 +342,22 @@ bool vmx::Vm::run(vm::VmExit& exit) {
         }
 
         guest_simd.store();
+        if(switch_xcr0)
+            xcr0::write(host_xcr0);
         host_simd.load();
 
-        vcpu->tsc = cpu::rdtsc() + tsc_offset;
-
         // VM Exits restore the GDT and IDT Limit to 0xFFFF for some reason, so fix them
         get_cpu().gdt_table.set();
         idt::load();
 
+        // The CPU already acknowledged the interrupt that caused this exit, so it won't be delivered through the IDT again
+        // Dispatch it directly, with interrupts still disabled like an interrupt gate would
+        if(!(rflags & ((1 << 0) | (1 << 6))) && (read(vm_exit_reason) & 0xFFFF) == (uint32_t)VMExitReasons::ExtInt) {
+            InterruptionInfo info{.raw = (uint32_t)read(vm_exit_interruption_info)};
+            if(info.valid)
+                idt::dispatch(info.vector);
+        }
+
         asm("sti");
 
         // rflags.CF is set when an error occurs and there is no current VMCS
@@ -389,7 +423,7 @@ bool vmx::Vm::run(vm::VmExit& exit) {
         } else if(basic_reason == VMExitReasons::CPUID) {
             exit.reason = vm::VmExit::Reason::CPUID;
 
-            exit.instruction_len = 2;
+            exit.instruction_len = read(vm_exit_instruction_len);
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0xA2;
 
@@ -399,37 +433,48 @@ bool vmx::Vm::run(vm::VmExit& exit) {
         } else if(basic_reason == VMExitReasons::Hlt) {
             exit.reason = vm::VmExit::Reason::Hlt;
 
-            exit.instruction_len = 1;
+            exit.instruction_len = read(vm_exit_instruction_len);
             exit.instruction[0] = 0xF4;
 
             next_instruction();
 
+            return true;
+        } else if(basic_reason == VMExitReasons::Rdtsc || basic_reason == VMExitReasons::Rdtscp) {
+            exit.reason = vm::VmExit::Reason::Rdtsc;
+            exit.rdtsc.rdtscp = (basic_reason == VMExitReasons::Rdtscp);
+
+            exit.instruction_len = read(vm_exit_instruction_len);
+            exit.instruction[0] = 0x0F;
+            exit.instruction[1] = exit.rdtsc.rdtscp ? 0x01 : 0x31;
+            if(exit.rdtsc.rdtscp)
+                exit.instruction[2] = 0xF9;
+
+            next_instruction();
+
             return true;
         } else if(basic_reason == VMExitReasons::MovToCr) {
-            exit.reason = vm::VmExit::Reason::CrMov;
+            CrQualification info{.raw = read(vm_exit_qualification)};
 
+            exit.reason = vm::VmExit::Reason::CrMov;
             exit.instruction_len = read(vm_exit_instruction_len);
 
-            auto grip = read(guest_cs_base) + read(guest_rip);
-            vcpu->mem_read(grip, {exit.instruction});
-
-            if(exit.instruction[0] == 0x0F && exit.instruction[1] == 0x20) {
-                // Mov cr0-cr7, {r32, r64}
-
-                auto modrm = vm::emulate::parse_modrm(exit.instruction[2]);
-                exit.cr.cr = modrm.reg;
-                exit.cr.gpr = modrm.rm;
-                exit.cr.write = false;
-            } else if(exit.instruction[0] == 0x0F && exit.instruction[1] == 0x22) {
-                // Mov cr0-cr7, {r32, r64}
-
-                auto modrm = vm::emulate::parse_modrm(exit.instruction[2]);
-                exit.cr.cr = modrm.reg;
-                exit.cr.gpr = modrm.rm;
-                exit.cr.write = true;
-            } else {
-                PANIC("Unknown move to cr instruction");
-            }
+            exit.cr.cr = info.cr;
+            exit.cr.gpr = info.gpr;
+            exit.cr.write = (info.type != 1); // Everything but MOV from CR writes
+            exit.cr.clts = (info.type == 2);
+            exit.cr.lmsw = (info.type == 3);
+            exit.cr.lmsw_source = info.lmsw_source;
+
+            next_instruction();
+
+            return true;
+        } else if(basic_reason == VMExitReasons::Xsetbv) {
+            exit.reason = vm::VmExit::Reason::Xsetbv;
+
+            exit.instruction_len = read(vm_exit_instruction_len);
+            exit.instruction[0] = 0x0F;
+            exit.instruction[1] = 0x01;
+            exit.instruction[2] = 0xD1;
 
             next_instruction();
 
@@ -437,7 +482,7 @@ bool vmx::Vm::run(vm::VmExit& exit) {
         } else if(basic_reason == VMExitReasons::Vmcall) {
             exit.reason = vm::VmExit::Reason::Vmcall;
 
-            exit.instruction_len = 3;
+            exit.instruction_len = read(vm_exit_instruction_len);
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0x01;
             exit.instruction[2] = 0xC1;
@@ -466,7 +511,7 @@ bool vmx::Vm::run(vm::VmExit& exit) {
             exit.reason = vm::VmExit::Reason::MSR;
 
             exit.msr.write = false;
-            exit.instruction_len = 2;
+            exit.instruction_len = read(vm_exit_instruction_len);
 
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0x32;
@@ -478,7 +523,7 @@ bool vmx::Vm::run(vm::VmExit& exit) {
             exit.reason = vm::VmExit::Reason::MSR;
 
             exit.msr.write = true;
-            exit.instruction_len = 2;
+            exit.instruction_len = read(vm_exit_instruction_len);
 
             exit.instruction[0] = 0x0F;
             exit.instruction[1] = 0x30;
@@ -509,6 +554,11 @@ bool vmx::Vm::run(vm::VmExit& exit) {
             exit.mmu.gpa = addr;
             exit.mmu.reserved_bits_set = false;
 
+            return true;
+        } else if(basic_reason == VMExitReasons::PreemptionTimer) {
+            exit.reason = vm::VmExit::Reason::Preempt;
+            exit.instruction_len = 0;
+
             return true;
         } else {
             print("vmx: Unknown VMExit Reason: {:d}\n", (uint64_t)basic_reason);
@@ -71,4 +71,16 @@ void lapic::Lapic::start_timer(uint8_t vector, uint64_t ms, lapic::regs::LapicTi
     write(regs::lvt_timer, (read(regs::lvt_timer) & 0xFFFFFF00) | vector);
     write(regs::timer_initial_count, ticks_per_ms * ms);
     write(regs::lvt_timer, read(regs::lvt_timer) & ~(1 << 16)); // Clear timer mask
-}
\ No newline at end of file
+}
+
+void lapic::Lapic::send_ipi(uint32_t dest, uint8_t vector) {
+    if(x2apic) {
+        msr::write(msr::x2apic_base + (regs::icr_low >> 4), ((uint64_t)dest << 32) | vector); // x2APIC has a single 64bit ICR
+    } else {
+        write(regs::icr_high, dest << 24);
+        write(regs::icr_low, vector);
+
+        while(read(regs::icr_low) & (1 << 12)) // Delivery Status
+            ;
+    }
+}
@@ -3,6 +3,8 @@
 
 #include <Luna/mm/hmm.hpp>
 
+#include <std/string.hpp>
+
 uint64_t msr::read(uint32_t msr) {
     uint32_t high = 0, low = 0;
     asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
@@ -35,6 +37,17 @@ void cr4::write(uint64_t v){
     asm volatile("mov %0, %%cr4" : : "r"(v) : "memory");
 }
 
+uint64_t xcr0::read(){
+    uint32_t low = 0, high = 0;
+    asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+
+    return ((uint64_t)high << 32) | low;
+}
+
+void xcr0::write(uint64_t v){
+    asm volatile("xsetbv" : : "a"(v & 0xFFFF'FFFF), "d"(v >> 32), "c"(0) : "memory");
+}
+
 void simd::init() {
     auto& data = get_cpu().simd_data;
 
@@ -45,8 +58,18 @@ void simd::init() {
         cr4::write(cr4::read() | (1 << 18)); // Set CR4.OSXSAVE
 
         ASSERT(cpu::cpuid(0xD, 0, a, b, c, d));
+        uint64_t supported = a | ((uint64_t)d << 32);
+
+        // Enable every component guests might want to use, AVX-512 state is all or nothing
+        uint64_t enabled = supported & (xcr0::X87 | xcr0::SSE | xcr0::AVX);
+        if((enabled & xcr0::AVX) && (supported & xcr0::AVX512) == xcr0::AVX512)
+            enabled |= xcr0::AVX512;
+
+        xcr0::write(enabled);
+        data.xcr0 = enabled;
 
-        data.region_size = c;
+        ASSERT(cpu::cpuid(0xD, 0, a, b, c, d));
+        data.region_size = b; // Size required by the components enabled in XCR0
         data.region_alignment = 64;
 
         data.load = [](const uint8_t* context) {
@@ -83,6 +106,8 @@ void simd::init() {
     } else if(d & (1 << 24)) { // FXSAVE
         cr4::write(cr4::read() | (1 << 9)); // Set CR4.OSFXSR
 
+        data.xcr0 = 0;
+
         data.region_size = 512;
         data.region_alignment = 16;
 
@@ -100,6 +125,10 @@ void simd::init() {
 simd::Context::Context() {
     _ctx = (uint8_t*)hmm::alloc(get_cpu().simd_data.region_size, get_cpu().simd_data.region_alignment);
     ASSERT(_ctx);
+
+    memset(_ctx, 0, get_cpu().simd_data.region_size);
+    if(get_cpu().simd_data.xcr0)
+        xstate_bv() = xcr0::X87 | xcr0::SSE; // Make xrstor load the legacy region instead of the init state
 }
 
 simd::Context::~Context() {
@@ -3,11 +3,14 @@
 
 #include <Luna/misc/log.hpp>
 
+static size_t n_cpus = 1;
+
 void smp::start_cpus(stivale2::Parser& boot_info, void (*f)(stivale2_smp_info*)) {
     auto* smp = (stivale2_struct_tag_smp*)boot_info.get_tag(STIVALE2_STRUCT_TAG_SMP_ID);
     bool x2apic = (smp->flags & 0x1);
 
     auto cpu_count = smp->cpu_count;
+    n_cpus = cpu_count;
     print("smp: Detected {} CPUs, with {:s}\n", cpu_count, x2apic ? "x2APIC" : "xAPIC");
 
     for(size_t i = 0; i < cpu_count; i++) {
@@ -27,4 +30,8 @@ void smp::start_cpus(stivale2::Parser& boot_info, void (*f)(stivale2_smp_info*))
             __atomic_store_n(&cpu.goto_address, (uintptr_t)f, __ATOMIC_SEQ_CST);
         }   
     }
+}
+
+size_t smp::get_cpu_count() {
+    return n_cpus;
 }
\ No newline at end of file
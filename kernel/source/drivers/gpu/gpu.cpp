@@ -49,12 +49,14 @@ void gpu::GpuManager::flush() {
 }
 
 void gpu::GpuManager::flush(const gpu::Rect& rect) {
-    auto* front = main_gpu->get_lfb();
-    auto* back = backbuffer;
+    auto bytes_per_pixel = curr_mode.bpp / 8;
+    auto w = min(rect.w, curr_mode.width - min(rect.x, curr_mode.width));
+    auto h = min(rect.h, curr_mode.height - min(rect.y, curr_mode.height));
 
-    auto off = rect.y * curr_mode.pitch + rect.x;
-    front += off; back += off;
+    auto off = rect.y * curr_mode.pitch + rect.x * bytes_per_pixel;
+    auto* front = main_gpu->get_lfb() + off;
+    auto* back = backbuffer + off;
 
-    auto size = rect.h * curr_mode.pitch + rect.w;
-    memcpy(front, back, size);
+    for(size_t y = 0; y < h; y++)
+        memcpy(front + y * curr_mode.pitch, back + y * curr_mode.pitch, w * bytes_per_pixel);
 }
\ No newline at end of file
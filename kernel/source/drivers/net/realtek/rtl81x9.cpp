@@ -3,6 +3,7 @@
 #include <Luna/cpu/idt.hpp>
 
 #include <std/linked_list.hpp>
+#include <std/mutex.hpp>
 
 rtl81x9::Nic::Nic(pci::Device& device, uint16_t did): mm{&device}, regs{nullptr} {
     checksum_offload = net::cs_offload::ipv4 | net::cs_offload::udp;
@@ -100,12 +101,12 @@ rtl81x9::Nic::Nic(pci::Device& device, uint16_t did): mm{&device}, regs{nullptr}
 
     regs->cr = cr::tx_enable;
     regs->tcr = tcr::mxdma_unlimited | tcr::ifg_normal;
-    regs->rcr = rcr::mxdma_unlimited | rcr::rxftr_none;
+    regs->rcr = rcr::mxdma_unlimited | rcr::rxftr_none | rcr::accept_physical_match | rcr::accept_multicast | rcr::accept_broadcast;
 
     regs->etthr = 0x3B;
     regs->rms = 0x1FFF;
 
-    regs->imr = isr::rx_ok | isr::rx_err | isr::tx_ok | isr::tx_err | isr::link_change;
+    regs->imr = isr::rx_ok | isr::rx_err | isr::rx_unavailable | isr::tx_ok | isr::tx_err | isr::link_change;
     auto isr = regs->isr;
     regs->isr = isr; // Clear all interrupts
 
@@ -115,16 +116,41 @@ rtl81x9::Nic::Nic(pci::Device& device, uint16_t did): mm{&device}, regs{nullptr}
     regs->cr9346 = cr9346::lock_regs;
 
     tx_index = 0;
+    rx_index = 0;
 }
 
-bool rtl81x9::Nic::send_packet(const net::Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload) {
+// Returns the buffer of the next free TX descriptor, or nullptr if the ring is full
+uint8_t* rtl81x9::Nic::tx_begin() {
     if(tx[tx_index].flags & tx_flags::own) {
         regs->txpoll = txpoll::poll_normal_prio;
 
-        return false; // Try to send any descriptors left to make space
+        return nullptr; // Try to send any descriptors left to make space
     }
 
-    auto* buf = (uint8_t*)tx_set->descriptor[tx_index].buf;
+    return (uint8_t*)tx_set->descriptor[tx_index].buf;
+}
+
+void rtl81x9::Nic::tx_commit(size_t len, uint32_t offload) {
+    // TODO: These flags are only for 8168b
+    if(offload & net::cs_offload::ipv4)
+        tx[tx_index].vlan |= tx_flags::ip_cs;
+
+    if(offload & net::cs_offload::udp)
+        tx[tx_index].vlan |= tx_flags::udp_cs;
+
+    tx[tx_index].flags |= (tx_flags::own | tx_flags::fs | tx_flags::ls | (len & 0xFFFF));
+
+    tx_index = (tx_index + 1) % n_descriptor_sets;
+
+    regs->txpoll = txpoll::poll_normal_prio; // TODO: 8136 C+ mode uses different poll reg
+}
+
+bool rtl81x9::Nic::send_packet(const net::Mac& dst, uint16_t ethertype, const std::span<uint8_t>& packet, uint32_t offload) {
+    std::lock_guard guard{tx_lock};
+
+    auto* buf = tx_begin();
+    if(!buf)
+        return false;
 
     net::eth::Header header{};
     memcpy(header.dst_mac, dst.data, 6);
@@ -134,36 +160,72 @@ bool rtl81x9::Nic::send_packet(const net::Mac& dst, uint16_t ethertype, const st
     memcpy(buf, &header, sizeof(header));
     memcpy(buf + sizeof(header), packet.data(), packet.size_bytes());
 
+    tx_commit(sizeof(header) + packet.size_bytes(), offload);
+    return true;
+}
 
-    // TODO: These flags are only for 8168b
-    if(offload & net::cs_offload::ipv4)
-        tx[tx_index].vlan |= tx_flags::ip_cs;
+bool rtl81x9::Nic::send_frame(const std::span<uint8_t>& frame) {
+    if(frame.size_bytes() > mtu)
+        return false;
 
-    if(offload & net::cs_offload::udp)
-        tx[tx_index].vlan |= tx_flags::udp_cs;
+    std::lock_guard guard{tx_lock};
 
-    tx[tx_index].flags |= (tx_flags::own | tx_flags::fs | tx_flags::ls | ((sizeof(header) + packet.size_bytes()) & 0xFFFF));
+    auto* buf = tx_begin();
+    if(!buf)
+        return false;
 
-    tx_index = (tx_index + 1) % n_descriptor_sets;
+    memcpy(buf, frame.data(), frame.size_bytes());
 
-    regs->txpoll = txpoll::poll_normal_prio; // TODO: 8136 C+ mode uses different poll reg
+    tx_commit(frame.size_bytes(), 0);
     return true;
 }
 
+void rtl81x9::Nic::set_promiscuous(bool enable) {
+    regs->cr9346 = cr9346::unlock_regs;
+
+    if(enable)
+        regs->rcr |= rcr::accept_all_physical;
+    else
+        regs->rcr &= ~rcr::accept_all_physical;
+
+    regs->cr9346 = cr9346::lock_regs;
+}
+
 void rtl81x9::Nic::handle_irq() {
     auto sts = regs->isr;
 
     if(sts & isr::link_change) {
         // TODO: Handle Link Change events
-    } else if(sts & isr::tx_ok) {
+    }
+    
+    if(sts & isr::tx_ok)
         handle_tx_ok();
-    } else {
+
+    if(sts & (isr::rx_ok | isr::rx_unavailable))
+        handle_rx();
+
+    if(sts & ~(isr::link_change | isr::tx_ok | isr::rx_ok | isr::rx_unavailable))
         print("rtl81x9: Unhandled IRQ: {:#x}\n", sts);
-    }
 
     regs->isr = sts;
 }
 
+void rtl81x9::Nic::handle_rx() {
+    for(size_t i = 0; i < n_descriptor_sets; i++) {
+        auto flags = rx[rx_index].flags;
+        if(flags & rx_flags::own)
+            break; // Still owned by the NIC, no more received frames
+
+        // Frames that span more than one buffer are dropped
+        size_t len = flags & rx_flags::length_mask;
+        if((flags & rx_flags::fs) && (flags & rx_flags::ls) && len > 4 && len <= mtu && rx_handler)
+            rx_handler(rx_userptr, {(uint8_t*)rx_set->descriptor[rx_index].buf, len - 4}); // Strip the FCS
+
+        rx[rx_index].flags = rx_flags::own | mtu | ((rx_index == (n_descriptor_sets - 1)) ? rx_flags::eor : 0);
+        rx_index = (rx_index + 1) % n_descriptor_sets;
+    }
+}
+
 void rtl81x9::Nic::handle_tx_ok() {
     for(size_t i = 0; i < n_descriptor_sets; i++) {
         if(tx[i].flags & tx_flags::own) // Descriptor was not transmitted?
@@ -142,8 +142,24 @@ vfs::FileType echfs::File::get_type() {
     PANIC("Unknown Filetype");
 }
 
+// Returns how many of the count bytes at offset are contiguous on disk, and where they start
+// Consecutive blocks in the FAT chain are merged, so a file that isn't fragmented is read in a single request
+size_t echfs::File::extent(size_t offset, size_t count, uint64_t& loc) {
+    uint64_t block = offset / fs->bytes_per_block;
+    uint64_t disk_offset = offset % fs->bytes_per_block;
+    loc = (fat_chain[block] * fs->bytes_per_block) + disk_offset;
+
+    uint64_t size = fs->bytes_per_block - disk_offset;
+    while(size < count && fat_chain[block + 1] == (fat_chain[block] + 1)) {
+        block++;
+        size += fs->bytes_per_block;
+    }
+
+    return min(size, count);
+}
+
 size_t echfs::File::read(size_t offset, size_t count, uint8_t* data) {
-    if(entry.type != ObjectType::File)
+    if(entry.type != ObjectType::File || offset >= entry.file_size)
         return 0;
     
     if((offset + count) >= entry.file_size)
@@ -151,27 +167,66 @@ size_t echfs::File::read(size_t offset, size_t count, uint8_t* data) {
 
     uint64_t progress = 0;
     while(progress < count) {
-        uint64_t block = (offset + progress) / fs->bytes_per_block;
-        uint64_t loc = fat_chain[block] * fs->bytes_per_block;
+        uint64_t loc = 0;
+        auto chunk = extent(offset + progress, count - progress, loc);
+
+        fs->partition.read(loc, chunk, data + progress);
+        progress += chunk;
+    }
+
+    return count;
+}
+
+// Like read, but disk extents are split over the segments, so the data lands in them directly
+size_t echfs::File::read_sg(size_t offset, std::span<std::span<uint8_t>> segments) {
+    if(entry.type != ObjectType::File || offset >= entry.file_size)
+        return 0;
+
+    size_t count = 0;
+    for(auto& segment : segments)
+        count += segment.size();
+
+    if((offset + count) >= entry.file_size)
+        count = entry.file_size - offset;
 
-        uint64_t chunk = count - progress;
-        uint64_t disk_offset = (offset + progress) % fs->bytes_per_block;
-        if(chunk > (fs->bytes_per_block - disk_offset))
-            chunk = (fs->bytes_per_block - disk_offset);
+    uint64_t progress = 0;
+    size_t segment = 0, segment_offset = 0;
+    while(progress < count) {
+        uint64_t loc = 0;
+        auto chunk = extent(offset + progress, count - progress, loc);
+        chunk = min(chunk, segments[segment].size() - segment_offset);
 
-        fs->partition.read(loc + disk_offset, chunk, data + progress);
+        fs->partition.read(loc, chunk, segments[segment].data() + segment_offset);
         progress += chunk;
+        segment_offset += chunk;
+
+        if(segment_offset == segments[segment].size()) {
+            segment++;
+            segment_offset = 0;
+        }
     }
 
     return count;
 }
 
+// Writes in place, files can't grow yet since that needs allocating blocks in the FAT
 size_t echfs::File::write(size_t offset, size_t count, uint8_t* data) {
-    PANIC("TODO: Implement file writing");
-    (void)offset;
-    (void)count;
-    (void)data;
-    return 0;
+    if(entry.type != ObjectType::File || offset >= entry.file_size)
+        return 0;
+
+    if((offset + count) > entry.file_size)
+        count = entry.file_size - offset;
+
+    uint64_t progress = 0;
+    while(progress < count) {
+        uint64_t loc = 0;
+        auto chunk = extent(offset + progress, count - progress, loc);
+
+        fs->partition.write(loc, chunk, data + progress);
+        progress += chunk;
+    }
+
+    return count;
 }
 
 size_t echfs::File::get_size() {
@@ -3,6 +3,29 @@
 
 #include <Luna/fs/echfs.hpp>
 
+size_t fs::PartitionFile::clamp(size_t offset, size_t count) {
+    if(offset >= get_size())
+        return 0;
+
+    return min(count, get_size() - offset);
+}
+
+size_t fs::PartitionFile::read(size_t offset, size_t count, uint8_t* data) {
+    count = clamp(offset, count);
+    if(count == 0 || !part.device->read((part.device->driver.sector_size * part.start_lba) + offset, count, data))
+        return 0;
+
+    return count;
+}
+
+size_t fs::PartitionFile::write(size_t offset, size_t count, uint8_t* data) {
+    count = clamp(offset, count);
+    if(count == 0 || !part.device->write((part.device->driver.sector_size * part.start_lba) + offset, count, data))
+        return 0;
+
+    return count;
+}
+
 void fs::probe_fs(fs::Partition& part) {
     if(echfs::probe(part))
         return;
@@ -14,15 +14,27 @@ void mbr::parse_mbr(storage_dev::Device& dev) {
         return;
     }
 
-    for(const auto part : table.entries) {
-        if(part.type == 0)
-            continue; // Inactive
-
+    for(uint8_t i = 0; i < 4; i++) {
         fs::Partition partition{};
-        partition.device = &dev;
-        partition.n_sectors = part.n_sectors;
-        partition.start_lba = part.lba_start;
+        if(!get_partition(dev, i, partition))
+            continue; // Inactive
 
         fs::probe_fs(partition);
     }
+}
+
+bool mbr::get_partition(storage_dev::Device& dev, uint8_t i, fs::Partition& part) {
+    PartitionTable table{};
+    if(i >= 4 || !dev.read(0x1BE, sizeof(table), (uint8_t*)&table) || table.magic != magic)
+        return false;
+
+    const auto& entry = table.entries[i];
+    if(entry.type == 0)
+        return false;
+
+    part.device = &dev;
+    part.n_sectors = entry.n_sectors;
+    part.start_lba = entry.lba_start;
+    part.type = entry.type;
+    return true;
 }
\ No newline at end of file
@@ -137,4 +137,11 @@ void storage_dev::register_device(const DriverDevice& driver) {
         print("disk: TODO: Implement GPT\n");
     else
         mbr::parse_mbr(*device);
+}
+
+storage_dev::Device* storage_dev::get_device(size_t i) {
+    if(i >= devices.size())
+        return nullptr;
+
+    return devices[i];
 }
\ No newline at end of file
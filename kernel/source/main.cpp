@@ -26,6 +26,9 @@
 #include <Luna/drivers/hpet.hpp>
 
 #include <Luna/fs/vfs.hpp>
+#include <Luna/fs/fs.hpp>
+#include <Luna/fs/mbr.hpp>
+#include <Luna/fs/storage_dev.hpp>
 
 #include <Luna/vmm/vm.hpp>
 #include <Luna/vmm/drivers/e9.hpp>
@@ -33,12 +36,17 @@
 #include <Luna/vmm/drivers/nvme.hpp>
 #include <Luna/vmm/drivers/hpet.hpp>
 #include <Luna/vmm/drivers/cmos.hpp>
+#include <Luna/vmm/drivers/balloon.hpp>
 #include <Luna/vmm/drivers/ps2.hpp>
+#include <Luna/vmm/drivers/virtio/blk.hpp>
+#include <Luna/vmm/drivers/virtio/console.hpp>
+#include <Luna/vmm/drivers/virtio/net.hpp>
 #include <Luna/vmm/drivers/fast_a20.hpp>
 #include <Luna/vmm/drivers/pci/pci.hpp>
 #include <Luna/vmm/drivers/pci/pio_access.hpp>
 #include <Luna/vmm/drivers/pci/ecam.hpp>
 #include <Luna/vmm/drivers/pci/hotplug.hpp>
+#include <Luna/vmm/drivers/pci/passthrough.hpp>
 
 #include <Luna/vmm/drivers/q35/dram.hpp>
 #include <Luna/vmm/drivers/q35/lpc.hpp>
@@ -52,6 +60,7 @@
 #include <Luna/vmm/drivers/gpu/vga.hpp>
 
 #include <Luna/net/luna_debug.hpp>
+#include <Luna/net/if.hpp>
 
 #include <Luna/gui/gui.hpp>
 #include <Luna/gui/log_window.hpp>
@@ -210,6 +219,59 @@ stivale2_header header = {
     .tags = (uint64_t)&la57_tag
 };
 
+// Rewrites the folded stacks in the profile file every few seconds, so it's useful without the VM ever stopping
+constexpr uint64_t profile_dump_interval_ms = 10'000;
+static void dump_profile(vm::VCPU* vcpu, void* file) {
+    if(!vcpu->profiler.dump((vfs::File*)file))
+        print("profiler: Failed to write profile, it has to be preallocated to {} bytes\n", vm::profiler::default_ring_size * vm::profiler::max_line_size);
+
+    vcpu->start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * profile_dump_interval_ms, dump_profile, file);
+}
+
+// Host memory pressure policy, below the low watermark the guest is asked for the shortfall, above the high one pages are given back
+constexpr uint64_t balloon_interval_ms = 1000;
+constexpr size_t balloon_low_water = (64 * 1024 * 1024) / pmm::block_size, balloon_high_water = 2 * balloon_low_water;
+static void update_balloon(vm::VCPU* vcpu, void* userptr) {
+    if(vcpu->vm->ram_pinned)
+        return; // Pages can't be discarded anymore, so there's no point asking the guest for them
+
+    auto& balloon = *(vm::balloon::Driver*)userptr;
+    auto free = pmm::n_free_blocks();
+
+    auto target = balloon.get_target();
+    if(free < balloon_low_water)
+        target = balloon.get_actual() + (balloon_low_water - free);
+    else if(free > balloon_high_water)
+        target -= min(target, free - balloon_high_water);
+    balloon.set_target(target);
+
+    vcpu->start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * balloon_interval_ms, update_balloon, userptr);
+}
+
+// "bb:ss.f" in hex, as lspci prints it
+static bool parse_bdf(vfs::File* file, uint8_t& bus, uint8_t& slot, uint8_t& func) {
+    char str[7] = {};
+    if(file->read(0, sizeof(str), (uint8_t*)str) != sizeof(str) || str[2] != ':' || str[5] != '.')
+        return false;
+
+    auto hex = [](char c) -> int {
+        if(c >= '0' && c <= '9') return c - '0';
+        else if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    int digits[] = {hex(str[0]), hex(str[1]), hex(str[3]), hex(str[4]), hex(str[6])};
+    for(auto digit : digits)
+        if(digit < 0)
+            return false;
+
+    bus = (digits[0] << 4) | digits[1];
+    slot = (digits[2] << 4) | digits[3];
+    func = digits[4];
+    return slot < 32 && func < 8;
+}
+
 void create_vm() {
     constexpr uintptr_t himem_start = 0x10'0000;
     constexpr size_t himem_size = 32 * 1024 * 1024; // 16MiB
@@ -225,6 +287,7 @@ void create_vm() {
         
         auto isa_bios_size = min(bios_size, 128 * 1024);
         auto isa_bios_start = himem_start - isa_bios_size;
+        constexpr uintptr_t vga_hole_start = 0xA'0000, vga_hole_end = 0xC'0000;
         size_t isa_curr = 0;
 
 
@@ -244,8 +307,13 @@ void create_vm() {
             ASSERT(file->read(curr, 0x1000, va) == 0x1000);
         }
 
-        // Setup lowmem
+        // Setup lowmem, leaving a hole for the VGA window
+        vm.add_ram(0, vga_hole_start);
+        vm.add_ram(vga_hole_end, isa_bios_start - vga_hole_end);
         for(size_t i = 0; i < isa_bios_start; i += 0x1000) {
+            if(i >= vga_hole_start && i < vga_hole_end)
+                continue;
+
             auto block = pmm::alloc_block();
             ASSERT(block);
 
@@ -256,6 +324,7 @@ void create_vm() {
         }
 
         // Setup himem
+        vm.add_ram(himem_start, himem_size);
         for(size_t i = 0; i < himem_size; i += 0x1000) {
             auto block = pmm::alloc_block();
             ASSERT(block);
@@ -311,7 +380,7 @@ void create_vm() {
     auto* log_window = new gui::LogWindow{"VM Log"};
     gui::get_desktop().add_window(log_window);
 
-    auto* uart_dev = new vm::uart::Driver{&vm, 0x3F8, log_window};
+    auto* uart_dev = new vm::uart::Driver{&vm, 0x3F8, 4, log_window, new uart::Writer{uart::com1_base}};
     (void)uart_dev;
 
     auto* e9_dev = new vm::e9::Driver{&vm, log_window};
@@ -323,17 +392,64 @@ void create_vm() {
     auto* hpet_dev = new vm::hpet::Driver{&vm};
     (void)hpet_dev;
 
-    auto* file = vfs::get_vfs().open("A:/disk.bin");
+    // Without a disk image the first guest disk partition on any host disk is used raw
+    vfs::File* file = vfs::get_vfs().open("A:/disk.bin");
+    for(size_t i = 0; !file && storage_dev::get_device(i); i++) {
+        for(uint8_t j = 0; j < 4; j++) {
+            fs::Partition partition{};
+            if(mbr::get_partition(*storage_dev::get_device(i), j, partition) && partition.type == mbr::guest_disk_type) {
+                print("vm: Backing NVMe namespace with partition {} of disk {}\n", (uint16_t)j, i);
+                file = new fs::PartitionFile{partition};
+                break;
+            }
+        }
+    }
+    ASSERT(file);
+
     auto* nvme_dev = new vm::nvme::Driver{&vm, pci_host_bridge, 16, 0, file};
-    (void)nvme_dev;
+
+    vm.hypercall_services = {.console = log_window, .disk = nvme_dev->get_file()}; // Same disk, has to see the NVMe write cache
+
+    // Optional second disk for guests with virtio drivers
+    if(auto* virtio_disk = vfs::get_vfs().open("A:/virtio.bin"); virtio_disk) {
+        auto* virtio_blk_dev = new vm::virtio::blk::Driver{&vm, pci_host_bridge, 17, virtio_disk};
+        (void)virtio_blk_dev;
+    }
+
+    // Console without an exit per byte, guest logs written to the second port also end up in A:/console.log if it exists
+    auto* virtio_console_dev = new vm::virtio::console::Driver{&vm, pci_host_bridge, 19};
+    virtio_console_dev->add_port(nullptr, log_window);
+    virtio_console_dev->add_port("org.luna.log", log_window, vfs::get_vfs().open("A:/console.log"));
+
+    // Guest network, bridged to the first host NIC if there is one
+    auto* vswitch = new vm::vswitch::Switch{};
+    if(auto* interface = net::get_if(0); interface)
+        vswitch->attach_uplink(interface->nic);
+
+    auto* virtio_net_dev = new vm::virtio::net::Driver{&vm, pci_host_bridge, 18, vswitch, net::Mac{0x52, 0x54, 0x00, 0x12, 0x34, 0x56}};
+    (void)virtio_net_dev;
+
+    // PCI passthrough is opt-in, A:/passthrough.txt holds the bus:slot.func of a device without a host driver
+    if(auto* passthrough_file = vfs::get_vfs().open("A:/passthrough.txt"); passthrough_file) {
+        uint8_t bus = 0, slot = 0, func = 0;
+        auto* dev = parse_bdf(passthrough_file, bus, slot, func) ? pci::device_by_location(0, bus, slot, func) : nullptr;
+        if(dev && !dev->driver) {
+            auto* passthrough_dev = new vm::pci::passthrough::Driver{&vm, pci_host_bridge, 20, *dev};
+            (void)passthrough_dev;
+        } else {
+            print("vm: A:/passthrough.txt doesn't name a free PCI device\n");
+        }
+        passthrough_file->close();
+    }
+
+    auto* balloon_dev = new vm::balloon::Driver{&vm, pci_host_bridge, 3};
+    vm.cpus[0].start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * balloon_interval_ms, update_balloon, balloon_dev);
 
     auto* vgabios = vfs::get_vfs().open("A:/luna/vgabios.bin");
     ASSERT(vgabios);
-    auto* bga_dev = new vm::gpu::bga::Driver{&vm, pci_host_bridge, vgabios, 1};
-    (void)bga_dev;
-
     auto* vga_dev = new vm::gpu::vga::Driver{&vm};
-    (void)vga_dev;
+    auto* bga_dev = new vm::gpu::bga::Driver{&vm, pci_host_bridge, vgabios, vga_dev, 1};
+    (void)bga_dev;
 
     auto* pci_hotplug = new vm::pci::hotplug::Driver{&vm};
     (void)pci_hotplug;
@@ -359,5 +475,26 @@ void create_vm() {
     auto* pic_dev = new vm::irqs::pic::Driver{&vm};
     vm.irq_listeners.push_back(pic_dev);
     
-    ASSERT(vm.cpus[0].run());
+    // Guest profiling is opt-in through a preallocated A:/profile.txt
+    auto* profile_file = vfs::get_vfs().open("A:/profile.txt");
+    if(profile_file) {
+        vm.cpus[0].profiler.start(vm::profiler::default_period_us);
+        vm.cpus[0].start_timer(cpu::rdtsc() + cpu::tsc_ticks_per_ms() * profile_dump_interval_ms, dump_profile, profile_file);
+    }
+
+    // Record and replay are opt-in through preallocated files, a log to replay wins over recording a new one
+    auto* record_file = vfs::get_vfs().open("A:/record.bin");
+    if(auto* replay_file = vfs::get_vfs().open("A:/replay.bin"); replay_file && vm.replay_log.start_replay(replay_file))
+        record_file = nullptr;
+    else if(record_file)
+        vm.replay_log.start_record(record_file);
+
+    vm::sched::add(&vm.cpus[0]);
+    auto ok = vm.cpus[0].run();
+
+    if(record_file && vm.replay_log.get_mode() == vm::replay::Mode::Record)
+        vm.replay_log.save(record_file);
+    if(profile_file)
+        vm.cpus[0].profiler.dump(profile_file);
+    ASSERT(ok);
 }
\ No newline at end of file
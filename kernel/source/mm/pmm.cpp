@@ -6,6 +6,7 @@
 
 static std::span<uint8_t> bitmap;
 static size_t bitmap_size;
+static size_t n_free = 0;
 static TicketLock pmm_lock{};
 
 void pmm::init(stivale2::Parser& parser) {
@@ -81,6 +82,7 @@ uintptr_t pmm::alloc_block() {
             if((bitmap[i] & (1 << j)) == 0){
                 // Found free entry
                 bitmap[i] |= (1 << j); // Mark entry as reserved
+                n_free--;
                 return ((i * 8) + j) * block_size;
             }
         }
@@ -110,6 +112,7 @@ uintptr_t pmm::alloc_n_blocks(size_t n_pages) {
                     auto starting_bit = ((i * 8) + j) - n_pages;
                     for(size_t i = 0; i < n_pages; i++)
                         bit_set(starting_bit + i);
+                    n_free -= n_pages;
 
                     return starting_bit * block_size;
                 }
@@ -127,6 +130,8 @@ void pmm::free_block(uintptr_t block) {
 
     auto frame = (block / block_size);
 
+    if(bitmap[frame / 8] & (1 << (frame % 8)))
+        n_free++;
     bitmap[frame / 8] &= ~(1 << (frame % 8));
 }
 
@@ -135,5 +140,11 @@ void pmm::reserve_block(uintptr_t block) {
 
     auto frame = (block / block_size);
 
+    if(!(bitmap[frame / 8] & (1 << (frame % 8))))
+        n_free--;
     bitmap[frame / 8] |= (1 << (frame % 8));
+}
+
+size_t pmm::n_free_blocks() {
+    return __atomic_load_n(&n_free, __ATOMIC_RELAXED);
 }
\ No newline at end of file
@@ -13,6 +13,13 @@ void net::register_nic(Nic* nic) {
     print("net: Registered Interface with IP: {}\n", interface.ip);
 }
 
+net::Interface* net::get_if(size_t i) {
+    if(i >= interfaces.size())
+        return nullptr;
+
+    return &interfaces[i];
+}
+
 net::Interface* net::get_default_if() {
     ASSERT(interfaces.size() >= 1);
 
@@ -0,0 +1,202 @@
+#include <Luna/vmm/cpuid.hpp>
+#include <Luna/vmm/pvclock.hpp>
+
+#include <Luna/cpu/cpu.hpp>
+#include <Luna/cpu/regs.hpp>
+#include <Luna/misc/log.hpp>
+
+// Leaves whose contents depend on ECX
+static bool is_indexed(uint32_t leaf) {
+    switch (leaf) {
+        case 4: case 7: case 0xB: case 0xD: case 0x8000'001D:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static constexpr uint32_t bit(uint8_t i) { return 1u << i; }
+
+vm::cpuid::Policy vm::cpuid::default_policy() {
+    Policy policy{.max_basic_leaf = 0xD, .max_extended_leaf = 0x8000'0008, .hv_features = pvclock::supported_features() | features::Hypercalls, .xcr0 = get_cpu().simd_data.xcr0, .masks = {}};
+
+    // MONITOR, VMX, SMX, EIST, TM2, xTPR, PDCM, DCA, x2APIC, TSC-Deadline, OSXSAVE
+    policy.masks.push_back({.leaf = 1, .c = bit(3) | bit(5) | bit(6) | bit(7) | bit(8) | bit(14) | bit(15) | bit(18) | bit(21) | bit(24) | bit(27),
+                            .d = bit(21) | bit(22) | bit(29) | bit(31)}); // DS, ACPI, TM, PBE
+    policy.masks.push_back({.leaf = 6, .a = ~0u, .b = ~0u, .c = ~0u, .d = ~0u}); // Thermal and Power Management
+
+    // Only subleaf 0 of the Structured Extended Features is exposed
+    // SGX, INVPCID, Intel PT, WAITPKG
+    policy.masks.push_back({.leaf = 7, .subleaf = 0, .a = ~0u, .b = bit(2) | bit(10) | bit(25), .c = bit(5), .d = ~0u});
+    policy.masks.push_back({.leaf = 0xA, .a = ~0u, .b = ~0u, .c = ~0u, .d = ~0u}); // Architectural PMU
+    policy.masks.push_back({.leaf = 0xB, .a = ~0u, .b = ~0u, .c = ~0u, .d = ~0u}); // x2APIC Topology
+
+    policy.masks.push_back({.leaf = 0x8000'0001, .c = bit(2) | bit(11) | bit(16)}); // SVM, XOP, FMA4
+    policy.masks.push_back({.leaf = 0x8000'0007, .a = ~0u, .b = ~0u, .c = ~0u, .d = ~bit(8)}); // Advanced Power Management, except for Invariant TSC
+    policy.masks.push_back({.leaf = 0x8000'0008, .c = ~0u}); // Core info
+
+    return policy;
+}
+
+vm::cpuid::Leaf* vm::cpuid::Table::find(uint32_t leaf, uint32_t subleaf) {
+    if(!is_indexed(leaf))
+        subleaf = 0;
+
+    for(auto& entry : leaves)
+        if(entry.leaf == leaf && entry.subleaf == subleaf)
+            return &entry;
+
+    return nullptr;
+}
+
+void vm::cpuid::Table::add(uint32_t leaf, uint32_t subleaf, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    leaves.push_back({.leaf = leaf, .subleaf = subleaf, .a = a, .b = b, .c = c, .d = d});
+}
+
+void vm::cpuid::Table::filter_xsave() {
+    auto* features = find(1, 0);
+    if(!allowed_xcr0 && features)
+        features->c &= ~(bit(26) | bit(28) | bit(12) | bit(29)); // XSAVE, AVX, FMA, F16C
+
+    if(!(allowed_xcr0 & xcr0::AVX)) {
+        if(features)
+            features->c &= ~(bit(28) | bit(12) | bit(29)); // AVX, FMA, F16C
+
+        if(auto* ext = find(7, 0); ext) {
+            ext->b &= ~bit(5); // AVX2
+            ext->c &= ~(bit(9) | bit(10)); // VAES, VPCLMULQDQ
+        }
+    }
+
+    if((allowed_xcr0 & xcr0::AVX512) != xcr0::AVX512) {
+        if(auto* ext = find(7, 0); ext) {
+            ext->b &= ~(bit(16) | bit(17) | bit(21) | bit(26) | bit(27) | bit(28) | bit(30) | bit(31)); // AVX512F, DQ, IFMA, PF, ER, CD, BW, VL
+            ext->c &= ~(bit(1) | bit(6) | bit(11) | bit(12) | bit(14)); // AVX512VBMI, VBMI2, VNNI, BITALG, VPOPCNTDQ
+            ext->d &= ~(bit(2) | bit(3) | bit(8) | bit(23)); // AVX512_4VNNIW, 4FMAPS, VP2INTERSECT, FP16
+        }
+    }
+
+    // Leaf 0xD only describes the components the guest is allowed to enable
+    for(auto& entry : leaves) {
+        if(entry.leaf != 0xD)
+            continue;
+
+        if(entry.subleaf == 0) {
+            entry.a = allowed_xcr0 & 0xFFFF'FFFF;
+            entry.d = allowed_xcr0 >> 32;
+        } else if(entry.subleaf == 1) {
+            entry.a &= bit(0) | bit(1) | bit(2); // XSAVEOPT, XSAVEC, XGETBV with ECX=1, no XSAVES as IA32_XSS isn't virtualized
+            entry.c = 0;
+            entry.d = 0;
+        } else if(!((allowed_xcr0 >> entry.subleaf) & 1)) {
+            entry.a = entry.b = entry.c = entry.d = 0;
+        }
+    }
+
+    if(auto* entry = find(0xD, 0); entry)
+        entry->c = xsave_size(allowed_xcr0);
+}
+
+uint32_t vm::cpuid::Table::xsave_size(uint64_t xcr0) const {
+    uint32_t size = 512 + 64; // Legacy region and XSAVE header
+
+    for(const auto& entry : leaves)
+        if(entry.leaf == 0xD && entry.subleaf >= 2 && ((xcr0 >> entry.subleaf) & 1))
+            size = max(size, entry.b + entry.a); // EBX is the offset, EAX the size
+
+    return size;
+}
+
+void vm::cpuid::Table::init(const Policy& policy) {
+    leaves.clear();
+
+    auto add_range = [&](uint32_t base, uint32_t max) {
+        uint32_t a, b, c, d;
+        if(!cpu::cpuid(base, a, b, c, d))
+            return;
+
+        auto last = min(a, max);
+        for(uint32_t leaf = base; leaf <= last; leaf++) {
+            if(!is_indexed(leaf)) {
+                cpu::cpuid(leaf, 0, a, b, c, d);
+                add(leaf, 0, a, b, c, d);
+                continue;
+            }
+
+            for(uint32_t subleaf = 0; subleaf < 64; subleaf++) {
+                cpu::cpuid(leaf, subleaf, a, b, c, d);
+
+                if(leaf == 4 || leaf == 0x8000'001D) { // Cache Parameters, terminated by a null cache type
+                    if((a & 0x1F) == 0)
+                        break;
+                } else if(leaf == 7) { // EAX of subleaf 0 contains the max subleaf
+                    if(subleaf > 0 && subleaf > find(7, 0)->a)
+                        break;
+                } else if(leaf == 0xB) { // Topology, terminated by an invalid level type
+                    if(((c >> 8) & 0xFF) == 0)
+                        break;
+                } else if(leaf == 0xD) { // XSAVE components are sparse
+                    if(!a && !b && !c && !d)
+                        continue;
+                }
+
+                add(leaf, subleaf, a, b, c, d);
+            }
+        }
+    };
+
+    add_range(0, policy.max_basic_leaf);
+    add_range(0x8000'0000, policy.max_extended_leaf);
+
+    for(const auto& mask : policy.masks) {
+        for(auto& entry : leaves) {
+            if(entry.leaf != mask.leaf || (mask.subleaf != any_subleaf && entry.subleaf != mask.subleaf))
+                continue;
+
+            entry.a &= ~mask.a;
+            entry.b &= ~mask.b;
+            entry.c &= ~mask.c;
+            entry.d &= ~mask.d;
+        }
+
+        // Subleaves that aren't covered by the mask are hidden when only a single subleaf is selected
+        if(mask.subleaf != any_subleaf) {
+            for(auto& entry : leaves)
+                if(entry.leaf == mask.leaf && entry.subleaf != mask.subleaf)
+                    entry.a = entry.b = entry.c = entry.d = 0;
+        }
+    }
+
+    if(auto* entry = find(0, 0); entry)
+        entry->a = min(entry->a, policy.max_basic_leaf);
+
+    if(auto* entry = find(0x8000'0000, 0); entry)
+        entry->a = min(entry->a, policy.max_extended_leaf);
+
+    if(auto* entry = find(1, 0); entry)
+        entry->c |= bit(31); // Hypervisor Present
+
+    allowed_xcr0 = policy.xcr0 & get_cpu().simd_data.xcr0;
+    filter_xsave();
+
+    add(hv_base_leaf, 0, hv_features_leaf, luna_sig, luna_sig, luna_sig);
+    add(hv_features_leaf, 0, policy.hv_features, 0, 0, 0);
+}
+
+bool vm::cpuid::Table::get(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) const {
+    if(!is_indexed(leaf))
+        subleaf = 0;
+
+    for(const auto& entry : leaves) {
+        if(entry.leaf == leaf && entry.subleaf == subleaf) {
+            a = entry.a;
+            b = entry.b;
+            c = entry.c;
+            d = entry.d;
+            return true;
+        }
+    }
+
+    a = b = c = d = 0;
+    return false;
+}
@@ -23,6 +23,14 @@ uint64_t& get_r64(vm::RegisterState& regs, vm::emulate::r64 r) {
         case r64::Rbp: return regs.rbp;
         case r64::Rsi: return regs.rsi;
         case r64::Rdi: return regs.rdi;
+        case r64::R8: return regs.r8;
+        case r64::R9: return regs.r9;
+        case r64::R10: return regs.r10;
+        case r64::R11: return regs.r11;
+        case r64::R12: return regs.r12;
+        case r64::R13: return regs.r13;
+        case r64::R14: return regs.r14;
+        case r64::R15: return regs.r15;
         default: PANIC("Unknown reg");
     }
 }
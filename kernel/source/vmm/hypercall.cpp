@@ -0,0 +1,143 @@
+#include <Luna/vmm/hypercall.hpp>
+#include <Luna/vmm/pvclock.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+
+static int64_t console_write(vm::VCPU* vcpu, uintptr_t gpa, size_t len) {
+    auto* console = vcpu->vm->hypercall_services.console;
+    if(!console)
+        return vm::hypercall::errors::Unsupported;
+
+    if(len > vm::hypercall::max_console_write)
+        return vm::hypercall::errors::InvalidArgument;
+
+    uint8_t buf[64];
+    for(size_t curr = 0; curr < len; curr += sizeof(buf)) {
+        auto chunk = min(sizeof(buf), len - curr);
+        vcpu->dma_read(gpa + curr, {buf, chunk});
+
+        for(size_t i = 0; i < chunk; i++)
+            console->putc(buf[i]);
+    }
+    console->flush();
+
+    return len;
+}
+
+static int64_t block_io(vm::VCPU* vcpu, bool write, uint64_t lba, uint64_t count, uintptr_t gpa) {
+    using namespace vm::hypercall;
+
+    auto* disk = vcpu->vm->hypercall_services.disk;
+    if(!disk)
+        return errors::Unsupported;
+
+    auto n_blocks = disk->get_size() / block_size;
+    if(count == 0 || count > max_block_count || lba >= n_blocks || count > (n_blocks - lba))
+        return errors::InvalidArgument;
+
+    uint8_t buf[block_size];
+    for(size_t i = 0; i < count; i++) {
+        auto offset = (lba + i) * block_size;
+
+        if(write) {
+            vcpu->dma_read(gpa + i * block_size, {buf, block_size});
+            if(disk->write(offset, block_size, buf) != block_size)
+                return errors::IoError;
+        } else {
+            if(disk->read(offset, block_size, buf) != block_size)
+                return errors::IoError;
+            vcpu->dma_write(gpa + i * block_size, {buf, block_size});
+        }
+    }
+
+    return count;
+}
+
+static int64_t execute(vm::VCPU* vcpu, const vm::hypercall::Request& req) {
+    using namespace vm::hypercall;
+
+    switch (req.op) {
+        case ops::Nop: return errors::Success;
+        case ops::ConsoleWrite: return console_write(vcpu, req.args[0], req.args[1]);
+        case ops::GetTime: return vm::pvclock::system_time(vcpu->vm);
+        case ops::BlockRead: return block_io(vcpu, false, req.args[0], req.args[1], req.args[2]);
+        case ops::BlockWrite: return block_io(vcpu, true, req.args[0], req.args[1], req.args[2]);
+        default: return errors::InvalidCall;
+    }
+}
+
+static int64_t process_ring(vm::VCPU* vcpu) {
+    using namespace vm::hypercall;
+
+    const auto& ring = vcpu->hypercall_ring;
+    if(ring.n_entries == 0)
+        return errors::InvalidArgument;
+
+    auto sq = ring.gpa + sizeof(RingHeader);
+    auto cq = sq + ring.n_entries * sizeof(Request);
+
+    RingHeader header{};
+    vcpu->dma_read(ring.gpa, {(uint8_t*)&header, sizeof(header)});
+
+    // The guest owns the tails of the SQ and head of the CQ, don't trust them to be sane
+    if((header.sq_tail - header.sq_head) > ring.n_entries || (header.cq_tail - header.cq_head) > ring.n_entries)
+        return errors::InvalidArgument;
+
+    int64_t completed = 0;
+    while(header.sq_head != header.sq_tail && (header.cq_tail - header.cq_head) < ring.n_entries) {
+        Request req{};
+        vcpu->dma_read(sq + (header.sq_head % ring.n_entries) * sizeof(Request), {(uint8_t*)&req, sizeof(req)});
+
+        Completion completion{.user_data = req.user_data, .result = execute(vcpu, req)};
+        vcpu->dma_write(cq + (header.cq_tail % ring.n_entries) * sizeof(Completion), {(uint8_t*)&completion, sizeof(completion)});
+
+        header.sq_head++;
+        header.cq_tail++;
+        completed++;
+    }
+
+    // Only write back the indices we own
+    vcpu->dma_write(ring.gpa + offsetof(RingHeader, sq_head), {(uint8_t*)&header.sq_head, sizeof(uint32_t)});
+    vcpu->dma_write(ring.gpa + offsetof(RingHeader, cq_tail), {(uint8_t*)&header.cq_tail, sizeof(uint32_t)});
+
+    return completed;
+}
+
+bool vm::hypercall::handle(vm::VCPU* vcpu) {
+    vm::RegisterState regs{};
+    vcpu->get_regs(regs);
+
+    bool long_mode = (regs.efer & (1 << 10)) && regs.cs.attrib.l;
+    uint64_t mask = long_mode ? ~0ull : 0xFFFF'FFFF;
+
+    auto call = regs.rax & mask;
+    if(call < magic || call > (magic + 0xFFFF))
+        return false;
+
+    int64_t ret = errors::InvalidCall;
+    if(regs.cs.attrib.dpl != 0) {
+        ret = errors::PermissionDenied;
+    } else if(call == calls::Nop) {
+        ret = errors::Success;
+    } else if(call == calls::SetupRing) {
+        auto gpa = regs.rbx & mask;
+        auto n_entries = regs.rcx & mask;
+
+        if(n_entries == 0) {
+            vcpu->hypercall_ring = {};
+            ret = errors::Success;
+        } else if((gpa % 64) != 0 || n_entries > max_ring_entries || (n_entries & (n_entries - 1)) != 0) {
+            ret = errors::InvalidArgument;
+        } else {
+            vcpu->hypercall_ring = {.gpa = gpa, .n_entries = (uint32_t)n_entries};
+            ret = errors::Success;
+        }
+    } else if(call == calls::Notify) {
+        ret = process_ring(vcpu);
+    }
+
+    regs.rax = ret & mask;
+    vcpu->set_regs(regs, VmRegs::General);
+    return true;
+}
@@ -0,0 +1,125 @@
+#include <Luna/vmm/profiler.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <std/unordered_map.hpp>
+
+// Buffers a line at a time and appends it to a file, format_to flushes after every call
+struct FileWriter : public log::Logger {
+    FileWriter(vfs::File* file): file{file} {}
+
+    void putc(const char c) const {
+        if(i == sizeof(buf))
+            flush();
+
+        buf[i++] = c;
+    }
+
+    void flush() const {
+        auto size = file->get_size();
+        auto n = (offset < size) ? min(i, size - offset) : 0;
+        if(n != i || file->write(offset, n, (uint8_t*)buf) != n)
+            failed = true;
+
+        offset += i;
+        i = 0;
+    }
+
+    vfs::File* file;
+    mutable char buf[128];
+    mutable size_t i = 0, offset = 0;
+    mutable bool failed = false;
+};
+
+void vm::profiler::Profiler::start(uint64_t period_us, size_t ring_size) {
+    ASSERT(period_us > 0 && ring_size > 0);
+
+    std::lock_guard guard{lock};
+    ring.clear();
+    ring.resize(ring_size);
+    head = 0;
+    n_samples = 0;
+
+    period = max(div_ceil(cpu::tsc_ticks_per_ms() * period_us, 1000), 1);
+    deadline = cpu::rdtsc() + period;
+}
+
+void vm::profiler::Profiler::stop() {
+    std::lock_guard guard{lock};
+    deadline = 0;
+}
+
+bool vm::profiler::Profiler::sample(vm::VCPU* vcpu, uint64_t now) {
+    if(deadline == 0 || now < deadline)
+        return false;
+
+    vm::RegisterState regs{};
+    vcpu->get_regs(regs);
+
+    Sample sample{.rip = regs.rip, .cr3 = regs.cr3, .mode = Mode::Real, .cpl = (uint8_t)regs.ss.attrib.dpl};
+    if(regs.cr0 & (1 << 0))
+        sample.mode = ((regs.efer & (1 << 10)) && regs.cs.attrib.l) ? Mode::Long : Mode::Protected;
+
+    // Outside of long mode RIP is relative to CS, and CR3 is meaningless without paging
+    if(sample.mode != Mode::Long)
+        sample.rip += regs.cs.base;
+    if(!(regs.cr0 & (1u << 31)))
+        sample.cr3 = 0;
+
+    std::lock_guard guard{lock};
+    if(deadline == 0)
+        return false;
+
+    ring[head] = sample;
+    head = (head + 1) % ring.size();
+    n_samples++;
+
+    deadline = now + period; // Don't try to catch up on missed samples, that would just be a burst of exits at the same RIP
+    return true;
+}
+
+void vm::profiler::Profiler::dump(const log::Logger& out) {
+    std::lock_guard guard{lock};
+
+    struct Entry {
+        Sample sample;
+        size_t count;
+    };
+    std::vector<Entry> entries;
+    std::unordered_map<uint64_t, std::vector<size_t>> by_rip; // Index into entries
+
+    auto n = min(n_samples, ring.size());
+    for(size_t i = 0; i < n; i++) {
+        const auto& sample = ring[i];
+        auto& candidates = by_rip[sample.rip];
+
+        bool found = false;
+        for(auto index : candidates) {
+            auto& entry = entries[index];
+            if(entry.sample.cr3 == sample.cr3 && entry.sample.mode == sample.mode) {
+                entry.count++;
+                found = true;
+                break;
+            }
+        }
+
+        if(!found) {
+            candidates.push_back(entries.size());
+            entries.push_back({sample, 1});
+        }
+    }
+
+    for(const auto& entry : entries)
+        format::format_to(out, "{:#x};{:s};{:#x} {}\n", entry.sample.cr3, mode_to_string(entry.sample.mode), entry.sample.rip, entry.count);
+}
+
+bool vm::profiler::Profiler::dump(vfs::File* file) {
+    FileWriter writer{file};
+    dump(writer);
+
+    // Lines of an earlier dump might still be there, flamegraph.pl skips empty ones
+    while(!writer.failed && (writer.offset + writer.i) < file->get_size())
+        writer.putc('\n');
+    writer.flush();
+
+    return !writer.failed;
+}
@@ -0,0 +1,95 @@
+#include <Luna/vmm/pvclock.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/cpu/cpu.hpp>
+#include <Luna/misc/log.hpp>
+
+static bool host_invariant_tsc() {
+    uint32_t a, b, c, d;
+    if(!cpu::cpuid(0x8000'0007, a, b, c, d))
+        return false;
+
+    return (d >> 8) & 1;
+}
+
+// Find a shift and a 32bit fraction so that ns = ((ticks << shift) * mul) >> 32
+static void get_scale(uint64_t hz, int8_t& shift, uint32_t& mul) {
+    constexpr uint64_t ns_per_s = 1'000'000'000;
+
+    uint64_t num = ns_per_s, den = hz;
+    int8_t s = 0;
+
+    // Normalize num / den into [0.5, 1) to keep as much precision in mul as possible
+    while(num >= den) {
+        den <<= 1;
+        s++;
+    }
+
+    while((num * 2) < den) {
+        num <<= 1;
+        s--;
+    }
+
+    shift = s;
+    mul = ((unsigned __int128)num << 32) / den;
+}
+
+static uint64_t scale(uint64_t ticks, int8_t shift, uint32_t mul) {
+    if(shift >= 0)
+        ticks <<= shift;
+    else
+        ticks >>= -shift;
+
+    return ((unsigned __int128)ticks * mul) >> 32;
+}
+
+uint32_t vm::pvclock::supported_features() {
+    uint32_t ret = cpuid::features::PvClock;
+    if(host_invariant_tsc())
+        ret |= cpuid::features::StableTsc;
+
+    return ret;
+}
+
+uint64_t vm::pvclock::system_time(vm::Vm* vm) {
+    int8_t shift = 0;
+    uint32_t mul = 0;
+    get_scale(cpu::tsc_ticks_per_ms() * 1000, shift, mul);
+
+    return scale(cpu::rdtsc() - vm->boot_tsc, shift, mul);
+}
+
+void vm::pvclock::write_msr(vm::VCPU* vcpu, uint64_t value) {
+    vcpu->pvclock_msr = value;
+    update(vcpu);
+}
+
+void vm::pvclock::update(vm::VCPU* vcpu) {
+    if(!(vcpu->pvclock_msr & 1))
+        return;
+
+    auto gpa = vcpu->pvclock_msr & ~0x1Full; // Aligned so that it never crosses a page
+
+    TimeInfo info{};
+    vcpu->dma_read(gpa, {(uint8_t*)&info, sizeof(info)});
+
+    // Bump the version to odd first, so other VCPUs reading our struct retry instead of seeing a torn update
+    auto version = info.version;
+    info.version = (version | 1) + ((version & 1) ? 2 : 0);
+    vcpu->dma_write(gpa, {(uint8_t*)&info.version, sizeof(info.version)});
+
+    int8_t shift = 0;
+    uint32_t mul = 0;
+    get_scale(cpu::tsc_ticks_per_ms() * 1000, shift, mul);
+
+    auto now = cpu::rdtsc();
+    info.tsc_timestamp = now + vcpu->tsc_offset;
+    info.system_time = scale(now - vcpu->vm->boot_tsc, shift, mul);
+    info.tsc_to_system_mul = mul;
+    info.tsc_shift = shift;
+    info.flags = host_invariant_tsc() ? flags::TscStable : 0;
+    vcpu->dma_write(gpa, {(uint8_t*)&info, sizeof(info)});
+
+    info.version++;
+    vcpu->dma_write(gpa, {(uint8_t*)&info.version, sizeof(info.version)});
+}
@@ -0,0 +1,302 @@
+#include <Luna/vmm/replay.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/misc/log.hpp>
+#include <std/string.hpp>
+
+void vm::replay::Log::start_record(vfs::File* file) {
+    std::lock_guard guard{lock};
+
+    data.clear();
+    offset = 0;
+    n_exits = 0;
+    record_file = file;
+    mode = Mode::Record;
+
+    set_rdtsc_exiting(true);
+}
+
+bool vm::replay::Log::start_replay(vfs::File* file) {
+    std::lock_guard guard{lock};
+
+    FileHeader header{};
+    if(file->read(0, sizeof(header), (uint8_t*)&header) != sizeof(header))
+        return false;
+
+    if(header.magic != magic || header.version != version || header.size > (file->get_size() - sizeof(header))) {
+        print("replay: Invalid log, magic: {:#x}, version: {}\n", (uint32_t)header.magic, (uint32_t)header.version);
+        return false;
+    }
+
+    data.resize(header.size);
+    if(file->read(sizeof(header), header.size, data.data()) != header.size)
+        return false;
+
+    offset = 0;
+    n_exits = 0;
+    mode = Mode::Replay;
+
+    set_rdtsc_exiting(true);
+
+    print("replay: Replaying {} bytes of records\n", (uint64_t)header.size);
+    return true;
+}
+
+bool vm::replay::Log::save(vfs::File* file) {
+    std::lock_guard guard{lock};
+
+    return write(file);
+}
+
+void vm::replay::Log::stop() {
+    std::lock_guard guard{lock};
+
+    mode = Mode::Off;
+    set_rdtsc_exiting(false);
+}
+
+uint32_t vm::replay::Log::pio_read(uint16_t port, uint8_t size, uint32_t value) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::PioRead;
+        put(&type, 1); put(&port, 2); put(&size, 1); put(&value, 4);
+    } else if(mode == Mode::Replay) {
+        uint16_t logged_port = 0; uint8_t logged_size = 0; uint32_t logged_value = 0;
+        if(!expect(records::PioRead) || !get(&logged_port, 2) || !get(&logged_size, 1) || !get(&logged_value, 4))
+            return value;
+
+        if(logged_port != port || logged_size != size) {
+            diverged("PIO read");
+            return value;
+        }
+
+        return logged_value;
+    }
+
+    return value;
+}
+
+uint64_t vm::replay::Log::mmio_read(uintptr_t gpa, uint8_t size, uint64_t value) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::MmioRead;
+        put(&type, 1); put(&gpa, 8); put(&size, 1); put(&value, 8);
+    } else if(mode == Mode::Replay) {
+        uint64_t logged_gpa = 0, logged_value = 0; uint8_t logged_size = 0;
+        if(!expect(records::MmioRead) || !get(&logged_gpa, 8) || !get(&logged_size, 1) || !get(&logged_value, 8))
+            return value;
+
+        if(logged_gpa != gpa || logged_size != size) {
+            diverged("MMIO read");
+            return value;
+        }
+
+        return logged_value;
+    }
+
+    return value;
+}
+
+uint64_t vm::replay::Log::rdtsc(uint64_t value) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::Rdtsc;
+        put(&type, 1); put(&value, 8);
+    } else if(mode == Mode::Replay) {
+        uint64_t logged_value = 0;
+        if(!expect(records::Rdtsc) || !get(&logged_value, 8))
+            return value;
+
+        return logged_value;
+    }
+
+    return value;
+}
+
+std::span<uint8_t> vm::replay::Log::dma_write(uintptr_t gpa, std::span<uint8_t> buf) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::Dma;
+        uint32_t len = buf.size_bytes();
+        put(&type, 1); put(&gpa, 8); put(&len, 4); put(buf.data(), len);
+    } else if(mode == Mode::Replay) {
+        uint64_t logged_gpa = 0; uint32_t logged_len = 0;
+        if(!expect(records::Dma) || !get(&logged_gpa, 8) || !get(&logged_len, 4))
+            return buf;
+
+        if(logged_gpa != gpa || logged_len != buf.size_bytes() || logged_len > (data.size() - offset)) {
+            diverged("DMA write");
+            return buf;
+        }
+
+        std::span<uint8_t> payload{data.data() + offset, logged_len};
+        offset += logged_len;
+        return payload;
+    }
+
+    return buf;
+}
+
+bool vm::replay::Log::interrupt(uint8_t cpu, uint8_t vector) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::Interrupt;
+        put(&type, 1); put(&n_exits, 8); put(&cpu, 1); put(&vector, 1);
+    } else if(mode == Mode::Replay) {
+        return false; // Injected from the log by inject_pending
+    }
+
+    return true;
+}
+
+void vm::replay::Log::timer(uint8_t cpu, uint32_t source) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::Timer;
+        put(&type, 1); put(&n_exits, 8); put(&cpu, 1); put(&source, 4);
+    }
+}
+
+void vm::replay::Log::kick(uint8_t cpu, uint32_t handler) {
+    std::lock_guard guard{lock};
+
+    if(mode == Mode::Record) {
+        uint8_t type = records::Kick;
+        put(&type, 1); put(&n_exits, 8); put(&cpu, 1); put(&handler, 4);
+    }
+}
+
+void vm::replay::Log::on_exit() {
+    std::lock_guard guard{lock};
+
+    if(mode != Mode::Off)
+        n_exits++;
+
+    if(mode == Mode::Record && record_file && (sizeof(FileHeader) + data.size()) >= record_file->get_size()) {
+        print("replay: Log filled the file at exit {}, stopping recording\n", n_exits);
+        write(record_file);
+
+        mode = Mode::Off;
+        set_rdtsc_exiting(false);
+    }
+}
+
+void vm::replay::Log::inject_pending(VCPU* vcpu) {
+    while(true) {
+        uint8_t type = 0;
+        uint32_t source = 0;
+        {
+            std::lock_guard guard{lock};
+
+            inject_due();
+            if(!callback_due(vcpu->id, type, source))
+                return;
+        }
+
+        // Callbacks DMA and raise interrupts through the log themselves, so they run without the lock held
+        bool ran = (type == records::Timer) ? vcpu->run_timer(source) : vcpu->run_kick_handler(source);
+        if(!ran) {
+            std::lock_guard guard{lock};
+            diverged((type == records::Timer) ? "Timer" : "Kick");
+            return;
+        }
+    }
+}
+
+void vm::replay::Log::inject_due() {
+    while(mode == Mode::Replay && (data.size() - offset) > sizeof(uint64_t) && data[offset] == records::Interrupt) {
+        uint64_t exit = 0;
+        memcpy(&exit, data.data() + offset + 1, sizeof(exit));
+        if(exit > n_exits)
+            break;
+
+        uint8_t type = 0, cpu = 0, vector = 0;
+        if(!get(&type, 1) || !get(&exit, 8) || !get(&cpu, 1) || !get(&vector, 1))
+            break;
+
+        if(cpu >= vm->cpus.size()) {
+            diverged("Interrupt");
+            break;
+        }
+
+        vm->cpus[cpu].vcpu->inject_int(AbstractVm::InjectType::ExtInt, vector);
+    }
+}
+
+// Callbacks for other VCPUs stay at the head of the log until those VCPUs get to them
+bool vm::replay::Log::callback_due(uint8_t cpu, uint8_t& type, uint32_t& source) {
+    if(mode != Mode::Replay || (data.size() - offset) < (1 + sizeof(uint64_t) + 1) || (data[offset] != records::Timer && data[offset] != records::Kick))
+        return false;
+
+    uint64_t exit = 0;
+    memcpy(&exit, data.data() + offset + 1, sizeof(exit));
+    if(exit > n_exits || data[offset + 1 + sizeof(exit)] != cpu)
+        return false;
+
+    uint8_t logged_cpu = 0;
+    return get(&type, 1) && get(&exit, 8) && get(&logged_cpu, 1) && get(&source, 4);
+}
+
+bool vm::replay::Log::write(vfs::File* file) {
+    auto size = data.size();
+    if((sizeof(FileHeader) + size) > file->get_size()) {
+        size = (file->get_size() > sizeof(FileHeader)) ? (file->get_size() - sizeof(FileHeader)) : 0;
+        print("replay: Log is {} bytes, only saving {}\n", (uint64_t)data.size(), (uint64_t)size);
+    }
+
+    FileHeader header{.magic = magic, .version = version, .size = size};
+    if(file->write(0, sizeof(header), (uint8_t*)&header) != sizeof(header))
+        return false;
+
+    return file->write(sizeof(header), size, data.data()) == size;
+}
+
+void vm::replay::Log::set_rdtsc_exiting(bool exiting) {
+    for(auto& cpu : vm->cpus)
+        cpu.set(VmCap::RdtscExiting, exiting);
+}
+
+void vm::replay::Log::put(const void* src, size_t size) {
+    auto old = data.size();
+    data.resize(old + size);
+
+    memcpy(data.data() + old, src, size);
+}
+
+bool vm::replay::Log::get(void* dst, size_t size) {
+    if(size > (data.size() - offset)) {
+        print("replay: End of log at exit {}, continuing live\n", n_exits);
+        mode = Mode::Off;
+        return false;
+    }
+
+    memcpy(dst, data.data() + offset, size);
+    offset += size;
+    return true;
+}
+
+bool vm::replay::Log::expect(uint8_t type) {
+    inject_due(); // Interrupts that were raised while handling this exit are logged in front of its reads
+
+    uint8_t logged = 0;
+    if(!get(&logged, 1))
+        return false;
+
+    if(logged != type) {
+        diverged("Record type");
+        return false;
+    }
+
+    return true;
+}
+
+void vm::replay::Log::diverged(const char* what) {
+    print("replay: {:s} diverged from the log at exit {}, offset {:#x}, continuing live\n", what, n_exits, offset);
+    mode = Mode::Off;
+}
@@ -0,0 +1,145 @@
+#include <Luna/vmm/sched.hpp>
+#include <Luna/vmm/vm.hpp>
+
+#include <Luna/cpu/cpu.hpp>
+#include <Luna/cpu/smp.hpp>
+#include <Luna/cpu/threads.hpp>
+
+#include <std/mutex.hpp>
+#include <std/vector.hpp>
+
+// Credit scheduler for VCPU threads
+// Every accounting period the capacity of all physical CPUs is handed out as credits proportional to each VCPU's weight,
+// running burns credits, and VCPUs that are out of credits give way to VCPUs which still have some left
+// VCPUs with a cap are parked until the next period once they've used up their percentage of a physical CPU
+
+static TicketLock sched_lock{};
+static std::vector<vm::VCPU*> entities;
+static uint64_t period_start = 0;
+
+static uint64_t period_ticks() {
+    return cpu::tsc_ticks_per_ms() * vm::sched::accounting_period_ms;
+}
+
+static void refill(uint64_t now) {
+    if((now - period_start) < period_ticks())
+        return;
+
+    period_start = now;
+
+    uint64_t total_weight = 0;
+    for(auto* vcpu : entities)
+        total_weight += vcpu->sched_entity.weight;
+
+    if(total_weight == 0)
+        return;
+
+    auto capacity = period_ticks() * smp::get_cpu_count();
+    for(auto* vcpu : entities) {
+        auto& entity = vcpu->sched_entity;
+
+        int64_t share = (capacity * entity.weight) / total_weight;
+        entity.credits = min(entity.credits + share, share); // Don't let idle VCPUs hoard credits
+        entity.used = 0;
+    }
+}
+
+static bool should_wait(vm::VCPU* vcpu) {
+    auto& entity = vcpu->sched_entity;
+
+    if(entity.cap && entity.used >= (period_ticks() * entity.cap) / 100)
+        return true;
+
+    if(entity.credits > 0)
+        return false;
+
+    // Out of credits, only give way if there's someone that still has some left, so we don't leave CPUs idle
+    for(auto* other : entities)
+        if(other != vcpu && other->sched_entity.credits > 0)
+            return true;
+
+    return false;
+}
+
+void vm::sched::add(vm::VCPU* vcpu, uint16_t weight, uint8_t cap) {
+    ASSERT(weight > 0);
+    ASSERT(cap <= 100);
+
+    std::lock_guard guard{sched_lock};
+    auto& entity = vcpu->sched_entity;
+    ASSERT(!entity.registered);
+
+    entity.weight = weight;
+    entity.cap = cap;
+    entity.credits = 0;
+    entity.used = 0;
+    entity.registered = true;
+
+    entities.push_back(vcpu);
+    period_start = 0; // Force a refill so the new VCPU gets its share
+}
+
+void vm::sched::remove(vm::VCPU* vcpu) {
+    std::lock_guard guard{sched_lock};
+
+    auto it = entities.find(vcpu);
+    if(it == entities.end())
+        return;
+
+    entities.erase(it);
+    vcpu->sched_entity.registered = false;
+    vcpu->timeslice_deadline = 0;
+}
+
+void vm::sched::set_params(vm::VCPU* vcpu, uint16_t weight, uint8_t cap) {
+    ASSERT(weight > 0);
+    ASSERT(cap <= 100);
+
+    std::lock_guard guard{sched_lock};
+    vcpu->sched_entity.weight = weight;
+    vcpu->sched_entity.cap = cap;
+}
+
+void vm::sched::start_slice(vm::VCPU* vcpu) {
+    auto& entity = vcpu->sched_entity;
+    if(!entity.registered)
+        return;
+
+    auto now = cpu::rdtsc();
+    entity.slice_start = now;
+    vcpu->timeslice_deadline = now + cpu::tsc_ticks_per_ms() * timeslice_ms;
+}
+
+void vm::sched::end_slice(vm::VCPU* vcpu) {
+    auto& entity = vcpu->sched_entity;
+    if(!entity.registered)
+        return;
+
+    vcpu->timeslice_deadline = 0;
+
+    {
+        std::lock_guard guard{sched_lock};
+
+        auto now = cpu::rdtsc();
+        auto ran = now - entity.slice_start;
+        entity.credits -= ran;
+        entity.used += ran;
+
+        refill(now);
+    }
+
+    // Always give other threads on this CPU a chance to run at the end of a timeslice
+    yield();
+
+    while(true) {
+        {
+            std::lock_guard guard{sched_lock};
+            refill(cpu::rdtsc());
+
+            if(!should_wait(vcpu))
+                break;
+        }
+
+        yield();
+    }
+}
@@ -6,6 +6,7 @@
 #include <Luna/cpu/amd/svm.hpp>
 
 #include <Luna/vmm/emulate.hpp>
+#include <Luna/vmm/pvclock.hpp>
 
 void vm::init() {
     if(vmx::is_supported()) {
@@ -20,7 +21,7 @@ void vm::init() {
         PANIC("Unknown virtualization vendor");
 }
 
-vm::VCPU::VCPU(vm::Vm* vm, uint8_t id): vm{vm}, lapic{id} {
+vm::VCPU::VCPU(vm::Vm* vm, uint8_t id): id{id}, vm{vm}, lapic{id} {
     switch (get_cpu().cpu.vm.vendor) {
         case CpuVendor::Intel:
             vcpu = new vmx::Vm{vm->mm, this};
@@ -78,6 +79,7 @@ vm::VCPU::VCPU(vm::Vm* vm, uint8_t id): vm{vm}, lapic{id} {
     lapic.update_apicbase(apicbase);
 
     smbase = 0x3'0000;
+    tsc_offset = -cpu::rdtsc(); // Guest TSC starts at 0 on reset
 }
 
 void vm::VCPU::exit() {
@@ -102,6 +104,8 @@ void vm::VCPU::set(VmCap cap, void (*fn)(VCPU*, void*), void* userptr) {
 }
 
 bool vm::VCPU::run() {
+    sched::start_slice(this);
+
     while(true) {
         if(should_exit)
             return true;
@@ -109,11 +113,19 @@ bool vm::VCPU::run() {
         vm::RegisterState regs{};
         vm::VmExit exit{};
 
+        vm->replay_log.inject_pending(this);
         if(!vcpu->run(exit))
             return false;
 
+        // Preemption depends on host timing, the guest can't observe it, MMU exits are only counted once they turn out to be guest visible
+        if(exit.reason != VmExit::Reason::Preempt && exit.reason != VmExit::Reason::MMUViolation)
+            vm->replay_log.on_exit();
+
         switch (exit.reason) {
         case VmExit::Reason::Vmcall:
+            if(hypercall::handle(this))
+                break;
+
             if(hypercall_callback)
                 hypercall_callback(this, hypercall_userptr);
             else // If no handler, exit
@@ -126,13 +138,36 @@ bool vm::VCPU::run() {
             auto grip = regs.cs.base + regs.rip;
 
             auto emulate_mmio = [&](AbstractMMIODriver* driver, uintptr_t gpa, uintptr_t base, size_t size) {
-                uint8_t instruction[max_x86_instruction_size];
-                mem_read(grip, {instruction, 15});
+                uint8_t instruction[max_x86_instruction_size] = {};
+                if(exit.instruction_len == max_x86_instruction_size) // The backend already fetched the full instruction for us
+                    memcpy(instruction, exit.instruction, max_x86_instruction_size);
+                else
+                    mem_read(grip, {instruction, 15});
+
+                // Route reads through the replay log, writes are a result of guest execution and don't need logging
+                struct : AbstractMMIODriver {
+                    void mmio_write(uintptr_t addr, uint64_t value, uint8_t size) { driver->mmio_write(addr, value, size); }
+                    uint64_t mmio_read(uintptr_t addr, uint8_t size) { return log->mmio_read(addr, size, driver->mmio_read(addr, size)); }
 
-                vm::emulate::emulate_instruction(this, gpa, {base, size}, instruction, regs, driver);
+                    AbstractMMIODriver* driver;
+                    replay::Log* log;
+                } logged{};
+                logged.driver = driver;
+                logged.log = &vm->replay_log;
+
+                vm::emulate::emulate_instruction(this, gpa, {base, size}, instruction, regs, (vm->replay_log.get_mode() == replay::Mode::Off) ? driver : &logged);
                 set_regs(regs);
             };
 
+            if(vm->populate_page(exit.mmu.gpa)) // Access to a page that was given back to the host, retry with a fresh one
+                break;
+
+            if(exit.mmu.access.w && vm->handle_dirty_write(exit.mmu.gpa)) // First write to a logged page, retry now that it's writable
+                break;
+
+            // Which writes fault above depends on when host timers re-protect dirty logged pages, so only the exits past here count
+            vm->replay_log.on_exit();
+
             if((exit.mmu.gpa & ~0xFFF) == (apicbase & ~0xFFF)) {
                 emulate_mmio(&lapic, exit.mmu.gpa, apicbase & ~0xFFF, 0x1000);
                 goto did_mmio;
@@ -201,7 +236,7 @@ bool vm::VCPU::run() {
 
                 driver->pio_write(exit.pio.port, value, exit.pio.size);
             } else {
-                auto value = driver->pio_read(exit.pio.port, exit.pio.size);
+                auto value = vm->replay_log.pio_read(exit.pio.port, exit.pio.size, driver->pio_read(exit.pio.port, exit.pio.size));
 
                 switch(exit.pio.size) {
                     case 1: regs.rax &= ~0xFF; break;
@@ -227,59 +262,31 @@ bool vm::VCPU::run() {
             auto leaf = regs.rax & 0xFFFF'FFFF;
             auto subleaf = regs.rcx & 0xFFFF'FFFF;
 
-            constexpr uint32_t luna_sig = 0x616E754C; // Luna in ASCII
-            
-            auto passthrough = [&]() {
-                uint32_t a, b, c, d;
-                ASSERT(cpu::cpuid(leaf, subleaf, a, b, c, d));
-
-                write_low32(regs.rax, a);
-                write_low32(regs.rbx, b);
-                write_low32(regs.rcx, c);
-                write_low32(regs.rdx, d);
-            };
+            uint32_t a, b, c, d;
+            vm->cpuid_table.get(leaf, subleaf, a, b, c, d);
 
-            auto os_support_bit = [&](uint64_t& reg, uint8_t cr4_bit, uint8_t bit) {
+            auto os_support_bit = [&](uint32_t& reg, uint8_t cr4_bit, uint8_t bit) {
                 reg &= ~(1 << bit);
 
                 bool os = (regs.cr4 >> cr4_bit) & 1;
                 reg |= (os << bit);
             };
 
-            if(leaf == 0) {
-                passthrough();
-            } else if(leaf == 1) {
-                passthrough();
-
-                regs.rcx |= (1u << 31); // Set Hypervisor Present bit
-
-                os_support_bit(regs.rdx, 9, 24);
-                os_support_bit(regs.rcx, 18, 27); // Only set OSXSAVE bit if actually enabled by OS
-            } else if(leaf == 7) {
-                if(subleaf == 0) {
-                    passthrough();
-
-                    os_support_bit(regs.rcx, 22, 4);
-                } else {
-                    print("vcpu: Unhandled CPUID 0x7 subleaf {:#x}\n", subleaf);
-                }
-            } else if(leaf == 0x4000'0000) {
-                write_low32(regs.rax, 0);
-                write_low32(regs.rbx, luna_sig);
-                write_low32(regs.rcx, luna_sig);
-                write_low32(regs.rdx, luna_sig);
-            } else if(leaf == 0x8000'0000) {
-                passthrough();
-            } else if(leaf == 0x8000'0001) {
-                passthrough();
-                os_support_bit(regs.rdx, 9, 24);
-            } else if(leaf == 0x8000'0008) {
-                passthrough(); // TODO: Do we want this to be passthrough?
-                write_low32(regs.rcx, 0); // Clear out core info
-            } else {
-                print("vcpu: Unhandled CPUID: {:#x}:{}\n", leaf, subleaf);
+            // The table is static, only patch in the bits that depend on VCPU state
+            if(leaf == 1) {
+                b = (b & 0x00FF'FFFF) | (id << 24); // Initial APIC ID
+                os_support_bit(c, 18, 27); // Only set OSXSAVE bit if actually enabled by OS
+            } else if(leaf == 7 && subleaf == 0) {
+                os_support_bit(c, 22, 4); // OSPKE
+            } else if(leaf == 0xD && (subleaf == 0 || subleaf == 1)) {
+                b = vm->cpuid_table.xsave_size(xcr0); // Size required by the currently enabled components
             }
 
+            write_low32(regs.rax, a);
+            write_low32(regs.rbx, b);
+            write_low32(regs.rcx, c);
+            write_low32(regs.rdx, d);
+
             set_regs(regs);
             break;
         }
@@ -292,10 +299,17 @@ bool vm::VCPU::run() {
             auto write_low32 = [&](uint64_t& reg, uint32_t val) { reg &= ~0xFFFF'FFFF; reg |= val; };
 
             if(index == msr::ia32_tsc) {
+                if(exit.msr.write) {
+                    tsc_offset = value - cpu::rdtsc();
+                    pvclock::update(this);
+                } else {
+                    value = vm->replay_log.rdtsc(cpu::rdtsc() + tsc_offset);
+                }
+            } else if(index == pvclock::msr_system_time) {
                 if(exit.msr.write)
-                    tsc = value;
+                    pvclock::write_msr(this, value);
                 else
-                    value = tsc;
+                    value = pvclock_msr;
             } else if(index == msr::ia32_mtrr_cap) {
                 if(exit.msr.write)
                     vcpu->inject_int(AbstractVm::InjectType::Exception, 13, true, 0); // Inject #GP(0)
@@ -333,6 +347,21 @@ bool vm::VCPU::run() {
             break;
         }
 
+        case VmExit::Reason::Rdtsc: {
+            get_regs(regs);
+
+            auto write_low32 = [&](uint64_t& reg, uint32_t val) { reg &= ~0xFFFF'FFFF; reg |= val; };
+
+            auto value = vm->replay_log.rdtsc(cpu::rdtsc() + tsc_offset);
+            write_low32(regs.rax, value & 0xFFFF'FFFF);
+            write_low32(regs.rdx, value >> 32);
+            if(exit.rdtsc.rdtscp)
+                write_low32(regs.rcx, 0); // IA32_TSC_AUX
+
+            set_regs(regs);
+            break;
+        }
+
         case VmExit::Reason::RSM: {
             if(is_in_smm)
                 handle_rsm();
@@ -346,9 +375,56 @@ bool vm::VCPU::run() {
             return false;
         }
 
+        case VmExit::Reason::Preempt: {
+            auto now = cpu::rdtsc();
+            profiler.sample(this, now);
+
+            // When replaying, callbacks run from inject_pending at the exits they were logged at instead
+            bool live = !vm->replay_log.drives_callbacks();
+
+            // Callbacks can start and stop timers, so take a due one out before running it, and rescan
+            for(size_t i = 0; live && i < timers.size();) {
+                if(now < timers[i].deadline) {
+                    i++;
+                    continue;
+                }
+
+                auto timer = timers[i];
+                timers.erase(timers.begin() + i);
+                vm->replay_log.timer(id, timer.source);
+                timer.fn(this, timer.userptr);
+                i = 0;
+            }
+
+            if(__atomic_exchange_n(&kicked, false, __ATOMIC_ACQ_REL) && live) {
+                for(size_t i = 0; i < kick_handlers.size(); i++) {
+                    vm->replay_log.kick(id, i);
+                    kick_handlers[i].first(this, kick_handlers[i].second);
+                }
+            }
+
+            if(timeslice_deadline && now >= timeslice_deadline) {
+                sched::end_slice(this);
+                sched::start_slice(this);
+            }
+            break;
+        }
+
         case VmExit::Reason::CrMov: {
             get_regs(regs);
 
+            if(exit.cr.clts) {
+                regs.cr0 &= ~(1 << 3); // Clear cr0.TS
+
+                set_regs(regs);
+                break;
+            } else if(exit.cr.lmsw) {
+                regs.cr0 = (regs.cr0 & ~0xEull) | (exit.cr.lmsw_source & 0xF); // LMSW only loads cr0[3:0], and can't clear cr0.PE
+
+                set_regs(regs);
+                break;
+            }
+
             uint64_t value = 0;
 
             if(exit.cr.write)
@@ -375,7 +451,30 @@ bool vm::VCPU::run() {
             set_regs(regs);
             break;
         }
-        
+
+        case VmExit::Reason::Xsetbv: {
+            get_regs(regs);
+            auto index = regs.rcx & 0xFFFF'FFFF;
+            auto value = (regs.rax & 0xFFFF'FFFF) | (regs.rdx << 32);
+
+            // Bit 0 is always required, AVX depends on SSE, and AVX-512 state can only be enabled as a whole on top of AVX
+            bool valid = (index == 0) && regs.cs.attrib.dpl == 0;
+            valid = valid && (value & xcr0::X87) && !(value & ~vm->cpuid_table.get_xcr0_mask());
+            valid = valid && (!(value & xcr0::AVX) || (value & xcr0::SSE));
+            valid = valid && (!(value & xcr0::AVX512) || ((value & xcr0::AVX512) == xcr0::AVX512 && (value & xcr0::AVX)));
+
+            if(!valid) {
+                regs.rip -= exit.instruction_len; // #GP is a fault, so point at the XSETBV
+                set_regs(regs);
+
+                vcpu->inject_int(AbstractVm::InjectType::Exception, 13, true, 0);
+                break;
+            }
+
+            xcr0 = value;
+            break;
+        }
+
         default:
             print("vcpu: Exit due to {:s}\n", exit.reason_to_string(exit.reason));
             if(exit.instruction_len != 0) {
@@ -573,7 +672,7 @@ void vm::VCPU::enter_smm() {
         PUT_SEGMENT(9, tr);
     }
 
-    auto* dst = (uint8_t*)(vm->mm->get_phys(smbase + 0xFE00) + phys_mem_map);
+    auto* dst = (uint8_t*)(vm->get_phys(smbase + 0xFE00) + phys_mem_map);
     memcpy(dst, save, 512);
 
     regs.rflags = (1 << 1);
@@ -603,7 +702,7 @@ void vm::VCPU::handle_rsm() {
     ASSERT(is_in_smm);
 
     uint8_t buf[512] = {};
-    auto* src = (uint8_t*)(vm->mm->get_phys(smbase + 0xFE00) + phys_mem_map);
+    auto* src = (uint8_t*)(vm->get_phys(smbase + 0xFE00) + phys_mem_map);
     memcpy(buf, src, 512);
 
     RegisterState rregs{};
@@ -725,11 +824,10 @@ void vm::VCPU::handle_rsm() {
 void vm::VCPU::dma_read(uintptr_t gpa, std::span<uint8_t> buf) {
     uintptr_t curr = 0;
     while(curr != buf.size_bytes()) {
-        auto va = vm->mm->get_phys(gpa + curr) + phys_mem_map;
-        auto top = align_up(va, pmm::block_size);
+        auto va = vm->get_phys(gpa + curr) + phys_mem_map;
+        auto top = align_down(va, pmm::block_size) + pmm::block_size;
 
-
-        auto chunk = min(top - va + 1, buf.size_bytes() - curr);
+        auto chunk = min(top - va, buf.size_bytes() - curr);
 
         memcpy(buf.data() + curr, (uint8_t*)va, chunk);
 
@@ -738,12 +836,14 @@ void vm::VCPU::dma_read(uintptr_t gpa, std::span<uint8_t> buf) {
 }
 
 void vm::VCPU::dma_write(uintptr_t gpa, std::span<uint8_t> buf) {
+    buf = vm->replay_log.dma_write(gpa, buf);
+
     uintptr_t curr = 0;
     while(curr != buf.size_bytes()) {
-        auto va = vm->mm->get_phys(gpa + curr) + phys_mem_map;
-        auto top = align_up(va, pmm::block_size);
+        auto va = vm->get_phys(gpa + curr) + phys_mem_map;
+        auto top = align_down(va, pmm::block_size) + pmm::block_size;
 
-        auto chunk = min(top - va + 1, buf.size_bytes() - curr);
+        auto chunk = min(top - va, buf.size_bytes() - curr);
 
         memcpy((uint8_t*)va, buf.data() + curr, chunk);
 
@@ -751,6 +851,102 @@ void vm::VCPU::dma_write(uintptr_t gpa, std::span<uint8_t> buf) {
     }
 }
 
+void vm::VCPU::dma_map(uintptr_t gpa, size_t size, std::vector<std::span<uint8_t>>& segments) {
+    uintptr_t curr = 0;
+    while(curr != size) {
+        auto va = vm->get_phys(gpa + curr) + phys_mem_map;
+        auto top = align_down(va, pmm::block_size) + pmm::block_size;
+
+        auto chunk = min(top - va, size - curr);
+
+        // Guest pages that are contiguous in host memory are merged
+        if(segments.size() && (segments[segments.size() - 1].data() + segments[segments.size() - 1].size()) == (uint8_t*)va)
+            segments[segments.size() - 1] = {segments[segments.size() - 1].data(), segments[segments.size() - 1].size() + chunk};
+        else
+            segments.push_back({(uint8_t*)va, chunk});
+
+        curr += chunk;
+    }
+}
+
+uint64_t vm::VCPU::next_deadline() const {
+    uint64_t deadline = 0;
+    auto earliest = [&](uint64_t v) {
+        if(v && (!deadline || v < deadline))
+            deadline = v;
+    };
+
+    if(__atomic_load_n(&kicked, __ATOMIC_ACQUIRE))
+        return 1; // Already due
+
+    earliest(timeslice_deadline);
+    earliest(profiler.get_deadline());
+    if(!vm->replay_log.drives_callbacks())
+        for(const auto& timer : timers)
+            earliest(timer.deadline);
+
+    return deadline;
+}
+
+void vm::VCPU::start_timer(uint64_t deadline, void (*fn)(VCPU*, void*), void* userptr) {
+    ASSERT(deadline);
+
+    for(auto& timer : timers) {
+        if(timer.fn == fn && timer.userptr == userptr) {
+            timer.deadline = deadline;
+            return;
+        }
+    }
+
+    uint32_t source = 0;
+    while(source < timer_sources.size() && (timer_sources[source].first != fn || timer_sources[source].second != userptr))
+        source++;
+
+    if(source == timer_sources.size())
+        timer_sources.push_back({fn, userptr});
+
+    timers.push_back({.deadline = deadline, .fn = fn, .userptr = userptr, .source = source});
+}
+
+void vm::VCPU::stop_timer(void (*fn)(VCPU*, void*), void* userptr) {
+    for(auto it = timers.begin(); it != timers.end(); ++it) {
+        if(it->fn == fn && it->userptr == userptr) {
+            timers.erase(it);
+            return;
+        }
+    }
+}
+
+bool vm::VCPU::run_timer(uint32_t source) {
+    for(auto it = timers.begin(); it != timers.end(); ++it) {
+        if(it->source == source) {
+            auto timer = *it;
+            timers.erase(it);
+            timer.fn(this, timer.userptr);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool vm::VCPU::run_kick_handler(uint32_t handler) {
+    if(handler >= kick_handlers.size())
+        return false;
+
+    kick_handlers[handler].first(this, kick_handlers[handler].second);
+    return true;
+}
+
+void vm::VCPU::add_kick_handler(void (*fn)(VCPU*, void*), void* userptr) {
+    kick_handlers.push_back({fn, userptr});
+}
+
+void vm::VCPU::inject_irq(uint8_t vector) {
+    if(vm->replay_log.interrupt(id, vector))
+        vcpu->inject_int(AbstractVm::InjectType::ExtInt, vector);
+}
+
 vm::PageWalkInfo vm::VCPU::walk_guest_paging(uintptr_t gva) {
     vm::RegisterState regs{};
     get_regs(regs, VmRegs::Control); // We only really care about cr0, cr3, cr4, and efer here
@@ -773,7 +969,7 @@ vm::PageWalkInfo vm::VCPU::walk_guest_paging(uintptr_t gva) {
         auto pml1_i = (gva >> 12) & 0x3FF;
 
         uint32_t pml2_addr = regs.cr3 & 0xFFFF'F000;
-        auto* pml2 = (uint32_t*)(vm->mm->get_phys(pml2_addr) + phys_mem_map); // Page tables are always in 1 page so this is fine
+        auto* pml2 = (uint32_t*)(vm->get_phys(pml2_addr) + phys_mem_map); // Page tables are always in 1 page so this is fine
         uint32_t pml2_entry = pml2[pml2_i];
 
         ASSERT(pml2_entry & (1 << 0)); // Assert its present
@@ -781,7 +977,7 @@ vm::PageWalkInfo vm::VCPU::walk_guest_paging(uintptr_t gva) {
         user = user && (pml2_entry >> 2) & 1;
 
         uint32_t pml1_addr = pml2_entry & 0xFFFF'F000;
-        auto* pml1 = (uint32_t*)(vm->mm->get_phys(pml1_addr) + phys_mem_map); // Page tables are always in 1 page so this is fine
+        auto* pml1 = (uint32_t*)(vm->get_phys(pml1_addr) + phys_mem_map); // Page tables are always in 1 page so this is fine
         uint32_t pml1_entry = pml1[pml1_i];
         
         ASSERT(pml1_entry & (1 << 0)); // Assert its present
@@ -801,11 +997,11 @@ void vm::VCPU::mem_read(uintptr_t gva, std::span<uint8_t> buf) {
     uintptr_t curr = 0;
     while(curr != buf.size_bytes()) {
         auto gpa = walk_guest_paging(gva + curr).gpa;
-        auto hpa = vm->mm->get_phys(gpa);
+        auto hpa = vm->get_phys(gpa);
         auto hva = hpa + phys_mem_map;
-        auto top = align_up(hva, pmm::block_size);
+        auto top = align_down(hva, pmm::block_size) + pmm::block_size;
 
-        auto chunk = min(top - hva + 1, buf.size_bytes() - curr);
+        auto chunk = min(top - hva, buf.size_bytes() - curr);
 
         memcpy(buf.data() + curr, (uint8_t*)hva, chunk);
 
@@ -818,11 +1014,11 @@ void vm::VCPU::mem_write(uintptr_t gva, std::span<uint8_t> buf) {
     while(curr != buf.size_bytes()) {
         auto res = walk_guest_paging(gva + curr);
         ASSERT(res.is_write);
-        auto hpa = vm->mm->get_phys(res.gpa);
+        auto hpa = vm->get_phys(res.gpa);
         auto hva = hpa + phys_mem_map;
-        auto top = align_up(hva, pmm::block_size);
+        auto top = align_down(hva, pmm::block_size) + pmm::block_size;
 
-        auto chunk = min(top - hva + 1, buf.size_bytes() - curr);
+        auto chunk = min(top - hva, buf.size_bytes() - curr);
 
         memcpy((uint8_t*)hva, buf.data() + curr, chunk);
 
@@ -830,7 +1026,10 @@ void vm::VCPU::mem_write(uintptr_t gva, std::span<uint8_t> buf) {
     }
 }
 
-vm::Vm::Vm(uint8_t n_cpus) {
+vm::Vm::Vm(uint8_t n_cpus, const cpuid::Policy& policy): replay_log{this} {
+    cpuid_table.init(policy);
+    boot_tsc = cpu::rdtsc();
+
     switch (get_cpu().cpu.vm.vendor) {
         case CpuVendor::Intel:
             mm = vmx::create_ept();
@@ -851,4 +1050,140 @@ vm::Vm::Vm(uint8_t n_cpus) {
 void vm::Vm::set_irq(uint8_t irq, bool level) {
     for(auto& listener : irq_listeners)
         listener->irq_set(irq, level);
-}
\ No newline at end of file
+}
+
+void vm::Vm::send_msi(uint64_t address, uint32_t data) {
+    if((address & 0xFFF0'0000) != 0xFEE0'0000) {
+        print("vm: MSI to non-LAPIC address {:#x}\n", address);
+        return;
+    }
+
+    auto dest = (address >> 12) & 0xFF;
+    auto delivery_mode = (data >> 8) & 0x7;
+    auto vector = data & 0xFF;
+
+    if(delivery_mode != 0 && delivery_mode != 1) { // Only Fixed and Lowest Priority are supported
+        print("vm: Unsupported MSI delivery mode {}\n", delivery_mode);
+        return;
+    }
+
+    // Physical destination mode only, Lowest Priority just goes to the named CPU
+    for(auto& cpu : cpus) {
+        if(cpu.id == dest) {
+            cpu.inject_irq(vector);
+            return;
+        }
+    }
+
+    print("vm: MSI to unknown APIC ID {}\n", dest);
+}
+
+void vm::Vm::add_ram(uintptr_t gpa, size_t size) {
+    ram.push_back({gpa, size});
+}
+
+bool vm::Vm::is_ram(uintptr_t gpa) const {
+    for(const auto& [base, size] : ram)
+        if(gpa >= base && gpa < (base + size))
+            return true;
+
+    return false;
+}
+
+bool vm::Vm::discard_page(uintptr_t gpa) {
+    gpa &= ~(pmm::block_size - 1);
+    if(ram_pinned || !is_ram(gpa) || discarded_pages.contains(gpa))
+        return false;
+
+    auto hpa = mm->unmap(gpa);
+    if(!hpa)
+        return false;
+
+    pmm::free_block(hpa);
+
+    discarded_pages[gpa] = true;
+    n_discarded_pages++;
+    return true;
+}
+
+bool vm::Vm::populate_page(uintptr_t gpa) {
+    gpa &= ~(pmm::block_size - 1);
+    if(n_discarded_pages == 0 || !discarded_pages.erase(gpa))
+        return false;
+
+    auto hpa = pmm::alloc_block();
+    ASSERT(hpa);
+
+    memset((uint8_t*)(hpa + phys_mem_map), 0, pmm::block_size);
+    mm->map(hpa, gpa, paging::mapPagePresent | paging::mapPageWrite | paging::mapPageExecute);
+
+    n_discarded_pages--;
+    return true;
+}
+
+uintptr_t vm::Vm::get_phys(uintptr_t gpa) {
+    populate_page(gpa);
+
+    return mm->get_phys(gpa);
+}
+
+vm::DirtyLog* vm::Vm::start_dirty_log(uintptr_t gpa, size_t size) {
+    ASSERT((gpa % pmm::block_size) == 0);
+
+    auto* log = new DirtyLog{.base = gpa, .n_pages = div_ceil(size, pmm::block_size), .bitmap = {}};
+    log->bitmap.resize(div_ceil(log->n_pages, 64));
+
+    for(size_t i = 0; i < log->n_pages; i++)
+        mm->protect(gpa + i * pmm::block_size, paging::mapPagePresent);
+
+    dirty_logs.push_back(log);
+    return log;
+}
+
+void vm::Vm::stop_dirty_log(DirtyLog* log) {
+    for(auto it = dirty_logs.begin(); it != dirty_logs.end(); ++it) {
+        if(*it == log) {
+            dirty_logs.erase(it);
+            break;
+        }
+    }
+
+    for(size_t i = 0; i < log->n_pages; i++)
+        mm->protect(log->base + i * pmm::block_size, paging::mapPagePresent | paging::mapPageWrite);
+
+    delete log;
+}
+
+bool vm::Vm::collect_dirty_log(DirtyLog& log, std::vector<uint64_t>& dirty) {
+    dirty.resize(log.bitmap.size());
+
+    bool any = false;
+    for(size_t i = 0; i < log.bitmap.size(); i++) {
+        dirty[i] = log.bitmap[i];
+        log.bitmap[i] = 0;
+
+        // Only pages that were written have lost their protection
+        for(auto bits = dirty[i]; bits; bits &= bits - 1) {
+            auto page = i * 64 + __builtin_ctzll(bits);
+            mm->protect(log.base + page * pmm::block_size, paging::mapPagePresent);
+            any = true;
+        }
+    }
+
+    return any;
+}
+
+bool vm::Vm::handle_dirty_write(uintptr_t gpa) {
+    for(auto* log : dirty_logs) {
+        if(gpa < log->base || gpa >= (log->base + log->n_pages * pmm::block_size))
+            continue;
+
+        auto page = (gpa - log->base) / pmm::block_size;
+        log->bitmap[page / 64] |= (1ull << (page % 64));
+
+        mm->protect(log->base + page * pmm::block_size, paging::mapPagePresent | paging::mapPageWrite);
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,139 @@
+#include <Luna/vmm/vswitch.hpp>
+#include <Luna/vmm/vm.hpp>
+#include <Luna/net/eth.hpp>
+
+#include <Luna/misc/log.hpp>
+
+// The uplink sends from its IRQ handler, so the locks are only ever taken with interrupts disabled, otherwise that IRQ could spin on a lock held by the code it interrupted
+// Frames from the uplink are never sent back to it, so the IRQ handler never needs the NIC's TX lock
+struct IrqGuard {
+    IrqGuard() { asm volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory"); }
+    ~IrqGuard() {
+        if(rflags & (1 << 9))
+            asm volatile("sti" : : : "memory");
+    }
+
+    uint64_t rflags;
+};
+
+vm::vswitch::Frame* vm::vswitch::Port::front() {
+    IrqGuard irq_guard{};
+    std::lock_guard guard{lock};
+
+    return (head != tail) ? &inbox[head] : nullptr;
+}
+
+void vm::vswitch::Port::pop() {
+    IrqGuard irq_guard{};
+    std::lock_guard guard{lock};
+
+    if(head != tail)
+        head = (head + 1) % inbox_size;
+}
+
+bool vm::vswitch::Port::push(std::span<uint8_t> frame) {
+    IrqGuard irq_guard{};
+    std::lock_guard guard{lock};
+
+    auto next = (tail + 1) % inbox_size;
+    if(next == head)
+        return false; // Full, drop it like a real switch would
+
+    inbox[tail].len = frame.size();
+    memcpy(inbox[tail].data, frame.data(), frame.size());
+    tail = next;
+
+    if(owner)
+        owner->kick(); // IRQ safe, the owner drains the inbox from its kick handler
+    return true;
+}
+
+vm::vswitch::Port* vm::vswitch::Switch::add_port(VCPU* owner) {
+    IrqGuard irq_guard{};
+    std::lock_guard guard{lock};
+    ASSERT(n_ports < max_ports);
+
+    auto* port = new Port{};
+    port->owner = owner;
+    ports[n_ports++] = port;
+    return port;
+}
+
+void vm::vswitch::Switch::attach_uplink(net::Nic* nic) {
+    {
+        IrqGuard irq_guard{};
+        std::lock_guard guard{lock};
+        uplink = nic;
+    }
+
+    // Guests have their own MACs, so the host NIC has to accept everything
+    nic->rx_userptr = this;
+    nic->rx_handler = [](void* userptr, std::span<uint8_t> frame) { ((Switch*)userptr)->send(nullptr, frame); };
+    nic->set_promiscuous(true);
+
+    print("vswitch: Uplink attached, MAC {}\n", nic->get_mac());
+}
+
+void vm::vswitch::Switch::send(Port* from, std::span<uint8_t> frame) {
+    if(frame.size() < sizeof(net::eth::Header) || frame.size() > max_frame_size)
+        return;
+
+    const auto& header = *(net::eth::Header*)frame.data();
+    net::Mac dst{}, src{};
+    memcpy(dst.data, header.dst_mac, 6);
+    memcpy(src.data, header.src_mac, 6);
+
+    IrqGuard irq_guard{};
+    std::lock_guard guard{lock};
+    learn(src, from);
+
+    // Known unicast goes to a single port, everything else is flooded
+    Port* to = nullptr;
+    if(!(dst.data[0] & 1) && lookup(dst, to)) {
+        if(to == from)
+            return;
+
+        if(to)
+            to->push(frame);
+        else if(uplink)
+            uplink->send_frame(frame);
+        return;
+    }
+
+    for(size_t i = 0; i < n_ports; i++)
+        if(ports[i] != from)
+            ports[i]->push(frame);
+
+    if(from && uplink)
+        uplink->send_frame(frame);
+}
+
+void vm::vswitch::Switch::learn(const net::Mac& mac, Port* port) {
+    if(mac.data[0] & 1)
+        return; // Multicast sources are bogus
+
+    for(size_t i = 0; i < n_macs; i++) {
+        if(mac_table[i].mac == mac) {
+            mac_table[i].port = port; // Might have moved
+            return;
+        }
+    }
+
+    if(n_macs < mac_table_size) {
+        mac_table[n_macs++] = {.mac = mac, .port = port};
+    } else {
+        mac_table[next_evict] = {.mac = mac, .port = port};
+        next_evict = (next_evict + 1) % mac_table_size;
+    }
+}
+
+bool vm::vswitch::Switch::lookup(const net::Mac& mac, Port*& port) {
+    for(size_t i = 0; i < n_macs; i++) {
+        if(mac_table[i].mac == mac) {
+            port = mac_table[i].port;
+            return true;
+        }
+    }
+
+    return false;
+}
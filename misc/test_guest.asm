@@ -1,6 +1,33 @@
 bits 16
+org 0x7C00
 
+; Luna hypercall ABI, see kernel/include/Luna/vmm/hypercall.hpp
+LUNA_SIG equ 0x616E754C
+LUNA_FEATURE_HYPERCALLS equ (1 << 2)
 
+LUNA_NOP equ 0x4C550000
+LUNA_SETUP_RING equ 0x4C550001
+LUNA_NOTIFY equ 0x4C550002
+
+OP_CONSOLE_WRITE equ 1
+OP_GET_TIME equ 2
+
+RING equ 0x1000
+N_ENTRIES equ 16
+SQ equ RING + 64
+CQ equ SQ + (N_ENTRIES * 48)
+RING_SIZE equ 64 + (N_ENTRIES * (48 + 16))
+
+SQ_TAIL equ RING + 4
+CQ_HEAD equ RING + 8
+CQ_TAIL equ RING + 12
+
+start:
+xor ax, ax
+mov ds, ax
+mov es, ax
+mov ss, ax
+mov sp, 0x7C00
 
 mov al, ':'
 mov ah, 0xE
@@ -22,11 +49,132 @@ out dx, al
 mov al, 10
 out dx, al
 
+; Make sure we're running on Luna with hypercall support
+mov eax, 0x40000000
+cpuid
+cmp ebx, LUNA_SIG
+jne exit
+
+mov eax, 0x40000001
+cpuid
+test al, LUNA_FEATURE_HYPERCALLS
+jz exit
+
+; Use the native instruction for this vendor, the other one is emulated through a #UD exit
+xor eax, eax
+cpuid
+cmp ebx, 0x756E6547 ; "Genu"
+jne .amd
+mov byte [hypercall.insn + 2], 0xC1 ; VMCALL
+.amd:
+
+mov di, RING
+mov cx, RING_SIZE / 2
+xor ax, ax
+rep stosw
+
+mov eax, LUNA_SETUP_RING
+mov ebx, RING
+mov ecx, N_ENTRIES
+call hypercall
+
+; Benchmark 1: N_ENTRIES Nop hypercalls, one exit each
+rdtsc
+mov [start_tsc], eax
+
+mov cx, N_ENTRIES
+.nop_loop:
+mov eax, LUNA_NOP
+call hypercall
+loop .nop_loop
+
+rdtsc
+sub eax, [start_tsc]
+mov di, single_val
+call hex32
 
+; Benchmark 2: N_ENTRIES Nop requests through the ring, a single exit, the SQ is zeroed so all requests are already Nops
+rdtsc
+mov [start_tsc], eax
 
+add dword [SQ_TAIL], N_ENTRIES
+mov eax, LUNA_NOTIFY
+call hypercall
+
+rdtsc
+sub eax, [start_tsc]
+mov di, batch_val
+call hex32
+
+mov eax, [CQ_TAIL]
+mov [CQ_HEAD], eax ; Consume all completions
+
+; Query the time, SQ and CQ have wrapped around so this is entry 0
+mov word [SQ], OP_GET_TIME
+inc dword [SQ_TAIL]
+mov eax, LUNA_NOTIFY
+call hypercall
+
+mov eax, [CQ + 8] ; Low 32bits of the result
+mov di, time_val
+call hex32
+inc dword [CQ_HEAD]
+
+; Print all results in a single batch
+mov di, SQ + 48
+mov bx, single_msg
+mov dx, 3
+.print_loop:
+mov word [di], OP_CONSOLE_WRITE
+mov [di + 16], bx ; args[0] = GPA of buffer, upper bits are still zero
+mov word [di + 24], msg_len ; args[1] = Length
+add bx, msg_len
+add di, 48
+dec dx
+jnz .print_loop
+
+add dword [SQ_TAIL], 3
+mov eax, LUNA_NOTIFY
+call hypercall
+
+exit:
+xor eax, eax ; Not a Luna hypercall, so it causes a VM exit
+call hypercall
+jmp $
+
+hypercall:
+.insn:
 vmmcall
+ret
+
+; Convert EAX to 8 hex digits at DI
+hex32:
+mov cx, 8
+.loop:
+rol eax, 4
+mov bl, al
+and bl, 0xF
+add bl, '0'
+cmp bl, '9'
+jbe .store
+add bl, 'A' - '0' - 10
+.store:
+mov [di], bl
+inc di
+loop .loop
+ret
+
+start_tsc: dd 0
+
+single_msg: db "vmcall x16: 0x"
+single_val: db "00000000 cycles", 10
+msg_len equ $ - single_msg
+batch_msg: db "ring x16:   0x"
+batch_val: db "00000000 cycles", 10
+time_msg: db "guest time: 0x"
+time_val: db "00000000 ns    ", 10
 
 times 510-($-$$) db 0
 dw 0xAA55
 
-times (512 * 1024 / 8) dq 0
\ No newline at end of file
+times (512 * 1024 / 8) dq 0